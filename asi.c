@@ -75,6 +75,8 @@ static bool b_sync = false;
  * Local prototypes
  *****************************************************************************/
 static void asi_Read(struct ev_loop *loop, struct ev_io *w, int revents);
+static block_t *asi_Handle( block_t *p_ts, ssize_t i_len,
+                            const uint8_t *p_header );
 static void asi_MuteCb(struct ev_loop *loop, struct ev_timer *w, int revents);
 
 /*****************************************************************************
@@ -179,8 +181,13 @@ void asi_Open( void )
 
     fsync( i_handle );
 
-    ev_io_init(&asi_watcher, asi_Read, i_handle, EV_READ);
-    ev_io_start(event_loop, &asi_watcher);
+    if ( i_input_ring )
+        input_Start( i_handle, i_bufsize / TS_SIZE, 0, asi_Handle );
+    else
+    {
+        ev_io_init(&asi_watcher, asi_Read, i_handle, EV_READ);
+        ev_io_start(event_loop, &asi_watcher);
+    }
 
     ev_timer_init(&mute_watcher, asi_MuteCb,
                   ASI_LOCK_TIMEOUT / 1000000., ASI_LOCK_TIMEOUT / 1000000.);
@@ -191,27 +198,10 @@ void asi_Open( void )
  *****************************************************************************/
 static void asi_Read(struct ev_loop *loop, struct ev_io *w, int revents)
 {
-    unsigned int i_val;
-
-    if ( ioctl(i_handle, ASI_IOC_RXGETEVENTS, &i_val) == 0 )
-    {
-        if ( i_val & ASI_EVENT_RX_BUFFER )
-            msg_Warn( NULL, "driver receive buffer queue overrun" );
-        if ( i_val & ASI_EVENT_RX_FIFO )
-            msg_Warn( NULL, "onboard receive FIFO overrun" );
-        if ( i_val & ASI_EVENT_RX_CARRIER )
-            msg_Warn( NULL, "carrier status change" );
-        if ( i_val & ASI_EVENT_RX_LOS )
-            msg_Warn( NULL, "loss of packet synchronization" );
-        if ( i_val & ASI_EVENT_RX_AOS )
-            msg_Warn( NULL, "acquisition of packet synchronization" );
-        if ( i_val & ASI_EVENT_RX_DATA )
-            msg_Warn( NULL, "receive data status change" );
-    }
-
     struct iovec p_iov[i_bufsize / TS_SIZE];
     block_t *p_ts, **pp_current = &p_ts;
-    int i, i_len;
+    int i;
+    ssize_t i_len;
 
     for ( i = 0; i < i_bufsize / TS_SIZE; i++ )
     {
@@ -221,7 +211,20 @@ static void asi_Read(struct ev_loop *loop, struct ev_io *w, int revents)
         pp_current = &(*pp_current)->p_next;
     }
 
-    if ( (i_len = readv(i_handle, p_iov, i_bufsize / TS_SIZE)) < 0 )
+    i_len = readv(i_handle, p_iov, i_bufsize / TS_SIZE);
+    block_DeleteChain( asi_Handle( p_ts, i_len, NULL ) );
+}
+
+/*****************************************************************************
+ * asi_Handle: passes the i_len bytes read to the demux, returns unused blocks
+ *****************************************************************************/
+static block_t *asi_Handle( block_t *p_ts, ssize_t i_len,
+                            const uint8_t *p_header )
+{
+    block_t *p_unused, **pp_current;
+    unsigned int i_val;
+
+    if ( i_len < 0 )
     {
         msg_Err( NULL, "couldn't read from device " ASI_DEVICE " (%s)",
                  i_asi_adapter, strerror(errno) );
@@ -229,6 +232,22 @@ static void asi_Read(struct ev_loop *loop, struct ev_io *w, int revents)
     }
     i_len /= TS_SIZE;
 
+    if ( ioctl(i_handle, ASI_IOC_RXGETEVENTS, &i_val) == 0 )
+    {
+        if ( i_val & ASI_EVENT_RX_BUFFER )
+            msg_Warn( NULL, "driver receive buffer queue overrun" );
+        if ( i_val & ASI_EVENT_RX_FIFO )
+            msg_Warn( NULL, "onboard receive FIFO overrun" );
+        if ( i_val & ASI_EVENT_RX_CARRIER )
+            msg_Warn( NULL, "carrier status change" );
+        if ( i_val & ASI_EVENT_RX_LOS )
+            msg_Warn( NULL, "loss of packet synchronization" );
+        if ( i_val & ASI_EVENT_RX_AOS )
+            msg_Warn( NULL, "acquisition of packet synchronization" );
+        if ( i_val & ASI_EVENT_RX_DATA )
+            msg_Warn( NULL, "receive data status change" );
+    }
+
     if ( i_len )
     {
         if ( !b_sync )
@@ -248,7 +267,7 @@ static void asi_Read(struct ev_loop *loop, struct ev_io *w, int revents)
             b_sync = true;
         }
 
-        ev_timer_again(loop, &mute_watcher);
+        ev_timer_again(event_loop, &mute_watcher);
     }
 
     pp_current = &p_ts;
@@ -260,10 +279,11 @@ static void asi_Read(struct ev_loop *loop, struct ev_io *w, int revents)
 
     if ( *pp_current )
         msg_Dbg( NULL, "partial buffer received" );
-    block_DeleteChain( *pp_current );
+    p_unused = *pp_current;
     *pp_current = NULL;
 
     demux_Run( p_ts );
+    return p_unused;
 }
 
 static void asi_MuteCb(struct ev_loop *loop, struct ev_timer *w, int revents)
@@ -0,0 +1,606 @@
+/*****************************************************************************
+ * bench.c: throughput benchmark of the demux and output pipeline
+ *****************************************************************************
+ * Copyright (C) 2016 VideoLAN
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*
+ * The benchmark is linked against the regular DVBlast objects (dvblast.c is
+ * built with its main() renamed). It acts as the input: it synthesizes an
+ * MPTS in memory, hands it to demux_Run() by chunks while forcing mdate() to
+ * the stream clock, and calls outputs_Run() after each chunk. The outputs
+ * are read from a generated configuration file, and their sockets are
+ * connected to a local UDP sink once they are created.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ev.h>
+
+#include <bitstream/common.h>
+#include <bitstream/mpeg/ts.h>
+#include <bitstream/mpeg/psi.h>
+#include <bitstream/dvb/si.h>
+
+#include "dvblast.h"
+
+/*****************************************************************************
+ * Local declarations
+ *****************************************************************************/
+#define BENCH_READ_ONCE 64 /* packets per demux_Run() */
+#define BENCH_FIRST_PMT_PID 32
+#define BENCH_PAT_PROGRAMS 200 /* per section */
+#define BENCH_SDT_SERVICES 150 /* per section */
+#define BENCH_PCR_PERIOD 40000 /* 40 ms */
+#define BENCH_TSID 1
+#define BENCH_ONID 1
+
+static int i_nb_services = 10;
+static int i_nb_es = 3;
+static int i_nb_bench_outputs = 1;
+static uint64_t i_nb_packets = 1000000;
+static uint64_t i_bitrate = 40000000;
+static mtime_t i_psi_period = 100000;
+static mtime_t i_eit_period = 500000;
+static unsigned int i_cc_error = 0;
+
+typedef struct bench_table_t
+{
+    uint16_t i_pid;
+    uint8_t **pp_sections;
+    int i_nb_sections;
+    mtime_t i_period;
+    mtime_t i_next;
+} bench_table_t;
+
+static bench_table_t *p_tables = NULL;
+static int i_nb_tables = 0;
+static uint8_t pi_cc[MAX_PIDS];
+
+/* PSI packets waiting to be multiplexed */
+static uint8_t (*p_psi_queue)[TS_SIZE] = NULL;
+static int i_psi_queue_size = 0, i_psi_queue_start = 0, i_psi_queue_end = 0;
+
+static int i_next_es = 0;
+static mtime_t *pi_next_pcr;
+
+/*****************************************************************************
+ * Input callbacks: the benchmark feeds the demux itself
+ *****************************************************************************/
+static void bench_Open( void )
+{
+}
+
+static void bench_Reset( void )
+{
+}
+
+static int bench_SetFilter( uint16_t i_pid )
+{
+    return -1;
+}
+
+static void bench_UnsetFilter( int i_fd, uint16_t i_pid )
+{
+}
+
+/*****************************************************************************
+ * BenchClock: real time in ns, mdate() follows the stream
+ *****************************************************************************/
+static uint64_t BenchClock( void )
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*****************************************************************************
+ * PIDs of the synthesized services
+ *****************************************************************************/
+static uint16_t BenchPMTPID( int i_service )
+{
+    return BENCH_FIRST_PMT_PID + i_service;
+}
+
+static uint16_t BenchESPID( int i_service, int i_es )
+{
+    return BENCH_FIRST_PMT_PID + i_nb_services + i_service * i_nb_es + i_es;
+}
+
+/*****************************************************************************
+ * BenchAddTable
+ *****************************************************************************/
+static bench_table_t *BenchAddTable( uint16_t i_pid, int i_nb_sections,
+                                     mtime_t i_period )
+{
+    bench_table_t *p_table;
+
+    p_tables = realloc( p_tables, (i_nb_tables + 1) * sizeof(bench_table_t) );
+    p_table = &p_tables[i_nb_tables++];
+    p_table->i_pid = i_pid;
+    p_table->pp_sections = calloc( i_nb_sections, sizeof(uint8_t *) );
+    p_table->i_nb_sections = i_nb_sections;
+    p_table->i_period = i_period;
+    p_table->i_next = 0;
+    return p_table;
+}
+
+/*****************************************************************************
+ * BenchBuildPAT
+ *****************************************************************************/
+static void BenchBuildPAT( void )
+{
+    int i_nb_sections = (i_nb_services + BENCH_PAT_PROGRAMS - 1)
+                         / BENCH_PAT_PROGRAMS;
+    bench_table_t *p_table = BenchAddTable( PAT_PID, i_nb_sections,
+                                            i_psi_period );
+    int i, j;
+
+    for ( i = 0; i < i_nb_sections; i++ )
+    {
+        uint8_t *p_section = p_table->pp_sections[i] = psi_allocate();
+        uint8_t *p;
+        int k = 0;
+
+        pat_init( p_section );
+        psi_set_length( p_section, PSI_MAX_SIZE );
+        pat_set_tsid( p_section, BENCH_TSID );
+        psi_set_version( p_section, 0 );
+        psi_set_current( p_section );
+        psi_set_section( p_section, i );
+        psi_set_lastsection( p_section, i_nb_sections - 1 );
+
+        for ( j = i * BENCH_PAT_PROGRAMS;
+              j < i_nb_services && k < BENCH_PAT_PROGRAMS; j++ )
+        {
+            p = pat_get_program( p_section, k++ );
+            patn_init( p );
+            patn_set_program( p, j + 1 );
+            patn_set_pid( p, BenchPMTPID( j ) );
+        }
+
+        p = pat_get_program( p_section, k );
+        pat_set_length( p_section, p - p_section - PAT_HEADER_SIZE );
+        psi_set_crc( p_section );
+    }
+}
+
+/*****************************************************************************
+ * BenchBuildPMT
+ *****************************************************************************/
+static void BenchBuildPMT( int i_service )
+{
+    bench_table_t *p_table = BenchAddTable( BenchPMTPID( i_service ), 1,
+                                            i_psi_period );
+    uint8_t *p_section = p_table->pp_sections[0] = psi_allocate();
+    uint8_t *p_es;
+    int i;
+
+    pmt_init( p_section );
+    psi_set_length( p_section, PSI_MAX_SIZE );
+    pmt_set_program( p_section, i_service + 1 );
+    psi_set_version( p_section, 0 );
+    psi_set_current( p_section );
+    pmt_set_desclength( p_section, 0 );
+    pmt_set_pcrpid( p_section, BenchESPID( i_service, 0 ) );
+
+    for ( i = 0; i < i_nb_es; i++ )
+    {
+        p_es = pmt_get_es( p_section, i );
+        pmtn_init( p_es );
+        /* One video and then audio streams */
+        pmtn_set_streamtype( p_es, i ? 0x04 : 0x1b );
+        pmtn_set_pid( p_es, BenchESPID( i_service, i ) );
+        pmtn_set_desclength( p_es, 0 );
+    }
+
+    p_es = pmt_get_es( p_section, i );
+    pmt_set_length( p_section, p_es - p_section - PMT_HEADER_SIZE );
+    psi_set_crc( p_section );
+}
+
+/*****************************************************************************
+ * BenchBuildSDT
+ *****************************************************************************/
+static void BenchBuildSDT( void )
+{
+    int i_nb_sections = (i_nb_services + BENCH_SDT_SERVICES - 1)
+                         / BENCH_SDT_SERVICES;
+    bench_table_t *p_table = BenchAddTable( SDT_PID, i_nb_sections,
+                                            i_psi_period );
+    int i, j;
+
+    for ( i = 0; i < i_nb_sections; i++ )
+    {
+        uint8_t *p_section = p_table->pp_sections[i] = psi_allocate();
+        uint8_t *p;
+        int k = 0;
+
+        sdt_init( p_section, true );
+        sdt_set_length( p_section, PSI_MAX_SIZE );
+        sdt_set_tsid( p_section, BENCH_TSID );
+        sdt_set_onid( p_section, BENCH_ONID );
+        psi_set_version( p_section, 0 );
+        psi_set_current( p_section );
+        psi_set_section( p_section, i );
+        psi_set_lastsection( p_section, i_nb_sections - 1 );
+
+        for ( j = i * BENCH_SDT_SERVICES;
+              j < i_nb_services && k < BENCH_SDT_SERVICES; j++ )
+        {
+            p = sdt_get_service( p_section, k++ );
+            sdtn_init( p );
+            sdtn_set_sid( p, j + 1 );
+            sdtn_set_eitpresent( p );
+            sdtn_set_running( p, 4 );
+            sdtn_set_desclength( p, 0 );
+        }
+
+        p = sdt_get_service( p_section, k );
+        sdt_set_length( p_section, p - p_section - SDT_HEADER_SIZE );
+        psi_set_crc( p_section );
+    }
+}
+
+/*****************************************************************************
+ * BenchBuildEIT: present/following of one service, one event per section
+ *****************************************************************************/
+static void BenchBuildEIT( int i_service )
+{
+    bench_table_t *p_table = BenchAddTable( EIT_PID, 2, i_eit_period );
+    int i;
+
+    for ( i = 0; i < 2; i++ )
+    {
+        uint8_t *p_section = p_table->pp_sections[i] = psi_allocate();
+        uint8_t *p_event;
+
+        eit_init( p_section, true );
+        psi_set_length( p_section, PSI_MAX_SIZE );
+        eit_set_sid( p_section, i_service + 1 );
+        eit_set_tsid( p_section, BENCH_TSID );
+        eit_set_onid( p_section, BENCH_ONID );
+        psi_set_version( p_section, 0 );
+        psi_set_current( p_section );
+        psi_set_section( p_section, i );
+        psi_set_lastsection( p_section, 1 );
+        eit_set_segment_last_sec_number( p_section, 1 );
+        eit_set_last_table_id( p_section, EIT_TABLE_ID_PF_ACTUAL );
+
+        p_event = eit_get_event( p_section, 0 );
+        eitn_set_event_id( p_event, i_service * 2 + i );
+        eitn_set_start_time( p_event, 0 );
+        eitn_set_duration_bcd( p_event, 0x010000 ); /* 1 h */
+        eitn_set_running( p_event, i ? 1 : 4 );
+        eitn_set_ca( p_event, false );
+        eitn_set_desclength( p_event, 0 );
+
+        p_event = eit_get_event( p_section, 1 );
+        eit_set_length( p_section, p_event - p_section - EIT_HEADER_SIZE );
+        psi_set_crc( p_section );
+    }
+}
+
+/*****************************************************************************
+ * BenchQueueTable: splits the sections of a table into the PSI queue
+ *****************************************************************************/
+static void BenchQueueTable( bench_table_t *p_table )
+{
+    int i;
+
+    for ( i = 0; i < p_table->i_nb_sections; i++ )
+    {
+        uint8_t *p_section = p_table->pp_sections[i];
+        uint16_t i_section_length = psi_get_length( p_section )
+                                     + PSI_HEADER_SIZE;
+        uint16_t i_section_offset = 0;
+
+        do
+        {
+            uint8_t i_ts_offset = 0;
+            uint8_t *p;
+
+            if ( i_psi_queue_end == i_psi_queue_size )
+            {
+                i_psi_queue_size = i_psi_queue_size ? i_psi_queue_size * 2
+                                                    : 64;
+                p_psi_queue = realloc( p_psi_queue,
+                                       i_psi_queue_size * TS_SIZE );
+            }
+            p = p_psi_queue[i_psi_queue_end++];
+
+            psi_split_section( p, &i_ts_offset, p_section,
+                               &i_section_offset );
+            ts_set_pid( p, p_table->i_pid );
+            ts_set_cc( p, pi_cc[p_table->i_pid] );
+            pi_cc[p_table->i_pid] = (pi_cc[p_table->i_pid] + 1) & 0xf;
+            if ( i_section_offset == i_section_length )
+                psi_split_end( p, &i_ts_offset );
+        }
+        while ( i_section_offset < i_section_length );
+    }
+}
+
+/*****************************************************************************
+ * BenchFill: synthesizes the packet sent at i_date
+ *****************************************************************************/
+static void BenchFill( uint8_t *p_ts, mtime_t i_date, int64_t i_clock )
+{
+    int i_service, i_es;
+    uint16_t i_pid;
+    int i;
+
+    for ( i = 0; i < i_nb_tables; i++ )
+    {
+        if ( p_tables[i].i_next <= i_date )
+        {
+            BenchQueueTable( &p_tables[i] );
+            p_tables[i].i_next = i_date + p_tables[i].i_period;
+        }
+    }
+
+    if ( i_psi_queue_start < i_psi_queue_end )
+    {
+        memcpy( p_ts, p_psi_queue[i_psi_queue_start++], TS_SIZE );
+        if ( i_psi_queue_start == i_psi_queue_end )
+            i_psi_queue_start = i_psi_queue_end = 0;
+        return;
+    }
+
+    i_service = i_next_es / i_nb_es;
+    i_es = i_next_es % i_nb_es;
+    i_next_es = (i_next_es + 1) % (i_nb_services * i_nb_es);
+    i_pid = BenchESPID( i_service, i_es );
+
+    ts_init( p_ts );
+    ts_set_pid( p_ts, i_pid );
+    ts_set_payload( p_ts );
+    if ( i_cc_error && !(rand() % i_cc_error) )
+        pi_cc[i_pid]++;
+    ts_set_cc( p_ts, pi_cc[i_pid] );
+    pi_cc[i_pid] = (pi_cc[i_pid] + 1) & 0xf;
+
+    if ( !i_es && pi_next_pcr[i_service] <= i_date )
+    {
+        ts_set_adaptation( p_ts, 7 );
+        tsaf_set_pcr( p_ts, i_clock / 300 );
+        tsaf_set_pcrext( p_ts, i_clock % 300 );
+        pi_next_pcr[i_service] = i_date + BENCH_PCR_PERIOD;
+    }
+}
+
+/*****************************************************************************
+ * BenchOutputs: creates the outputs and connects them to a local UDP sink,
+ * which never reads them: the kernel drops the datagrams once its receive
+ * buffer is full, but the outputs still go through the real send path
+ *****************************************************************************/
+static int i_sink = -1;
+
+static void BenchOutputs( void )
+{
+    char psz_conf[] = "/tmp/dvblast-bench-XXXXXX";
+    struct sockaddr_in sink_addr;
+    socklen_t i_sink_len = sizeof(sink_addr);
+    FILE *p_file;
+    int i_fd, i;
+
+    if ( (i_fd = mkstemp( psz_conf )) < 0
+          || (p_file = fdopen( i_fd, "w" )) == NULL )
+    {
+        msg_Err( NULL, "couldn't create configuration file (%s)",
+                 strerror(errno) );
+        exit(EXIT_FAILURE);
+    }
+    for ( i = 0; i < i_nb_bench_outputs; i++ )
+        fprintf( p_file, "127.0.0.1:%d/dvb 1 %d\n", 1024 + i,
+                 i % i_nb_services + 1 );
+    fclose( p_file );
+
+    psz_conf_file = psz_conf;
+    config_ReadFile();
+    psz_conf_file = NULL;
+    unlink( psz_conf );
+
+    memset( &sink_addr, 0, sizeof(sink_addr) );
+    sink_addr.sin_family = AF_INET;
+    sink_addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    if ( (i_sink = socket( AF_INET, SOCK_DGRAM, IPPROTO_UDP )) < 0
+          || bind( i_sink, (struct sockaddr *)&sink_addr,
+                   sizeof(sink_addr) ) < 0
+          || getsockname( i_sink, (struct sockaddr *)&sink_addr,
+                          &i_sink_len ) < 0 )
+    {
+        msg_Err( NULL, "couldn't create the UDP sink (%s)", strerror(errno) );
+        exit(EXIT_FAILURE);
+    }
+
+    for ( i = 0; i < i_nb_outputs; i++ )
+        if ( connect( pp_outputs[i]->i_handle, (struct sockaddr *)&sink_addr,
+                      sizeof(sink_addr) ) < 0 )
+        {
+            msg_Err( NULL, "couldn't connect to the UDP sink (%s)",
+                     strerror(errno) );
+            exit(EXIT_FAILURE);
+        }
+}
+
+/*****************************************************************************
+ * usage
+ *****************************************************************************/
+static void bench_usage( void )
+{
+    msg_Raw( NULL, "Usage: dvblast_bench [-s <services>] [-e <ES per service>] [-o <outputs>] [-n <packets>] [-b <bitrate>] [-p <PSI period>] [-E <EIT period>] [-c <CC error rate>] [-v]" );
+    msg_Raw( NULL, "  -s   number of services in the MPTS (default: %d)", i_nb_services );
+    msg_Raw( NULL, "  -e   number of elementary streams per service (default: %d)", i_nb_es );
+    msg_Raw( NULL, "  -o   number of outputs, each one carrying a service (default: %d)", i_nb_bench_outputs );
+    msg_Raw( NULL, "  -n   number of packets to push (default: %"PRIu64")", i_nb_packets );
+    msg_Raw( NULL, "  -b   bitrate of the MPTS in bi/s (default: %"PRIu64")", i_bitrate );
+    msg_Raw( NULL, "  -p   repetition period of the PAT, PMTs and SDT in ms (default: %"PRId64")", i_psi_period / 1000 );
+    msg_Raw( NULL, "  -E   repetition period of the EIT p/f of each service in ms (default: %"PRId64")", i_eit_period / 1000 );
+    msg_Raw( NULL, "  -c   introduce a CC error every <n> ES packets on average (default: none)" );
+    msg_Raw( NULL, "  -v   be more verbose (repeat for more)" );
+    exit(EXIT_FAILURE);
+}
+
+/*****************************************************************************
+ * main
+ *****************************************************************************/
+int main( int i_argc, char **pp_argv )
+{
+    uint64_t i_gen_time = 0, i_demux_time = 0, i_send_time = 0, i_start;
+    uint64_t i_packet;
+    int64_t i_clock = 0, i_packet_duration;
+    mtime_t i_date, i_next;
+    block_stats_t stats;
+    struct rusage usage;
+    struct rlimit limit;
+    int c, i;
+
+    i_verbose = 1;
+
+    while ( (c = getopt( i_argc, pp_argv, "s:e:o:n:b:p:E:c:vh" )) != -1 )
+    {
+        switch ( c )
+        {
+        case 's': i_nb_services = strtol( optarg, NULL, 0 ); break;
+        case 'e': i_nb_es = strtol( optarg, NULL, 0 ); break;
+        case 'o': i_nb_bench_outputs = strtol( optarg, NULL, 0 ); break;
+        case 'n': i_nb_packets = strtoull( optarg, NULL, 0 ); break;
+        case 'b': i_bitrate = strtoull( optarg, NULL, 0 ); break;
+        case 'p': i_psi_period = strtoll( optarg, NULL, 0 ) * 1000; break;
+        case 'E': i_eit_period = strtoll( optarg, NULL, 0 ) * 1000; break;
+        case 'c': i_cc_error = strtoul( optarg, NULL, 0 ); break;
+        case 'v': i_verbose++; break;
+        default: bench_usage();
+        }
+    }
+
+    if ( optind < i_argc || i_nb_services <= 0 || i_nb_es <= 0
+          || i_nb_es > 100 || i_nb_bench_outputs < 0 || !i_bitrate || i_psi_period <= 0
+          || i_eit_period <= 0
+          || BenchESPID( i_nb_services, 0 ) >= PADDING_PID )
+        bench_usage();
+
+    /* One socket per output */
+    if ( getrlimit( RLIMIT_NOFILE, &limit ) == 0 )
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit( RLIMIT_NOFILE, &limit );
+    }
+
+    if ( (event_loop = ev_default_loop(0)) == NULL )
+    {
+        msg_Err( NULL, "unable to initialize libev" );
+        exit(EXIT_FAILURE);
+    }
+
+    block_Init( DEFAULT_BLOCK_POOL, false, false );
+
+    /* 27 MHz ticks */
+    i_packet_duration = INT64_C(27000000) * TS_SIZE * 8 / i_bitrate;
+    i_date = mdate();
+    mdate_Force( i_date );
+
+    pf_Open = bench_Open;
+    pf_Reset = bench_Reset;
+    pf_SetFilter = bench_SetFilter;
+    pf_UnsetFilter = bench_UnsetFilter;
+    demux_Open();
+    outputs_Init();
+    BenchOutputs();
+
+    BenchBuildPAT();
+    BenchBuildSDT();
+    pi_next_pcr = calloc( i_nb_services, sizeof(mtime_t) );
+    for ( i = 0; i < i_nb_services; i++ )
+    {
+        BenchBuildPMT( i );
+        BenchBuildEIT( i );
+    }
+
+    for ( i_packet = 0; i_packet < i_nb_packets; )
+    {
+        block_t *p_ts = NULL, **pp_current = &p_ts;
+
+        i_start = BenchClock();
+        for ( i = 0; i < BENCH_READ_ONCE && i_packet < i_nb_packets;
+              i++, i_packet++ )
+        {
+            *pp_current = block_New();
+            BenchFill( (*pp_current)->p_ts, i_date + i_clock / 27, i_clock );
+            pp_current = &(*pp_current)->p_next;
+            i_clock += i_packet_duration;
+        }
+        mdate_Force( i_date + i_clock / 27 );
+        i_gen_time += BenchClock() - i_start;
+
+        i_start = BenchClock();
+        demux_Run( p_ts );
+        i_demux_time += BenchClock() - i_start;
+
+        i_start = BenchClock();
+        outputs_Run();
+        i_send_time += BenchClock() - i_start;
+    }
+
+    /* Drain the outputs */
+    i_start = BenchClock();
+    while ( (i_next = outputs_Run()) != INT64_MAX )
+        mdate_Force( i_next );
+    i_send_time += BenchClock() - i_start;
+
+    block_GetStats( &stats );
+    getrusage( RUSAGE_SELF, &usage );
+
+    printf( "outputs=%d services=%d es=%d packets=%"PRIu64"\n",
+            i_nb_bench_outputs, i_nb_services, i_nb_es, i_nb_packets );
+    printf( "  throughput: %.0f packets/s (%.1f Mbi/s, %.1fx real time)\n",
+            i_nb_packets * 1e9 / (i_demux_time + i_send_time),
+            i_nb_packets * TS_SIZE * 8 * 1e3 / (i_demux_time + i_send_time),
+            (double)i_clock / 27 * 1e3 / (i_demux_time + i_send_time) );
+    printf( "  demux: %.1f ns/packet, send: %.1f ns/packet (synthesis: %.1f ns/packet)\n",
+            (double)i_demux_time / i_nb_packets,
+            (double)i_send_time / i_nb_packets,
+            (double)i_gen_time / i_nb_packets );
+    printf( "  blocks: %.2f allocations/packet, %.3f mallocs/packet, high-water %u\n",
+            (double)(stats.i_hits + stats.i_misses) / i_nb_packets,
+            (double)stats.i_misses / i_nb_packets, stats.i_highwater );
+    printf( "  peak RSS: %ld kB\n", usage.ru_maxrss );
+
+    demux_Close();
+    outputs_Close( i_nb_outputs );
+    close( i_sink );
+    block_Vacuum();
+
+    return EXIT_SUCCESS;
+}
@@ -29,6 +29,8 @@
 #define HAVE_DVB_SUPPORT
 #define HAVE_ASI_SUPPORT
 #define HAVE_CLOCK_NANOSLEEP
+#define HAVE_RECVMMSG
+#define HAVE_SENDMMSG
 #endif
 
 #define HAVE_ICONV
@@ -48,6 +50,9 @@
 #define DEFAULT_OUTPUT_LATENCY 200000 /* 200 ms */
 #define DEFAULT_MAX_RETENTION 40000 /* 40 ms */
 #define MAX_EIT_RETENTION 500000 /* 500 ms */
+#define DEFAULT_BLOCK_POOL 8192 /* 2 MB */
+#define DEFAULT_DVR_CHUNK_MAX (1024 * TS_SIZE)
+#define DEFAULT_FILE_BITRATE 38000000 /* bi/s, until the PCRs are known */
 #define DEFAULT_FRONTEND_TIMEOUT 30000000 /* 30 s */
 #define EXIT_STATUS_FRONTEND_TIMEOUT 100
 
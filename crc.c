@@ -0,0 +1,322 @@
+/*****************************************************************************
+ * crc.c: CRC32 of MPEG-2 sections
+ *****************************************************************************
+ * Copyright (C) 2016 VideoLAN
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*
+ * The MPEG-2 CRC32 (polynomial 0x04C11DB7, MSB first, no final XOR) is
+ * computed with 8 lookup tables, 8 bytes at a time. On x86-64 CPUs having
+ * PCLMULQDQ, long sections are folded 64 bytes at a time with carry-less
+ * multiplications; on ARMv8 built with the CRC extension, the CRC32
+ * instructions are used on bit-reversed data.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include <bitstream/mpeg/psi.h>
+
+#include "dvblast.h"
+
+/*****************************************************************************
+ * Local declarations
+ *****************************************************************************/
+#define CRC32_POLY 0x04c11db7
+
+static uint32_t pi_crc32_tables[8][256];
+/* x^(8 * 2^i) mod P, to skip zero bytes */
+static uint32_t pi_crc32_zeros[32];
+
+static uint32_t crc32_Resolve( uint32_t i_crc, const uint8_t *p, size_t i_len );
+static uint32_t (*pf_crc32)( uint32_t, const uint8_t *, size_t ) =
+    crc32_Resolve;
+
+/*****************************************************************************
+ * crc32_MulMod: a * b mod P
+ *****************************************************************************/
+static uint32_t crc32_MulMod( uint32_t a, uint32_t b )
+{
+    uint32_t i_result = 0;
+    int i;
+
+    for ( i = 31; i >= 0; i-- )
+    {
+        i_result = (i_result << 1) ^ ((i_result >> 31) ? CRC32_POLY : 0);
+        if ( (a >> i) & 1 )
+            i_result ^= b;
+    }
+    return i_result;
+}
+
+/*****************************************************************************
+ * crc32_Tables
+ *****************************************************************************/
+static void crc32_Tables( void )
+{
+    int i, j;
+
+    for ( i = 0; i < 256; i++ )
+    {
+        uint32_t i_crc = (uint32_t)i << 24;
+        for ( j = 0; j < 8; j++ )
+            i_crc = (i_crc << 1) ^ ((i_crc & 0x80000000) ? CRC32_POLY : 0);
+        pi_crc32_tables[0][i] = i_crc;
+    }
+    for ( i = 0; i < 256; i++ )
+        for ( j = 1; j < 8; j++ )
+            pi_crc32_tables[j][i] = (pi_crc32_tables[j - 1][i] << 8)
+                ^ pi_crc32_tables[0][pi_crc32_tables[j - 1][i] >> 24];
+
+    pi_crc32_zeros[0] = 1 << 8;
+    for ( i = 1; i < 32; i++ )
+        pi_crc32_zeros[i] = crc32_MulMod( pi_crc32_zeros[i - 1],
+                                          pi_crc32_zeros[i - 1] );
+}
+
+/*****************************************************************************
+ * crc32_Slice8: portable version
+ *****************************************************************************/
+static uint32_t crc32_Slice8( uint32_t i_crc, const uint8_t *p, size_t i_len )
+{
+    while ( i_len >= 8 )
+    {
+        uint32_t i_high = i_crc ^ (((uint32_t)p[0] << 24) | (p[1] << 16)
+                                   | (p[2] << 8) | p[3]);
+        i_crc = pi_crc32_tables[7][i_high >> 24]
+              ^ pi_crc32_tables[6][(i_high >> 16) & 0xff]
+              ^ pi_crc32_tables[5][(i_high >> 8) & 0xff]
+              ^ pi_crc32_tables[4][i_high & 0xff]
+              ^ pi_crc32_tables[3][p[4]]
+              ^ pi_crc32_tables[2][p[5]]
+              ^ pi_crc32_tables[1][p[6]]
+              ^ pi_crc32_tables[0][p[7]];
+        p += 8;
+        i_len -= 8;
+    }
+    while ( i_len-- )
+        i_crc = (i_crc << 8) ^ pi_crc32_tables[0][(i_crc >> 24) ^ *p++];
+    return i_crc;
+}
+
+#if defined(__x86_64__)
+/*****************************************************************************
+ * crc32_Clmul: folds 64 bytes at a time, the remainder of the 128-bit
+ * accumulator is then handed to crc32_Slice8
+ *****************************************************************************/
+#define CLMUL_FOLD( x, k )                                                  \
+    _mm_xor_si128( _mm_clmulepi64_si128( x, k, 0x11 ),                      \
+                   _mm_clmulepi64_si128( x, k, 0x00 ) )
+
+__attribute__((target("pclmul,ssse3")))
+static uint32_t crc32_Clmul( uint32_t i_crc, const uint8_t *p, size_t i_len )
+{
+    const __m128i bswap = _mm_setr_epi8( 15, 14, 13, 12, 11, 10, 9, 8,
+                                         7, 6, 5, 4, 3, 2, 1, 0 );
+    /* x^(512+64) mod P, x^512 mod P */
+    const __m128i k512 = _mm_set_epi64x( 0x8833794c, 0xe6228b11 );
+    /* x^(128+64) mod P, x^128 mod P */
+    const __m128i k128 = _mm_set_epi64x( 0xc5b9cd4c, 0xe8a45605 );
+    __m128i x0, x1, x2, x3;
+    uint8_t p_acc[16];
+
+    if ( i_len < 128 )
+        return crc32_Slice8( i_crc, p, i_len );
+
+#define LOAD( i ) _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)p + i ), \
+                                    bswap )
+    x0 = _mm_xor_si128( LOAD(0), _mm_set_epi32( i_crc, 0, 0, 0 ) );
+    x1 = LOAD(1);
+    x2 = LOAD(2);
+    x3 = LOAD(3);
+    p += 64;
+    i_len -= 64;
+
+    while ( i_len >= 64 )
+    {
+        x0 = _mm_xor_si128( CLMUL_FOLD( x0, k512 ), LOAD(0) );
+        x1 = _mm_xor_si128( CLMUL_FOLD( x1, k512 ), LOAD(1) );
+        x2 = _mm_xor_si128( CLMUL_FOLD( x2, k512 ), LOAD(2) );
+        x3 = _mm_xor_si128( CLMUL_FOLD( x3, k512 ), LOAD(3) );
+        p += 64;
+        i_len -= 64;
+    }
+
+    x1 = _mm_xor_si128( CLMUL_FOLD( x0, k128 ), x1 );
+    x2 = _mm_xor_si128( CLMUL_FOLD( x1, k128 ), x2 );
+    x0 = _mm_xor_si128( CLMUL_FOLD( x2, k128 ), x3 );
+
+    while ( i_len >= 16 )
+    {
+        x0 = _mm_xor_si128( CLMUL_FOLD( x0, k128 ), LOAD(0) );
+        p += 16;
+        i_len -= 16;
+    }
+#undef LOAD
+
+    _mm_storeu_si128( (__m128i *)p_acc, _mm_shuffle_epi8( x0, bswap ) );
+    i_crc = crc32_Slice8( 0, p_acc, sizeof(p_acc) );
+    return crc32_Slice8( i_crc, p, i_len );
+}
+#undef CLMUL_FOLD
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+/*****************************************************************************
+ * crc32_Arm: the CRC32 instructions process the bits LSB first, so they
+ * are fed with bit-reversed data and state
+ *****************************************************************************/
+static inline uint64_t crc32_Rbit64( uint64_t x )
+{
+    __asm__( "rbit %0, %1" : "=r" (x) : "r" (x) );
+    return x;
+}
+
+static inline uint32_t crc32_Rbit32( uint32_t x )
+{
+    __asm__( "rbit %w0, %w1" : "=r" (x) : "r" (x) );
+    return x;
+}
+
+static uint32_t crc32_Arm( uint32_t i_crc, const uint8_t *p, size_t i_len )
+{
+    uint32_t i_reflected = crc32_Rbit32( i_crc );
+
+    while ( i_len >= 8 )
+    {
+        uint64_t i_data;
+        memcpy( &i_data, p, 8 );
+        i_reflected = __crc32d( i_reflected,
+                                crc32_Rbit64( __builtin_bswap64( i_data ) ) );
+        p += 8;
+        i_len -= 8;
+    }
+    return crc32_Slice8( crc32_Rbit32( i_reflected ), p, i_len );
+}
+#endif
+
+/*****************************************************************************
+ * crc32_Resolve: picks the implementation on the first call
+ *****************************************************************************/
+static uint32_t crc32_Resolve( uint32_t i_crc, const uint8_t *p, size_t i_len )
+{
+    uint32_t (*pf)( uint32_t, const uint8_t *, size_t ) = crc32_Slice8;
+
+    crc32_Tables();
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "pclmul" )
+          && __builtin_cpu_supports( "ssse3" ) )
+        pf = crc32_Clmul;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    pf = crc32_Arm;
+#endif
+    __atomic_store_n( &pf_crc32, pf, __ATOMIC_RELEASE );
+    return pf( i_crc, p, i_len );
+}
+
+/*****************************************************************************
+ * crc32_Init: makes sure the tables are ready
+ *****************************************************************************/
+static void crc32_Init( void )
+{
+    if ( __atomic_load_n( &pf_crc32, __ATOMIC_ACQUIRE ) == crc32_Resolve )
+        crc32_Resolve( 0, NULL, 0 );
+}
+
+/*****************************************************************************
+ * psi_crc32: updates the CRC state i_crc (0xffffffff initially) with i_len
+ * bytes
+ *****************************************************************************/
+uint32_t psi_crc32( uint32_t i_crc, const uint8_t *p, size_t i_len )
+{
+    return __atomic_load_n( &pf_crc32, __ATOMIC_ACQUIRE )( i_crc, p, i_len );
+}
+
+/*****************************************************************************
+ * psi_crc32_zeros: updates the CRC state i_crc with i_len zero bytes, in
+ * O(log(i_len)); used to patch the CRC of a section whose header changed
+ *****************************************************************************/
+uint32_t psi_crc32_zeros( uint32_t i_crc, size_t i_len )
+{
+    int i;
+
+    crc32_Init();
+    for ( i = 0; i_len; i++, i_len >>= 1 )
+        if ( i_len & 1 )
+            i_crc = crc32_MulMod( i_crc, pi_crc32_zeros[i] );
+    return i_crc;
+}
+
+/*****************************************************************************
+ * psi_set_crc_fast: same as psi_set_crc()
+ *****************************************************************************/
+void psi_set_crc_fast( uint8_t *p_section )
+{
+    uint16_t i_end = psi_get_length( p_section ) + PSI_HEADER_SIZE
+                      - PSI_CRC_SIZE;
+    uint32_t i_crc = psi_crc32( 0xffffffff, p_section, i_end );
+
+    p_section[i_end] = i_crc >> 24;
+    p_section[i_end + 1] = (i_crc >> 16) & 0xff;
+    p_section[i_end + 2] = (i_crc >> 8) & 0xff;
+    p_section[i_end + 3] = i_crc & 0xff;
+}
+
+/*****************************************************************************
+ * psi_patch_crc: updates the CRC of a section whose first i_size bytes were
+ * p_old_header when its CRC was computed, without reading the rest of it
+ *****************************************************************************/
+void psi_patch_crc( uint8_t *p_section, const uint8_t *p_old_header,
+                    uint16_t i_size )
+{
+    uint16_t i_end = psi_get_length( p_section ) + PSI_HEADER_SIZE
+                      - PSI_CRC_SIZE;
+    uint8_t *p_crc = p_section + i_end;
+    uint32_t i_crc = 0;
+    uint16_t i;
+
+    crc32_Init();
+
+    /* The CRC is linear: the CRC of the XOR of two messages of the same
+     * length is the XOR of their CRCs, without the initial value */
+    for ( i = 0; i < i_size; i++ )
+    {
+        uint8_t i_diff = p_section[i] ^ p_old_header[i];
+        i_crc = (i_crc << 8) ^ pi_crc32_tables[0][(i_crc >> 24) ^ i_diff];
+    }
+    if ( !i_crc )
+        return;
+    i_crc = psi_crc32_zeros( i_crc, i_end - i_size );
+
+    i_crc ^= ((uint32_t)p_crc[0] << 24) | (p_crc[1] << 16) | (p_crc[2] << 8)
+              | p_crc[3];
+    p_crc[0] = i_crc >> 24;
+    p_crc[1] = (i_crc >> 16) & 0xff;
+    p_crc[2] = (i_crc >> 8) & 0xff;
+    p_crc[3] = i_crc & 0xff;
+}
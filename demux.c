@@ -33,11 +33,20 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 #include <ev.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#endif
+
 #include "dvblast.h"
 #include "en50221.h"
 #include "mrtg-cnt.h"
+#include "ring.h"
+#include "pidlist.h"
 
 #ifdef HAVE_ICONV
 #include <iconv.h>
@@ -54,17 +63,53 @@
  * Local declarations
  *****************************************************************************/
 #define MIN_SECTION_FRAGMENT    PSI_HEADER_SIZE_SYNTAX1
+#define SHARD_BATCH 256 /* packets per hand-over to a shard */
+#define SHARD_BATCHES 64 /* hand-overs in flight per shard */
+#define SHARD_DRAIN_WAIT 100 /* 100 us */
+#define PSI_SHARE_BUCKETS 256
+#define EIT_CRC_HEADER_SIZE 10 /* up to transport_stream_id */
+#define SECTION_POOL 64 /* recycled section buffers */
+#define SECTION_RECHECK 100 /* unchanged sections skipped before a reparse */
+#define HEADERS_MIN 256 /* initial size of the decoded headers */
+
+/* Immutable list of the outputs of an ES PID, for the demux shards */
+typedef struct demux_fanout_t
+{
+    const char *psz_desc;
+    uint16_t i_sid;
+    int i_nb_outputs;
+    struct
+    {
+        output_t *p_output;
+        bool b_pcr_only;
+    } p_outputs[];
+} demux_fanout_t;
 
+/* Fields of a PID used for every packet, 32 bytes so that an entry of
+ * p_pids[] never straddles two cache lines */
 typedef struct ts_pid_t
 {
-    int i_refcount;
-    int i_psi_refcount;
-    bool b_pes;
     int8_t i_last_cc;
-    int i_demux_fd;
+    uint8_t i_scrambling; /* of the last packet */
+    bool b_pes;
     /* b_emm is set to true when PID carries EMM packet
        and should be outputed in all services */
     bool b_emm;
+    int i_psi_refcount;
+    int i_nb_outputs;
+    /* packets not yet accounted in p_pids_cold[].info */
+    uint32_t i_packets;
+
+    output_t **pp_outputs;
+    /* set if the PID is demuxed by a shard */
+    demux_fanout_t *p_fanout;
+} ts_pid_t;
+
+/* Other fields of a PID */
+typedef struct ts_pid_cold_t
+{
+    int i_refcount;
+    int i_demux_fd;
 
     /* PID info and stats */
     mtime_t i_bytes_ts;
@@ -74,13 +119,23 @@ typedef struct ts_pid_t
     /* biTStream PSI section gathering */
     uint8_t *p_psi_buffer;
     uint16_t i_psi_buffer_used;
-
-    output_t **pp_outputs;
-    int i_nb_outputs;
+    /* unchanged sections skipped since the last full check */
+    uint8_t i_psi_unchanged;
 
     int i_pes_status; /* pes + unscrambled */
     struct ev_timer timeout_watcher;
-} ts_pid_t;
+
+    /* in pi_unshard_pids[] */
+    bool b_unshard;
+} ts_pid_cold_t;
+
+/* PIDs having packets not yet accounted in their stats, which are updated
+ * once per batch of packets by the thread demuxing them */
+typedef struct demux_pending_t
+{
+    int i_nb_pids;
+    uint16_t pi_pids[MAX_PIDS];
+} demux_pending_t;
 
 typedef struct sid_t
 {
@@ -88,11 +143,77 @@ typedef struct sid_t
     uint8_t *p_current_pmt;
 } sid_t;
 
+/* Generated section of an output, split into TS packets */
+struct psi_share_t
+{
+    struct psi_share_t *p_next; /* in pp_psi_shares, while reusable */
+    int i_refcount;
+    bool b_hashed;
+    int i_table;
+    uint16_t i_sid;
+    uint32_t i_hash;
+    uint8_t *p_key;
+    size_t i_key_size;
+
+    uint8_t *p_section;
+    uint8_t *p_packets; /* without PID and CC */
+    uint8_t i_nb_packets;
+};
+
+enum
+{
+    PSI_SHARE_PAT,
+    PSI_SHARE_PMT,
+    PSI_SHARE_NIT,
+    PSI_SHARE_SDT,
+    PSI_SHARE_TABLES
+};
+
+/* Fixed part of the key of a psi_share_t, the fields which don't affect a
+ * table are left to 0 */
+typedef struct psi_share_key_t
+{
+    uint16_t i_sid, i_new_sid, i_tsid, i_onid, i_network_id, i_pmt_pid;
+    uint16_t pi_confpids[N_MAP_PIDS];
+    uint32_t i_crc;
+    bool b_dvb, b_epg, b_do_remap;
+} psi_share_key_t;
+
 mtime_t i_wallclock = 0;
 
-static ts_pid_t p_pids[MAX_PIDS];
+static ts_pid_t p_pids[MAX_PIDS] __attribute__((aligned(64)));
+static ts_pid_cold_t p_pids_cold[MAX_PIDS];
+static demux_pending_t pending_stats;
+/* Headers of the packets being demuxed by demux_Run() */
+static ts_headers_t headers;
 static sid_t **pp_sids = NULL;
 static int i_nb_sids = 0;
+/* Services indexed by SID, kept in sync with pp_sids by HandlePAT() and
+ * DeleteProgram() */
+static sid_t *pp_sid_index[65536];
+/* Valid outputs of each SID, to avoid walking pp_outputs */
+typedef struct sid_outputs_t
+{
+    output_t **pp_outputs;
+    int i_nb_outputs;
+} sid_outputs_t;
+static sid_outputs_t p_sid_outputs[65536];
+/* Set when the PAT, CAT or a PMT changed, so that the classification of the
+ * PIDs in p_pids_cold[].info is rebuilt before being read */
+static bool b_pid_classes_dirty = true;
+/* Generated sections which may be reused by other outputs; a share leaves
+ * its bucket when its input table changes */
+static psi_share_t *pp_psi_shares[PSI_SHARE_TABLES][PSI_SHARE_BUCKETS];
+/* Buffers of released input sections, to assemble the next ones */
+static uint8_t *pp_section_pool[SECTION_POOL];
+static int i_section_pool = 0;
+/* Key being looked up */
+static int i_share_table;
+static uint8_t *p_share_key = NULL;
+static size_t i_share_key_size = 0, i_share_key_alloc = 0;
+/* Outputs having b_passthrough, so that demux_Handle() doesn't scan them all */
+static output_t **pp_passthrough_outputs = NULL;
+static int i_nb_passthrough_outputs = 0;
 
 static PSI_TABLE_DECLARE(pp_current_pat_sections);
 static PSI_TABLE_DECLARE(pp_next_pat_sections);
@@ -113,6 +234,51 @@ static mtime_t i_last_error = 0;
 static mtime_t i_last_reset = 0;
 static struct ev_timer print_watcher;
 
+/*
+ * With --demux-shards, the ES PIDs whose outputs are all run by output
+ * workers are demuxed by shard threads, by PID modulo the number of shards.
+ * The main thread remains the control shard: it validates the packets,
+ * handles the PSI PIDs and the transport errors, and dispatches the other
+ * packets along with an immutable snapshot of the outputs of their PID.
+ * The snapshots are rebuilt after the shards have drained the packets
+ * dispatched with the previous ones, which is the only grace period needed.
+ */
+typedef struct demux_batch_t
+{
+    unsigned int i_count;
+    struct
+    {
+        block_t *p_ts;
+        const demux_fanout_t *p_fanout;
+    } p_items[SHARD_BATCH];
+} demux_batch_t;
+
+typedef struct demux_shard_t
+{
+    struct ev_loop *p_loop;
+    struct ev_async wakeup_watcher;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int i_producer;
+    int b_die;
+
+    demux_batch_t *p_batches;
+    demux_batch_t *p_pending; /* being filled by the main thread */
+    ring_t queue, free_ring;
+    block_t *p_garbage;
+    demux_pending_t pending_stats;
+
+    uint64_t i_nb_packets, i_overruns;
+} demux_shard_t;
+
+static demux_shard_t *p_shards = NULL;
+static int i_nb_shards = 0;
+static bool b_fanouts_dirty = true;
+/* PIDs to take back to the main thread before the next packet is
+ * dispatched */
+static uint16_t pi_unshard_pids[MAX_PIDS];
+static int i_nb_unshard_pids = 0;
+
 #ifdef HAVE_ICONV
 static iconv_t iconv_handle = (iconv_t)-1;
 #endif
@@ -120,13 +286,17 @@ static iconv_t iconv_handle = (iconv_t)-1;
 /*****************************************************************************
  * Local prototypes
  *****************************************************************************/
-static void demux_Handle( block_t *p_ts );
-static void SetDTS( block_t *p_list );
+static void demux_Handle( block_t *p_ts, uint16_t i_pid, uint8_t i_flags,
+                          uint8_t i_cc_byte );
+static void demux_StartShards( void );
+static void demux_StopShards( void );
+static void SetDTS( const ts_headers_t *p_headers );
 static void SetPID( uint16_t i_pid );
 static void SetPID_EMM( uint16_t i_pid );
 static void UnsetPID( uint16_t i_pid );
 static void StartPID( output_t *p_output, uint16_t i_pid );
 static void StopPID( output_t *p_output, uint16_t i_pid );
+static void SetPassthrough( output_t *p_output, bool b_passthrough );
 static void SelectPID( uint16_t i_sid, uint16_t i_pid, bool b_pcr );
 static void UnselectPID( uint16_t i_sid, uint16_t i_pid );
 static void SelectPMT( uint16_t i_sid, uint16_t i_pid );
@@ -145,8 +315,48 @@ static void NewPMT( output_t *p_output );
 static void NewNIT( output_t *p_output );
 static void NewSDT( output_t *p_output );
 static void HandlePSIPacket( uint8_t *p_ts, mtime_t i_dts );
+static void SectionRelease( uint8_t *p_section );
+static void SectionTableRelease( uint8_t **pp_sections );
+static bool SectionIsCurrent( uint8_t **pp_current_sections,
+                              uint8_t **pp_next_sections, uint8_t *p_section );
+static void AssembleReset( ts_pid_cold_t *p_pid );
 static const char *get_pid_desc(uint16_t i_pid, uint16_t *i_sid);
 
+/*****************************************************************************
+ * PIDIsMapped/AddPIDMapping : sparse PID mapping of an output
+ *****************************************************************************/
+static bool PIDIsMapped( const output_t *p_output, uint16_t i_newpid )
+{
+    int i;
+
+    for ( i = 0; i < p_output->i_nb_pid_pairs; i++ )
+        if ( p_output->p_pid_pairs[i].i_newpid == i_newpid )
+            return true;
+    return false;
+}
+
+static void AddPIDMapping( output_t *p_output, uint16_t i_pid,
+                           uint16_t i_newpid )
+{
+    int i = p_output->i_nb_pid_pairs;
+
+    while ( i > 0 && p_output->p_pid_pairs[i - 1].i_pid > i_pid )
+        i--;
+    if ( i > 0 && p_output->p_pid_pairs[i - 1].i_pid == i_pid )
+    {
+        p_output->p_pid_pairs[i - 1].i_newpid = i_newpid;
+        return;
+    }
+
+    p_output->p_pid_pairs = realloc( p_output->p_pid_pairs,
+                    (p_output->i_nb_pid_pairs + 1) * sizeof(pid_pair_t) );
+    memmove( &p_output->p_pid_pairs[i + 1], &p_output->p_pid_pairs[i],
+             (p_output->i_nb_pid_pairs - i) * sizeof(pid_pair_t) );
+    p_output->p_pid_pairs[i].i_pid = i_pid;
+    p_output->p_pid_pairs[i].i_newpid = i_newpid;
+    p_output->i_nb_pid_pairs++;
+}
+
 /*
  * Remap an ES pid to a fixed value.
  * Multiple streams of the same type use sequential pids
@@ -229,10 +439,9 @@ static uint16_t map_es_pid(output_t * p_output, uint8_t *p_es, uint16_t i_pid)
 
     /* Got the new base for the mapped pid. Find the next free one
        we do this to ensure that multiple audios get unique pids */
-    while (p_output->pi_freepids[i_newpid] != UNUSED_PID)
+    while (PIDIsMapped(p_output, i_newpid))
         i_newpid++;
-    p_output->pi_freepids[i_newpid] = i_pid;  /* Mark as in use */
-    p_output->pi_newpids[i_pid] = i_newpid;   /* Save the new pid */
+    AddPIDMapping(p_output, i_pid, i_newpid);
 
     msg_Dbg(NULL, "REMAP: => Elementary stream is remapped to PID 0x%x (%u)", i_newpid, i_newpid);
 
@@ -244,14 +453,57 @@ static uint16_t map_es_pid(output_t * p_output, uint8_t *p_es, uint16_t i_pid)
  *****************************************************************************/
 static inline sid_t *FindSID( uint16_t i_sid )
 {
+    return i_sid ? pp_sid_index[i_sid] : NULL;
+}
+
+/*****************************************************************************
+ * IndexOutput : files the output under its SID in p_sid_outputs, must be
+ * called whenever config.i_sid or OUTPUT_VALID change
+ *****************************************************************************/
+static void IndexOutput( output_t *p_output )
+{
+    int i_sid = (p_output->config.i_config & OUTPUT_VALID) ?
+                p_output->config.i_sid : -1;
+    sid_outputs_t *p_list;
     int i;
 
-    for ( i = 0; i < i_nb_sids; i++ )
+    if ( i_sid == p_output->i_indexed_sid )
+        return;
+
+    if ( p_output->i_indexed_sid != -1 )
     {
-        sid_t *p_sid = pp_sids[i];
-        if ( p_sid->i_sid == i_sid )
-            return p_sid;
+        p_list = &p_sid_outputs[p_output->i_indexed_sid];
+        for ( i = 0; i < p_list->i_nb_outputs; i++ )
+            if ( p_list->pp_outputs[i] == p_output )
+                break;
+        if ( i < p_list->i_nb_outputs )
+        {
+            memmove( &p_list->pp_outputs[i], &p_list->pp_outputs[i + 1],
+                     (p_list->i_nb_outputs - i - 1) * sizeof(output_t *) );
+            p_list->i_nb_outputs--;
+        }
+    }
+
+    if ( i_sid != -1 )
+    {
+        p_list = &p_sid_outputs[i_sid];
+        p_list->pp_outputs = realloc( p_list->pp_outputs,
+                        (p_list->i_nb_outputs + 1) * sizeof(output_t *) );
+        p_list->pp_outputs[p_list->i_nb_outputs++] = p_output;
     }
+    p_output->i_indexed_sid = i_sid;
+}
+
+/*****************************************************************************
+ * FindFreeSID : returns an unused entry of pp_sids, if any
+ *****************************************************************************/
+static sid_t *FindFreeSID( void )
+{
+    int i;
+
+    for ( i = 0; i < i_nb_sids; i++ )
+        if ( pp_sids[i]->i_sid == 0 )
+            return pp_sids[i];
     return NULL;
 }
 
@@ -261,6 +513,11 @@ static inline sid_t *FindSID( uint16_t i_sid )
 static void PrintCb( struct ev_loop *loop, struct ev_timer *w, int revents )
 {
     uint64_t i_bitrate = i_nb_packets * TS_SIZE * 8 * 1000000 / i_print_period;
+    /* also counted by the demux shards */
+    uint64_t i_discontinuities = __atomic_exchange_n( &i_nb_discontinuities,
+                                                      0, __ATOMIC_RELAXED );
+    int i;
+
     switch (i_print_type)
     {
         case PRINT_XML:
@@ -294,23 +551,47 @@ static void PrintCb( struct ev_loop *loop, struct ev_timer *w, int revents )
         i_nb_invalids = 0;
     }
 
-    if ( i_nb_discontinuities )
+    if ( i_discontinuities )
     {
         switch (i_print_type)
         {
             case PRINT_XML:
                 fprintf(print_fh,
                         "<ERROR type=\"invalid_discontinuity\" number=\"%"PRIu64"\" />\n",
-                        i_nb_discontinuities);
+                        i_discontinuities);
                 break;
             case PRINT_TEXT:
                 fprintf(print_fh, "discontinuities: %"PRIu64"\n",
-                        i_nb_discontinuities);
+                        i_discontinuities);
                 break;
             default:
                 break;
         }
-        i_nb_discontinuities = 0;
+    }
+
+    for ( i = 0; i < i_nb_shards; i++ )
+    {
+        demux_shard_t *p_shard = &p_shards[i];
+        uint64_t i_packets = __atomic_exchange_n( &p_shard->i_nb_packets, 0,
+                                                  __ATOMIC_RELAXED );
+        uint64_t i_overruns = p_shard->i_overruns;
+        unsigned int i_occupancy = ring_Count( &p_shard->queue );
+
+        switch (i_print_type)
+        {
+            case PRINT_XML:
+                fprintf(print_fh,
+                        "<STATUS type=\"demux_shard\" id=\"%d\" packets=\"%"PRIu64"\" queue=\"%u\" overruns=\"%"PRIu64"\" />\n",
+                        i, i_packets, i_occupancy, i_overruns);
+                break;
+            case PRINT_TEXT:
+                fprintf(print_fh, "demux shard %d: %"PRIu64" packets, queue %u/%d (overruns %"PRIu64")\n",
+                        i, i_packets, i_occupancy, SHARD_BATCHES, i_overruns);
+                break;
+            default:
+                break;
+        }
+        p_shard->i_overruns = 0;
     }
 
     if ( i_nb_errors )
@@ -330,12 +611,31 @@ static void PrintCb( struct ev_loop *loop, struct ev_timer *w, int revents )
         }
         i_nb_errors = 0;
     }
+
+    block_stats_t stats;
+    block_GetStats( &stats );
+    switch (i_print_type)
+    {
+        case PRINT_XML:
+            fprintf(print_fh,
+                    "<STATUS type=\"blocks\" pool=\"%u\" used=\"%u\" highwater=\"%u\" hits=\"%"PRIu64"\" misses=\"%"PRIu64"\" />\n",
+                    stats.i_pool, stats.i_used, stats.i_highwater,
+                    stats.i_hits, stats.i_misses);
+            break;
+        case PRINT_TEXT:
+            fprintf(print_fh, "blocks: %u/%u used (high-water %u), %"PRIu64" hits, %"PRIu64" misses\n",
+                    stats.i_used, stats.i_pool, stats.i_highwater,
+                    stats.i_hits, stats.i_misses);
+            break;
+        default:
+            break;
+    }
 }
 
 static void PrintESCb( struct ev_loop *loop, struct ev_timer *w, int revents )
 {
-    ts_pid_t *p_pid = container_of( w, ts_pid_t, timeout_watcher );
-    uint16_t i_pid = p_pid - p_pids;
+    ts_pid_cold_t *p_pid = container_of( w, ts_pid_cold_t, timeout_watcher );
+    uint16_t i_pid = p_pid - p_pids_cold;
 
     switch (i_print_type)
     {
@@ -357,7 +657,7 @@ static void PrintESCb( struct ev_loop *loop, struct ev_timer *w, int revents )
 
 static void PrintES( uint16_t i_pid )
 {
-    const ts_pid_t *p_pid = &p_pids[i_pid];
+    const ts_pid_cold_t *p_pid = &p_pids_cold[i_pid];
 
     switch (i_print_type)
     {
@@ -383,16 +683,18 @@ void demux_Open( void )
     int i;
 
     memset( p_pids, 0, sizeof(p_pids) );
+    memset( p_pids_cold, 0, sizeof(p_pids_cold) );
+    pending_stats.i_nb_pids = 0;
 
     pf_Open();
 
     for ( i = 0; i < MAX_PIDS; i++ )
     {
         p_pids[i].i_last_cc = -1;
-        p_pids[i].i_demux_fd = -1;
-        psi_assemble_init( &p_pids[i].p_psi_buffer,
-                           &p_pids[i].i_psi_buffer_used );
-        p_pids[i].i_pes_status = -1;
+        p_pids_cold[i].i_demux_fd = -1;
+        psi_assemble_init( &p_pids_cold[i].p_psi_buffer,
+                           &p_pids_cold[i].i_psi_buffer_used );
+        p_pids_cold[i].i_pes_status = -1;
     }
 
     if ( b_budget_mode )
@@ -426,6 +728,9 @@ void demux_Open( void )
 
     SetPID(TDT_PID);
 
+    if ( i_demux_shards )
+        demux_StartShards();
+
     if ( i_print_period )
     {
         ev_timer_init( &print_watcher, PrintCb,
@@ -441,6 +746,8 @@ void demux_Close( void )
 {
     int i;
 
+    demux_StopShards();
+
     psi_table_free( pp_current_pat_sections );
     psi_table_free( pp_next_pat_sections );
     psi_table_free( pp_current_cat_sections );
@@ -452,9 +759,10 @@ void demux_Close( void )
 
     for ( i = 0; i < MAX_PIDS; i++ )
     {
-        ev_timer_stop( event_loop, &p_pids[i].timeout_watcher );
-        free( p_pids[i].p_psi_buffer );
+        ev_timer_stop( event_loop, &p_pids_cold[i].timeout_watcher );
+        free( p_pids_cold[i].p_psi_buffer );
         free( p_pids[i].pp_outputs );
+        free( p_pids[i].p_fanout );
     }
 
     for ( i = 0; i < i_nb_sids; i++ )
@@ -464,6 +772,25 @@ void demux_Close( void )
         free( p_sid );
     }
     free( pp_sids );
+    pp_sids = NULL;
+    i_nb_sids = 0;
+    memset( pp_sid_index, 0, sizeof(pp_sid_index) );
+    for ( i = 0; i < 65536; i++ )
+        free( p_sid_outputs[i].pp_outputs );
+    memset( p_sid_outputs, 0, sizeof(p_sid_outputs) );
+    free( p_share_key );
+    p_share_key = NULL;
+    i_share_key_size = i_share_key_alloc = 0;
+    while ( i_section_pool )
+        free( pp_section_pool[--i_section_pool] );
+
+    free( headers.pp_blocks );
+    free( headers.pi_words );
+    free( headers.pi_pids );
+    free( headers.pi_flags );
+    free( headers.pi_ccs );
+    memset( &headers, 0, sizeof(headers) );
+    free( pp_passthrough_outputs );
 
 #ifdef HAVE_ICONV
     if (iconv_handle != (iconv_t)-1) {
@@ -476,37 +803,618 @@ void demux_Close( void )
         ev_timer_stop( event_loop, &print_watcher );
 }
 
+/*****************************************************************************
+ * demux_Account : counts the packet of the PID, and returns true on a
+ * discontinuity (from the thread demuxing the PID)
+ *****************************************************************************/
+static bool demux_Account( ts_pid_t *p_pid, uint16_t i_pid, uint8_t i_flags,
+                           uint8_t i_cc_byte, demux_pending_t *p_pending )
+{
+    uint8_t i_cc = i_cc_byte & 0xf;
+
+    if ( !p_pid->i_packets++ )
+        p_pending->pi_pids[p_pending->i_nb_pids++] = i_pid;
+    if ( i_pid != PADDING_PID )
+    {
+        p_pid->i_scrambling = i_cc_byte >> 6;
+        if ( b_mrtg && !(i_flags & TS_HEADER_TEI) )
+            mrtgCheckCC( p_pid->i_last_cc, i_cc_byte );
+    }
+
+    if ( i_pid != PADDING_PID && p_pid->i_last_cc != -1
+          && !ts_check_duplicate( i_cc, p_pid->i_last_cc )
+          && ts_check_discontinuity( i_cc, p_pid->i_last_cc ) )
+    {
+        p_pids_cold[i_pid].info.i_cc_errors++;
+        __atomic_add_fetch( &i_nb_discontinuities, 1, __ATOMIC_RELAXED );
+        return true;
+    }
+    return false;
+}
+
+/*****************************************************************************
+ * demux_UpdateStats : updates the statistics of the PIDs counted by
+ * demux_Account() (from the thread demuxing the PIDs)
+ *****************************************************************************/
+static void demux_UpdateStats( demux_pending_t *p_pending, mtime_t i_date )
+{
+    int i;
+
+    for ( i = 0; i < p_pending->i_nb_pids; i++ )
+    {
+        uint16_t i_pid = p_pending->pi_pids[i];
+        ts_pid_t *p_pid = &p_pids[i_pid];
+        ts_pid_cold_t *p_cold = &p_pids_cold[i_pid];
+
+        if ( i_pid != PADDING_PID )
+            p_cold->info.i_scrambling = p_pid->i_scrambling;
+
+        p_cold->info.i_last_packet_ts = i_date;
+        p_cold->info.i_packets += p_pid->i_packets;
+
+        p_cold->i_packets_passed += p_pid->i_packets;
+        p_pid->i_packets = 0;
+
+        /* Calculate bytes_per_sec */
+        if ( i_date > p_cold->i_bytes_ts + 1000000 ) {
+            p_cold->info.i_bytes_per_sec = p_cold->i_packets_passed * TS_SIZE;
+            p_cold->i_packets_passed = 0;
+            p_cold->i_bytes_ts = i_date;
+        }
+
+        if ( p_cold->info.i_first_packet_ts == 0 )
+            p_cold->info.i_first_packet_ts = i_date;
+    }
+    p_pending->i_nb_pids = 0;
+}
+
+/*****************************************************************************
+ * Demux shards
+ *****************************************************************************/
+static bool demux_ShardOutput( const output_t *p_output )
+{
+    return p_output->p_worker != NULL
+            && !(i_ca_handle && (p_output->config.i_config & OUTPUT_WATCH));
+}
+
+/*****************************************************************************
+ * demux_BuildFanout : returns the outputs of an ES PID, or NULL if the PID
+ * must be demuxed by the main thread
+ *****************************************************************************/
+static demux_fanout_t *demux_BuildFanout( uint16_t i_pid )
+{
+    ts_pid_t *p_pid = &p_pids[i_pid];
+    bool b_dup = output_dup.config.i_config & OUTPUT_VALID;
+    demux_fanout_t *p_fanout;
+    int i, i_nb_outputs = i_nb_passthrough_outputs + (b_dup ? 1 : 0);
+
+    if ( p_pid->i_psi_refcount || i_pid == TDT_PID || i_pid == RST_PID
+          || (b_enable_emm && p_pid->b_emm) )
+        return NULL;
+
+    for ( i = 0; i < p_pid->i_nb_outputs; i++ )
+    {
+        if ( p_pid->pp_outputs[i] == NULL )
+            continue;
+        if ( !demux_ShardOutput( p_pid->pp_outputs[i] ) )
+            return NULL;
+        i_nb_outputs++;
+    }
+    for ( i = 0; i < i_nb_passthrough_outputs; i++ )
+        if ( !demux_ShardOutput( pp_passthrough_outputs[i] ) )
+            return NULL;
+    if ( b_dup && !demux_ShardOutput( &output_dup ) )
+        return NULL;
+
+    if ( !i_nb_outputs )
+        return NULL;
+
+    p_fanout = malloc( sizeof(demux_fanout_t)
+                        + i_nb_outputs * sizeof(p_fanout->p_outputs[0]) );
+    p_fanout->psz_desc = get_pid_desc( i_pid, &p_fanout->i_sid );
+    p_fanout->i_nb_outputs = 0;
+
+    for ( i = 0; i < p_pid->i_nb_outputs; i++ )
+    {
+        output_t *p_output = p_pid->pp_outputs[i];
+        if ( p_output == NULL )
+            continue;
+        p_fanout->p_outputs[p_fanout->i_nb_outputs].p_output = p_output;
+        p_fanout->p_outputs[p_fanout->i_nb_outputs].b_pcr_only =
+            p_output->i_pcr_pid == i_pid;
+        p_fanout->i_nb_outputs++;
+    }
+    for ( i = 0; i < i_nb_passthrough_outputs; i++ )
+    {
+        p_fanout->p_outputs[p_fanout->i_nb_outputs].p_output =
+            pp_passthrough_outputs[i];
+        p_fanout->p_outputs[p_fanout->i_nb_outputs].b_pcr_only = false;
+        p_fanout->i_nb_outputs++;
+    }
+    if ( b_dup )
+    {
+        p_fanout->p_outputs[p_fanout->i_nb_outputs].p_output = &output_dup;
+        p_fanout->p_outputs[p_fanout->i_nb_outputs].b_pcr_only = false;
+        p_fanout->i_nb_outputs++;
+    }
+
+    return p_fanout;
+}
+
+/*****************************************************************************
+ * demux_ShardCommit : hands the pending batch over to the shard
+ *****************************************************************************/
+static void demux_ShardCommit( demux_shard_t *p_shard )
+{
+    if ( p_shard->p_pending == NULL || !p_shard->p_pending->i_count )
+        return;
+
+    /* Cannot fail, there are as many batches as ring slots. */
+    ring_Push( &p_shard->queue, p_shard->p_pending );
+    p_shard->p_pending = NULL;
+    ev_async_send( p_shard->p_loop, &p_shard->wakeup_watcher );
+}
+
+/*****************************************************************************
+ * demux_ShardPut : dispatches a packet to the shard of its PID, which takes
+ * over the reference
+ *****************************************************************************/
+static void demux_ShardPut( uint16_t i_pid, block_t *p_ts )
+{
+    demux_shard_t *p_shard = &p_shards[i_pid % i_nb_shards];
+    demux_batch_t *p_batch = p_shard->p_pending;
+
+    if ( p_batch == NULL )
+    {
+        p_batch = p_shard->p_pending = ring_Pop( &p_shard->free_ring );
+        if ( p_batch == NULL )
+        {
+            /* The shard lags behind, drop the packet. */
+            p_shard->i_overruns++;
+            if ( !block_Unref( p_ts ) )
+                block_Delete( p_ts );
+            return;
+        }
+    }
+
+    p_batch->p_items[p_batch->i_count].p_ts = p_ts;
+    p_batch->p_items[p_batch->i_count].p_fanout = p_pids[i_pid].p_fanout;
+    if ( ++p_batch->i_count == SHARD_BATCH )
+        demux_ShardCommit( p_shard );
+}
+
+/*****************************************************************************
+ * demux_Quiesce : waits until the shards have handed all the packets
+ * dispatched so far over to the outputs, and rebuilds the snapshots before
+ * the next packet is dispatched; to be called before an output stops being
+ * run by its worker
+ *****************************************************************************/
+void demux_Quiesce( void )
+{
+    int i;
+
+    for ( i = 0; i < i_nb_shards; i++ )
+    {
+        demux_shard_t *p_shard = &p_shards[i];
+
+        demux_ShardCommit( p_shard );
+        while ( ring_Count( &p_shard->queue ) )
+            msleep( SHARD_DRAIN_WAIT );
+
+        /* The shard pops and processes the batches with the lock held. */
+        pthread_mutex_lock( &p_shard->lock );
+        pthread_mutex_unlock( &p_shard->lock );
+    }
+
+    b_fanouts_dirty = true;
+}
+
+/*****************************************************************************
+ * demux_Unshard : takes a PID whose outputs change back to the main thread,
+ * until the next demux_Publish(); the PIDs changed while handling a packet
+ * are taken back together by demux_UnshardPending(), with a single grace
+ * period, before the next packet is dispatched
+ *****************************************************************************/
+static void demux_Unshard( uint16_t i_pid )
+{
+    b_fanouts_dirty = true;
+    if ( p_pids[i_pid].p_fanout == NULL || p_pids_cold[i_pid].b_unshard )
+        return;
+
+    p_pids_cold[i_pid].b_unshard = true;
+    pi_unshard_pids[i_nb_unshard_pids++] = i_pid;
+}
+
+static void demux_UnshardReset( void )
+{
+    int i;
+
+    for ( i = 0; i < i_nb_unshard_pids; i++ )
+        p_pids_cold[pi_unshard_pids[i]].b_unshard = false;
+    i_nb_unshard_pids = 0;
+}
+
+static void demux_UnshardPending( void )
+{
+    int i;
+
+    if ( !i_nb_unshard_pids )
+        return;
+
+    demux_Quiesce();
+    for ( i = 0; i < i_nb_unshard_pids; i++ )
+    {
+        uint16_t i_pid = pi_unshard_pids[i];
+        free( p_pids[i_pid].p_fanout );
+        p_pids[i_pid].p_fanout = NULL;
+    }
+    demux_UnshardReset();
+}
+
+static void demux_UnshardAll( void )
+{
+    int i;
+
+    if ( !i_nb_shards )
+        return;
+
+    demux_Quiesce();
+    demux_UnshardReset();
+    for ( i = 0; i < MAX_PIDS; i++ )
+    {
+        free( p_pids[i].p_fanout );
+        p_pids[i].p_fanout = NULL;
+    }
+}
+
+/*****************************************************************************
+ * demux_Publish : replaces the snapshots of the outputs of the ES PIDs
+ *****************************************************************************/
+static void demux_Publish( void )
+{
+    int i;
+
+    if ( !i_nb_shards || !b_fanouts_dirty )
+        return;
+
+    /* Grace period: no shard may still use the previous snapshots. */
+    demux_Quiesce();
+    demux_UnshardReset();
+    b_fanouts_dirty = false;
+
+    for ( i = 0; i < MAX_PIDS; i++ )
+    {
+        free( p_pids[i].p_fanout );
+        p_pids[i].p_fanout = demux_BuildFanout( i );
+    }
+}
+
+/*****************************************************************************
+ * demux_ShardHandle : demuxes an ES packet (shard thread)
+ *****************************************************************************/
+static void demux_ShardHandle( block_t *p_ts, const demux_fanout_t *p_fanout,
+                               demux_pending_t *p_pending )
+{
+    uint16_t i_pid = ts_get_pid( p_ts->p_ts );
+    ts_pid_t *p_pid = &p_pids[i_pid];
+    uint8_t i_cc = ts_get_cc( p_ts->p_ts );
+    bool b_pcr = ts_has_adaptation( p_ts->p_ts )
+                  && ts_get_adaptation( p_ts->p_ts )
+                  && tsaf_has_pcr( p_ts->p_ts );
+    int i;
+
+    if ( demux_Account( p_pid, i_pid, p_ts->p_ts[1] & TS_HEADER_TEI,
+                        p_ts->p_ts[3], p_pending ) )
+        msg_Warn( NULL, "TS discontinuity on pid %4hu expected_cc %2u got %2u (%s, sid %d)",
+                  i_pid, (p_pid->i_last_cc + 1) & 0x0f, i_cc,
+                  p_fanout->psz_desc, p_fanout->i_sid );
+    p_pid->i_last_cc = i_cc;
+
+    for ( i = 0; i < p_fanout->i_nb_outputs; i++ )
+        if ( !p_fanout->p_outputs[i].b_pcr_only || b_pcr )
+            output_Put( p_fanout->p_outputs[i].p_output, p_ts );
+
+    block_Release( p_ts );
+}
+
+/*****************************************************************************
+ * demux_ShardWakeup : processes the packets dispatched (shard thread)
+ *****************************************************************************/
+static void demux_ShardWakeup( struct ev_loop *loop, struct ev_async *w,
+                               int revents )
+{
+    demux_shard_t *p_shard = w->data;
+    demux_batch_t *p_batch;
+    mtime_t i_date = mdate();
+
+    pthread_mutex_lock( &p_shard->lock );
+    while ( (p_batch = ring_Pop( &p_shard->queue )) != NULL )
+    {
+        unsigned int i;
+
+        for ( i = 0; i < p_batch->i_count; i++ )
+            demux_ShardHandle( p_batch->p_items[i].p_ts,
+                               p_batch->p_items[i].p_fanout,
+                               &p_shard->pending_stats );
+        __atomic_add_fetch( &p_shard->i_nb_packets, p_batch->i_count,
+                            __ATOMIC_RELAXED );
+        p_batch->i_count = 0;
+        ring_Push( &p_shard->free_ring, p_batch );
+    }
+    demux_UpdateStats( &p_shard->pending_stats, i_date );
+    outputs_Commit();
+    pthread_mutex_unlock( &p_shard->lock );
+
+    if ( __atomic_load_n( &p_shard->b_die, __ATOMIC_ACQUIRE ) )
+        ev_break( loop, EVBREAK_ALL );
+}
+
+/*****************************************************************************
+ * demux_ShardThread
+ *****************************************************************************/
+static void *demux_ShardThread( void *_p_shard )
+{
+    demux_shard_t *p_shard = _p_shard;
+
+    block_SetGarbage( &p_shard->p_garbage );
+    outputs_SetProducer( p_shard->i_producer );
+    ev_run( p_shard->p_loop, 0 );
+    return NULL;
+}
+
+/*****************************************************************************
+ * demux_StartShards
+ *****************************************************************************/
+static void demux_StartShards( void )
+{
+    int i;
+
+    p_shards = calloc( i_demux_shards, sizeof(demux_shard_t) );
+    for ( i = 0; i < i_demux_shards; i++ )
+    {
+        demux_shard_t *p_shard = &p_shards[i];
+        unsigned int j;
+        int i_error;
+
+        if ( (p_shard->p_loop = ev_loop_new( EVFLAG_AUTO )) == NULL )
+        {
+            msg_Err( NULL, "unable to initialize libev for demux shard %d", i );
+            exit(EXIT_FAILURE);
+        }
+        p_shard->i_producer = i + 1;
+        pthread_mutex_init( &p_shard->lock, NULL );
+
+        ring_Init( &p_shard->queue, SHARD_BATCHES );
+        ring_Init( &p_shard->free_ring, SHARD_BATCHES );
+        p_shard->p_batches = calloc( SHARD_BATCHES, sizeof(demux_batch_t) );
+        for ( j = 0; j < SHARD_BATCHES; j++ )
+            ring_Push( &p_shard->free_ring, &p_shard->p_batches[j] );
+
+        ev_async_init( &p_shard->wakeup_watcher, demux_ShardWakeup );
+        p_shard->wakeup_watcher.data = p_shard;
+        ev_async_start( p_shard->p_loop, &p_shard->wakeup_watcher );
+
+        if ( (i_error = pthread_create( &p_shard->thread, NULL,
+                                        demux_ShardThread, p_shard )) )
+        {
+            msg_Err( NULL, "couldn't create demux shard (%s)",
+                     strerror(i_error) );
+            exit(EXIT_FAILURE);
+        }
+        i_nb_shards++;
+    }
+
+    msg_Dbg( NULL, "demuxing ES PIDs from %d shards", i_nb_shards );
+}
+
+/*****************************************************************************
+ * demux_StopShards
+ *****************************************************************************/
+static void demux_StopShards( void )
+{
+    int i;
+
+    for ( i = 0; i < i_nb_shards; i++ )
+    {
+        demux_shard_t *p_shard = &p_shards[i];
+
+        demux_ShardCommit( p_shard );
+        __atomic_store_n( &p_shard->b_die, 1, __ATOMIC_RELEASE );
+        ev_async_send( p_shard->p_loop, &p_shard->wakeup_watcher );
+        pthread_join( p_shard->thread, NULL );
+        block_Collect( &p_shard->p_garbage );
+
+        ev_loop_destroy( p_shard->p_loop );
+        pthread_mutex_destroy( &p_shard->lock );
+        ring_Clean( &p_shard->queue );
+        ring_Clean( &p_shard->free_ring );
+        free( p_shard->p_batches );
+    }
+
+    free( p_shards );
+    p_shards = NULL;
+    i_nb_shards = 0;
+}
+
+/*****************************************************************************
+ * demux_DecodeHeaders : gathers the packets of a batch, and decodes their TS
+ * headers into headers (8 at a time with SSE2 or NEON)
+ *****************************************************************************/
+static void demux_DecodeHeaders( block_t *p_list )
+{
+    ts_headers_t *p = &headers;
+    unsigned int i = 0;
+
+    for ( ; p_list != NULL; p_list = p_list->p_next, i++ )
+    {
+        if ( i == p->i_size )
+        {
+            p->i_size = p->i_size ? 2 * p->i_size : HEADERS_MIN;
+            p->pp_blocks = realloc( p->pp_blocks,
+                                    p->i_size * sizeof(block_t *) );
+            p->pi_words = realloc( p->pi_words, p->i_size * sizeof(uint32_t) );
+            p->pi_pids = realloc( p->pi_pids, p->i_size * sizeof(uint16_t) );
+            p->pi_flags = realloc( p->pi_flags, p->i_size );
+            p->pi_ccs = realloc( p->pi_ccs, p->i_size );
+        }
+        p->pp_blocks[i] = p_list;
+        memcpy( &p->pi_words[i], p_list->p_ts, sizeof(uint32_t) );
+    }
+    p->i_nb = i;
+    i = 0;
+
+#if defined(__SSE2__)
+    {
+        const __m128i low = _mm_set1_epi32( 0xff );
+        const __m128i sync = _mm_set1_epi32( 0x47 );
+        const __m128i nosync = _mm_set1_epi32( TS_HEADER_NOSYNC );
+        const __m128i pid_high = _mm_set1_epi32( 0x1f00 );
+        const __m128i flags = _mm_set1_epi32( TS_HEADER_TEI
+                                              | TS_HEADER_UNITSTART );
+
+        for ( ; i + 8 <= p->i_nb; i += 8 )
+        {
+            __m128i w0 = _mm_loadu_si128( (const __m128i *)&p->pi_words[i] );
+            __m128i w1 = _mm_loadu_si128( (const __m128i *)&p->pi_words[i + 4] );
+            __m128i pid0, pid1, flags0, flags1, cc;
+
+            pid0 = _mm_or_si128( _mm_and_si128( w0, pid_high ),
+                                 _mm_and_si128( _mm_srli_epi32( w0, 16 ), low ) );
+            pid1 = _mm_or_si128( _mm_and_si128( w1, pid_high ),
+                                 _mm_and_si128( _mm_srli_epi32( w1, 16 ), low ) );
+            _mm_storeu_si128( (__m128i *)&p->pi_pids[i],
+                              _mm_packs_epi32( pid0, pid1 ) );
+
+            flags0 = _mm_or_si128( _mm_and_si128( _mm_srli_epi32( w0, 8 ),
+                                                  flags ),
+                        _mm_andnot_si128( _mm_cmpeq_epi32(
+                                _mm_and_si128( w0, low ), sync ), nosync ) );
+            flags1 = _mm_or_si128( _mm_and_si128( _mm_srli_epi32( w1, 8 ),
+                                                  flags ),
+                        _mm_andnot_si128( _mm_cmpeq_epi32(
+                                _mm_and_si128( w1, low ), sync ), nosync ) );
+            flags0 = _mm_packs_epi32( flags0, flags1 );
+            _mm_storel_epi64( (__m128i *)&p->pi_flags[i],
+                              _mm_packus_epi16( flags0, flags0 ) );
+
+            cc = _mm_packs_epi32( _mm_srli_epi32( w0, 24 ),
+                                  _mm_srli_epi32( w1, 24 ) );
+            _mm_storel_epi64( (__m128i *)&p->pi_ccs[i],
+                              _mm_packus_epi16( cc, cc ) );
+        }
+    }
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    {
+        const uint32x4_t low = vdupq_n_u32( 0xff );
+        const uint32x4_t sync = vdupq_n_u32( 0x47 );
+        const uint32x4_t nosync = vdupq_n_u32( TS_HEADER_NOSYNC );
+        const uint32x4_t pid_high = vdupq_n_u32( 0x1f00 );
+        const uint32x4_t flags = vdupq_n_u32( TS_HEADER_TEI
+                                              | TS_HEADER_UNITSTART );
+
+        for ( ; i + 8 <= p->i_nb; i += 8 )
+        {
+            uint32x4_t w0 = vld1q_u32( &p->pi_words[i] );
+            uint32x4_t w1 = vld1q_u32( &p->pi_words[i + 4] );
+            uint32x4_t pid0, pid1, flags0, flags1;
+
+            pid0 = vorrq_u32( vandq_u32( w0, pid_high ),
+                              vandq_u32( vshrq_n_u32( w0, 16 ), low ) );
+            pid1 = vorrq_u32( vandq_u32( w1, pid_high ),
+                              vandq_u32( vshrq_n_u32( w1, 16 ), low ) );
+            vst1q_u16( &p->pi_pids[i], vcombine_u16( vmovn_u32( pid0 ),
+                                                     vmovn_u32( pid1 ) ) );
+
+            flags0 = vorrq_u32( vandq_u32( vshrq_n_u32( w0, 8 ), flags ),
+                        vbicq_u32( nosync,
+                                   vceqq_u32( vandq_u32( w0, low ), sync ) ) );
+            flags1 = vorrq_u32( vandq_u32( vshrq_n_u32( w1, 8 ), flags ),
+                        vbicq_u32( nosync,
+                                   vceqq_u32( vandq_u32( w1, low ), sync ) ) );
+            vst1_u8( &p->pi_flags[i],
+                     vmovn_u16( vcombine_u16( vmovn_u32( flags0 ),
+                                              vmovn_u32( flags1 ) ) ) );
+
+            vst1_u8( &p->pi_ccs[i],
+                     vmovn_u16( vcombine_u16(
+                             vmovn_u32( vshrq_n_u32( w0, 24 ) ),
+                             vmovn_u32( vshrq_n_u32( w1, 24 ) ) ) ) );
+        }
+    }
+#endif
+
+    for ( ; i < p->i_nb; i++ )
+    {
+        const uint8_t *p_header = (const uint8_t *)&p->pi_words[i];
+
+        p->pi_pids[i] = ((p_header[1] & 0x1f) << 8) | p_header[2];
+        p->pi_flags[i] = (p_header[1] & (TS_HEADER_TEI | TS_HEADER_UNITSTART))
+                          | (p_header[0] != 0x47 ? TS_HEADER_NOSYNC : 0);
+        p->pi_ccs[i] = p_header[3];
+    }
+}
+
 /*****************************************************************************
  * demux_Run
  *****************************************************************************/
 void demux_Run( block_t *p_ts )
 {
+    int i;
+
     i_wallclock = mdate();
-    mrtgAnalyse( p_ts );
-    SetDTS( p_ts );
+    demux_DecodeHeaders( p_ts );
+    SetDTS( &headers );
+    demux_Publish();
 
-    while ( p_ts != NULL )
+    for ( i = 0; i < headers.i_nb; i++ )
     {
-        block_t *p_next = p_ts->p_next;
+        p_ts = headers.pp_blocks[i];
         p_ts->p_next = NULL;
-        demux_Handle( p_ts );
-        p_ts = p_next;
+        demux_Handle( p_ts, headers.pi_pids[i], headers.pi_flags[i],
+                      headers.pi_ccs[i] );
+        if ( i_nb_unshard_pids )
+            demux_UnshardPending();
+    }
+
+    demux_UpdateStats( &pending_stats, i_wallclock );
+
+    for ( i = 0; i < i_nb_shards; i++ )
+    {
+        demux_ShardCommit( &p_shards[i] );
+        block_Collect( &p_shards[i].p_garbage );
     }
+
+    /* The EIT buffers are otherwise flushed by the packets of the output. */
+    if ( i_nb_shards )
+        for ( i = 0; i < i_nb_outputs; i++ )
+        {
+            output_t *p_output = pp_outputs[i];
+            if ( (p_output->config.i_config & OUTPUT_VALID)
+                  && p_output->p_eit_ts_buffer != NULL
+                  && i_last_dts > p_output->p_eit_ts_buffer->i_dts
+                                   + MAX_EIT_RETENTION )
+                FlushEIT( p_output, i_last_dts );
+        }
+
+    outputs_Commit();
 }
 
 /*****************************************************************************
  * demux_Handle
  *****************************************************************************/
-static void demux_Handle( block_t *p_ts )
+static void demux_Handle( block_t *p_ts, uint16_t i_pid, uint8_t i_flags,
+                          uint8_t i_cc_byte )
 {
-    uint16_t i_pid = ts_get_pid( p_ts->p_ts );
     ts_pid_t *p_pid = &p_pids[i_pid];
-    uint8_t i_cc = ts_get_cc( p_ts->p_ts );
+    uint8_t i_cc = i_cc_byte & 0xf;
+    bool b_scrambled = !!(i_cc_byte & 0xc0);
     int i;
 
     i_nb_packets++;
+    if ( b_mrtg )
+        mrtgCount( i_pid, i_flags, i_cc_byte );
 
-    if ( !ts_validate( p_ts->p_ts ) )
+    if ( i_flags & TS_HEADER_NOSYNC )
     {
         msg_Warn( NULL, "lost TS sync" );
         block_Delete( p_ts );
@@ -514,45 +1422,24 @@ static void demux_Handle( block_t *p_ts )
         return;
     }
 
-    if ( i_pid != PADDING_PID )
-        p_pid->info.i_scrambling = ts_get_scrambling( p_ts->p_ts );
-
-    p_pid->info.i_last_packet_ts = i_wallclock;
-    p_pid->info.i_packets++;
-
-    p_pid->i_packets_passed++;
-
-    /* Calculate bytes_per_sec */
-    if ( i_wallclock > p_pid->i_bytes_ts + 1000000 ) {
-        p_pid->info.i_bytes_per_sec = p_pid->i_packets_passed * TS_SIZE;
-        p_pid->i_packets_passed = 0;
-        p_pid->i_bytes_ts = i_wallclock;
-    }
-
-    if ( p_pid->info.i_first_packet_ts == 0 )
-        p_pid->info.i_first_packet_ts = i_wallclock;
-
-    if ( i_pid != PADDING_PID && p_pid->i_last_cc != -1
-          && !ts_check_duplicate( i_cc, p_pid->i_last_cc )
-          && ts_check_discontinuity( i_cc, p_pid->i_last_cc ) )
+    if ( p_pid->p_fanout == NULL
+          && demux_Account( p_pid, i_pid, i_flags, i_cc_byte,
+                            &pending_stats ) )
     {
         unsigned int expected_cc = (p_pid->i_last_cc + 1) & 0x0f;
         uint16_t i_sid = 0;
         const char *pid_desc = get_pid_desc(i_pid, &i_sid);
 
-        p_pid->info.i_cc_errors++;
-        i_nb_discontinuities++;
-
         msg_Warn( NULL, "TS discontinuity on pid %4hu expected_cc %2u got %2u (%s, sid %d)",
                 i_pid, expected_cc, i_cc, pid_desc, i_sid );
     }
 
-    if ( ts_get_transporterror( p_ts->p_ts ) )
+    if ( i_flags & TS_HEADER_TEI )
     {
         uint16_t i_sid = 0;
         const char *pid_desc = get_pid_desc(i_pid, &i_sid);
 
-        p_pid->info.i_transport_errors++;
+        p_pids_cold[i_pid].info.i_transport_errors++;
 
         msg_Warn( NULL, "transport_error_indicator on pid %hu (%s, sid %u)",
                    i_pid, pid_desc, i_sid );
@@ -582,12 +1469,19 @@ static void demux_Handle( block_t *p_ts )
         pf_Reset();
     }
 
+    if ( p_pid->p_fanout != NULL )
+    {
+        demux_ShardPut( i_pid, p_ts );
+        return;
+    }
+
     if ( i_es_timeout )
     {
+        ts_pid_cold_t *p_cold = &p_pids_cold[i_pid];
         int i_pes_status = -1;
-        if ( ts_get_scrambling( p_ts->p_ts ) )
+        if ( b_scrambled )
             i_pes_status = 0;
-        else if ( ts_get_unitstart( p_ts->p_ts ) )
+        else if ( i_flags & TS_HEADER_UNITSTART )
         {
             uint8_t *p_payload = ts_payload( p_ts->p_ts );
             if ( p_payload + 3 < p_ts->p_ts + TS_SIZE )
@@ -596,38 +1490,38 @@ static void demux_Handle( block_t *p_ts )
 
         if ( i_pes_status != -1 )
         {
-            if ( p_pid->i_pes_status == -1 )
+            if ( p_cold->i_pes_status == -1 )
             {
-                p_pid->i_pes_status = i_pes_status;
+                p_cold->i_pes_status = i_pes_status;
                 PrintES( i_pid );
 
                 if ( i_pid != TDT_PID )
                 {
-                    ev_timer_init( &p_pid->timeout_watcher, PrintESCb,
+                    ev_timer_init( &p_cold->timeout_watcher, PrintESCb,
                                    i_es_timeout / 1000000.,
                                    i_es_timeout / 1000000. );
-                    ev_timer_start( event_loop, &p_pid->timeout_watcher );
+                    ev_timer_start( event_loop, &p_cold->timeout_watcher );
                 }
                 else
                 {
-                    ev_timer_init( &p_pid->timeout_watcher, PrintESCb, 30, 30 );
-                    ev_timer_start( event_loop, &p_pid->timeout_watcher );
+                    ev_timer_init( &p_cold->timeout_watcher, PrintESCb, 30, 30 );
+                    ev_timer_start( event_loop, &p_cold->timeout_watcher );
                 }
             }
             else
             {
-                if ( p_pid->i_pes_status != i_pes_status )
+                if ( p_cold->i_pes_status != i_pes_status )
                 {
-                    p_pid->i_pes_status = i_pes_status;
+                    p_cold->i_pes_status = i_pes_status;
                     PrintES( i_pid );
                 }
 
-                ev_timer_again( event_loop, &p_pid->timeout_watcher );
+                ev_timer_again( event_loop, &p_cold->timeout_watcher );
             }
         }
     }
 
-    if ( !ts_get_transporterror( p_ts->p_ts ) )
+    if ( !(i_flags & TS_HEADER_TEI) )
     {
         /* PSI parsing */
         if ( i_pid == TDT_PID || i_pid == RST_PID )
@@ -648,11 +1542,11 @@ static void demux_Handle( block_t *p_ts )
         if ( p_output != NULL )
         {
             if ( i_ca_handle && (p_output->config.i_config & OUTPUT_WATCH) &&
-                 ts_get_unitstart( p_ts->p_ts ) )
+                 (i_flags & TS_HEADER_UNITSTART) )
             {
                 uint8_t *p_payload;
 
-                if ( ts_get_scrambling( p_ts->p_ts ) ||
+                if ( b_scrambled ||
                      ( p_pid->b_pes
                         && (p_payload = ts_payload( p_ts->p_ts )) + 3
                              < p_ts->p_ts + TS_SIZE
@@ -706,22 +1600,13 @@ static void demux_Handle( block_t *p_ts )
         }
     }
 
-    for ( i = 0; i < i_nb_outputs; i++ )
-    {
-        output_t *p_output = pp_outputs[i];
-
-        if ( !(p_output->config.i_config & OUTPUT_VALID) ||
-             !p_output->config.b_passthrough )
-            continue;
-
-        output_Put( p_output, p_ts );
-    }
+    for ( i = 0; i < i_nb_passthrough_outputs; i++ )
+        output_Put( pp_passthrough_outputs[i], p_ts );
 
     if ( output_dup.config.i_config & OUTPUT_VALID )
         output_Put( &output_dup, p_ts );
 
-    p_ts->i_refcount--;
-    if ( !p_ts->i_refcount )
+    if ( !block_Unref( p_ts ) )
         block_Delete( p_ts );
 }
 
@@ -768,7 +1653,11 @@ void demux_Change( output_t *p_output, const output_config_t *p_config )
         p_output->config.pi_confpids[I_SPUPID] != p_config->pi_confpids[I_SPUPID];
     int i;
 
+    /* OUTPUT_WATCH and the thread running the output may change. */
+    b_fanouts_dirty = true;
+
     p_output->config.i_config = p_config->i_config;
+    IndexOutput( p_output );
     p_output->config.i_network_id = p_config->i_network_id;
     p_output->config.i_new_sid = p_config->i_new_sid;
     p_output->config.i_onid = p_config->i_onid;
@@ -818,6 +1707,7 @@ void demux_Change( output_t *p_output, const output_config_t *p_config )
     {
         sid_t *p_old_sid = FindSID( i_old_sid );
         p_output->config.i_sid = p_config->i_sid;
+        IndexOutput( p_output );
 
         if ( p_old_sid != NULL )
         {
@@ -866,6 +1756,7 @@ void demux_Change( output_t *p_output, const output_config_t *p_config )
     {
         sid_t *p_sid = FindSID( i_sid );
         p_output->config.i_sid = i_old_sid;
+        IndexOutput( p_output );
 
         if ( p_sid != NULL )
         {
@@ -887,8 +1778,11 @@ void demux_Change( output_t *p_output, const output_config_t *p_config )
             en50221_UpdatePMT( p_sid->p_current_pmt );
     }
 
+    if ( p_config->b_passthrough != p_output->config.b_passthrough )
+        SetPassthrough( p_output, p_config->b_passthrough );
     p_output->config.b_passthrough = p_config->b_passthrough;
     p_output->config.i_sid = i_sid;
+    IndexOutput( p_output );
     free( p_output->config.pi_pids );
     p_output->config.pi_pids = malloc( sizeof(uint16_t) * i_nb_pids );
     memcpy( p_output->config.pi_pids, pi_pids, sizeof(uint16_t) * i_nb_pids );
@@ -929,17 +1823,10 @@ out_change:
 /*****************************************************************************
  * SetDTS
  *****************************************************************************/
-static void SetDTS( block_t *p_list )
+static void SetDTS( const ts_headers_t *p_headers )
 {
-    int i_nb_ts = 0, i;
+    int i_nb_ts = p_headers->i_nb, i;
     mtime_t i_duration;
-    block_t *p_ts = p_list;
-
-    while ( p_ts != NULL )
-    {
-        i_nb_ts++;
-        p_ts = p_ts->p_next;
-    }
 
     /* We suppose the stream is CBR, at least between two consecutive read().
      * This is especially true in budget mode */
@@ -948,14 +1835,9 @@ static void SetDTS( block_t *p_list )
     else
         i_duration = i_wallclock - i_last_dts;
 
-    p_ts = p_list;
-    i = i_nb_ts - 1;
-    while ( p_ts != NULL )
-    {
-        p_ts->i_dts = i_wallclock - i_duration * i / i_nb_ts;
-        i--;
-        p_ts = p_ts->p_next;
-    }
+    for ( i = 0; i < i_nb_ts; i++ )
+        p_headers->pp_blocks[i]->i_dts =
+            i_wallclock - i_duration * (i_nb_ts - 1 - i) / i_nb_ts;
 
     i_last_dts = i_wallclock;
 }
@@ -965,29 +1847,31 @@ static void SetDTS( block_t *p_list )
  *****************************************************************************/
 static void SetPID( uint16_t i_pid )
 {
-    p_pids[i_pid].i_refcount++;
+    p_pids_cold[i_pid].i_refcount++;
 
-    if ( !b_budget_mode && p_pids[i_pid].i_refcount
-          && p_pids[i_pid].i_demux_fd == -1 )
-        p_pids[i_pid].i_demux_fd = pf_SetFilter( i_pid );
+    if ( !b_budget_mode && p_pids_cold[i_pid].i_refcount
+          && p_pids_cold[i_pid].i_demux_fd == -1 )
+        p_pids_cold[i_pid].i_demux_fd = pf_SetFilter( i_pid );
 }
 
 static void SetPID_EMM( uint16_t i_pid )
 {
     SetPID( i_pid );
     p_pids[i_pid].b_emm = true;
+    demux_Unshard( i_pid );
 }
 
 static void UnsetPID( uint16_t i_pid )
 {
-    p_pids[i_pid].i_refcount--;
+    p_pids_cold[i_pid].i_refcount--;
 
-    if ( !b_budget_mode && !p_pids[i_pid].i_refcount
-          && p_pids[i_pid].i_demux_fd != -1 )
+    if ( !b_budget_mode && !p_pids_cold[i_pid].i_refcount
+          && p_pids_cold[i_pid].i_demux_fd != -1 )
     {
-        pf_UnsetFilter( p_pids[i_pid].i_demux_fd, i_pid );
-        p_pids[i_pid].i_demux_fd = -1;
+        pf_UnsetFilter( p_pids_cold[i_pid].i_demux_fd, i_pid );
+        p_pids_cold[i_pid].i_demux_fd = -1;
         p_pids[i_pid].b_emm = false;
+        b_fanouts_dirty = true;
     }
 }
 
@@ -1016,6 +1900,7 @@ static void StartPID( output_t *p_output, uint16_t i_pid )
                                                 * p_pids[i_pid].i_nb_outputs );
         }
 
+        demux_Unshard( i_pid );
         p_pids[i_pid].pp_outputs[j] = p_output;
         SetPID( i_pid );
     }
@@ -1036,46 +1921,77 @@ static void StopPID( output_t *p_output, uint16_t i_pid )
 
     if ( j != p_pids[i_pid].i_nb_outputs )
     {
+        demux_Unshard( i_pid );
         p_pids[i_pid].pp_outputs[j] = NULL;
         UnsetPID( i_pid );
     }
 }
 
+/*****************************************************************************
+ * SetPassthrough: adds or removes an output from the passthrough list
+ *****************************************************************************/
+static void SetPassthrough( output_t *p_output, bool b_passthrough )
+{
+    int i;
+
+    demux_UnshardAll();
+    b_fanouts_dirty = true;
+
+    if ( b_passthrough )
+    {
+        i_nb_passthrough_outputs++;
+        pp_passthrough_outputs = realloc( pp_passthrough_outputs,
+                                          sizeof(output_t *)
+                                          * i_nb_passthrough_outputs );
+        pp_passthrough_outputs[i_nb_passthrough_outputs - 1] = p_output;
+        return;
+    }
+
+    for ( i = 0; i < i_nb_passthrough_outputs; i++ )
+    {
+        if ( pp_passthrough_outputs[i] == p_output )
+        {
+            /* Order doesn't matter, move the last one here. */
+            pp_passthrough_outputs[i] =
+                pp_passthrough_outputs[--i_nb_passthrough_outputs];
+            break;
+        }
+    }
+}
+
 /*****************************************************************************
  * SelectPID/UnselectPID
  *****************************************************************************/
 static void SelectPID( uint16_t i_sid, uint16_t i_pid, bool b_pcr )
 {
+    sid_outputs_t *p_list = &p_sid_outputs[i_sid];
     int i;
 
-    for ( i = 0; i < i_nb_outputs; i++ )
+    for ( i = 0; i < p_list->i_nb_outputs; i++ )
     {
-        if ( (pp_outputs[i]->config.i_config & OUTPUT_VALID)
-              && pp_outputs[i]->config.i_sid == i_sid )
+        output_t *p_output = p_list->pp_outputs[i];
+
+        if ( p_output->config.i_nb_pids &&
+            !IsIn( p_output->config.pi_pids,
+                   p_output->config.i_nb_pids, i_pid ) )
         {
-            if ( pp_outputs[i]->config.i_nb_pids &&
-                !IsIn( pp_outputs[i]->config.pi_pids,
-                       pp_outputs[i]->config.i_nb_pids, i_pid ) )
-            {
-                if ( b_pcr )
-                    pp_outputs[i]->i_pcr_pid = i_pid;
-                else
-                    continue;
-            }
-            StartPID( pp_outputs[i], i_pid );
+            if ( b_pcr )
+                p_output->i_pcr_pid = i_pid;
+            else
+                continue;
         }
+        StartPID( p_output, i_pid );
     }
 }
 
 static void UnselectPID( uint16_t i_sid, uint16_t i_pid )
 {
+    sid_outputs_t *p_list = &p_sid_outputs[i_sid];
     int i;
 
-    for ( i = 0; i < i_nb_outputs; i++ )
-        if ( (pp_outputs[i]->config.i_config & OUTPUT_VALID)
-              && pp_outputs[i]->config.i_sid == i_sid
-              && !pp_outputs[i]->config.i_nb_pids )
-            StopPID( pp_outputs[i], i_pid );
+    for ( i = 0; i < p_list->i_nb_outputs; i++ )
+        if ( !p_list->pp_outputs[i]->config.i_nb_pids )
+            StopPID( p_list->pp_outputs[i], i_pid );
 }
 
 /*****************************************************************************
@@ -1085,15 +2001,14 @@ static void SelectPMT( uint16_t i_sid, uint16_t i_pid )
 {
     int i;
 
+    demux_Unshard( i_pid );
     p_pids[i_pid].i_psi_refcount++;
     p_pids[i_pid].b_pes = false;
 
     if ( b_select_pmts )
         SetPID( i_pid );
-    else for ( i = 0; i < i_nb_outputs; i++ )
-        if ( (pp_outputs[i]->config.i_config & OUTPUT_VALID)
-              && pp_outputs[i]->config.i_sid == i_sid )
-            SetPID( i_pid );
+    else for ( i = 0; i < p_sid_outputs[i_sid].i_nb_outputs; i++ )
+        SetPID( i_pid );
 }
 
 static void UnselectPMT( uint16_t i_sid, uint16_t i_pid )
@@ -1102,15 +2017,15 @@ static void UnselectPMT( uint16_t i_sid, uint16_t i_pid )
 
     p_pids[i_pid].i_psi_refcount--;
     if ( !p_pids[i_pid].i_psi_refcount )
-        psi_assemble_reset( &p_pids[i_pid].p_psi_buffer,
-                            &p_pids[i_pid].i_psi_buffer_used );
+    {
+        AssembleReset( &p_pids_cold[i_pid] );
+        b_fanouts_dirty = true;
+    }
 
     if ( b_select_pmts )
         UnsetPID( i_pid );
-    else for ( i = 0; i < i_nb_outputs; i++ )
-        if ( (pp_outputs[i]->config.i_config & OUTPUT_VALID)
-              && pp_outputs[i]->config.i_sid == i_sid )
-            UnsetPID( i_pid );
+    else for ( i = 0; i < p_sid_outputs[i_sid].i_nb_outputs; i++ )
+        UnsetPID( i_pid );
 }
 
 /*****************************************************************************
@@ -1251,37 +2166,256 @@ static void OutputPSISection( output_t *p_output, uint8_t *p_section,
 
         psi_split_section( p, &i_ts_offset, p_section, &i_section_offset );
 
-        if ( !b_append )
-        {
-            ts_set_pid( p, i_pid );
-            ts_set_cc( p, *pi_cc );
-            (*pi_cc)++;
-            *pi_cc &= 0xf;
-        }
+        if ( !b_append )
+        {
+            ts_set_pid( p, i_pid );
+            ts_set_cc( p, *pi_cc );
+            (*pi_cc)++;
+            *pi_cc &= 0xf;
+        }
+
+        if ( i_section_offset == i_section_length )
+        {
+            if ( i_ts_offset < TS_SIZE - MIN_SECTION_FRAGMENT
+                  && pp_ts_buffer != NULL )
+            {
+                *pp_ts_buffer = p_block;
+                *pi_ts_buffer_offset = i_ts_offset;
+                break;
+            }
+            else
+                psi_split_end( p, &i_ts_offset );
+        }
+
+        p_block->i_dts = i_dts;
+        p_block->i_refcount--;
+        output_Put( p_output, p_block );
+        if ( pp_ts_buffer != NULL )
+        {
+            *pp_ts_buffer = NULL;
+            *pi_ts_buffer_offset = 0;
+        }
+    }
+    while ( i_section_offset < i_section_length );
+}
+
+/*****************************************************************************
+ * PSIShareKeyInit/Append/String : build the key of the section about to be
+ * generated, from the configuration of the output and the input tables
+ *****************************************************************************/
+static void PSIShareKeyAppend( const void *p_data, size_t i_size )
+{
+    if ( !i_size )
+        return;
+    if ( i_share_key_size + i_size > i_share_key_alloc )
+    {
+        i_share_key_alloc = (i_share_key_size + i_size) * 2;
+        p_share_key = realloc( p_share_key, i_share_key_alloc );
+    }
+    memcpy( p_share_key + i_share_key_size, p_data, i_size );
+    i_share_key_size += i_size;
+}
+
+static void PSIShareKeyString( const dvb_string_t *p_string )
+{
+    PSIShareKeyAppend( &p_string->i, sizeof(p_string->i) );
+    PSIShareKeyAppend( p_string->p, p_string->i );
+}
+
+static void PSIShareKeyInit( int i_table, const psi_share_key_t *p_key )
+{
+    i_share_table = i_table;
+    i_share_key_size = 0;
+    PSIShareKeyAppend( p_key, sizeof(psi_share_key_t) );
+}
+
+static uint32_t PSIShareHash( void )
+{
+    uint32_t i_hash = 2166136261U; /* FNV-1a */
+    size_t i;
+
+    for ( i = 0; i < i_share_key_size; i++ )
+        i_hash = (i_hash ^ p_share_key[i]) * 16777619U;
+    return i_hash;
+}
+
+/*****************************************************************************
+ * PSIShareGet : looks up a section generated for the current key. Its
+ * version must differ from the one last sent on the output, otherwise
+ * the receivers would miss the change.
+ *****************************************************************************/
+static bool PSIShareGet( psi_share_t **pp_share, uint8_t **pp_section,
+                         uint8_t *pi_version )
+{
+    uint32_t i_hash = PSIShareHash();
+    psi_share_t *p_share;
+
+    for ( p_share = pp_psi_shares[i_share_table][i_hash % PSI_SHARE_BUCKETS];
+          p_share != NULL; p_share = p_share->p_next )
+    {
+        if ( p_share->i_hash != i_hash
+              || p_share->i_key_size != i_share_key_size
+              || memcmp( p_share->p_key, p_share_key, i_share_key_size )
+              || psi_get_version( p_share->p_section )
+                  == (*pi_version & 0x1f) )
+            continue;
+
+        p_share->i_refcount++;
+        *pp_share = p_share;
+        *pp_section = p_share->p_section;
+        *pi_version = psi_get_version( p_share->p_section );
+        return true;
+    }
+    return false;
+}
+
+/*****************************************************************************
+ * PSIShareAdd : makes a section generated for the current key available
+ * to the other outputs, and splits it into TS packets
+ *****************************************************************************/
+static psi_share_t *PSIShareAdd( uint8_t *p_section, uint16_t i_sid )
+{
+    psi_share_t *p_share = malloc( sizeof(psi_share_t) );
+    uint16_t i_section_length = psi_get_length(p_section) + PSI_HEADER_SIZE;
+    uint16_t i_section_offset = 0;
+    psi_share_t **pp_bucket;
+
+    p_share->i_refcount = 1;
+    p_share->i_table = i_share_table;
+    p_share->i_sid = i_sid;
+    p_share->i_hash = PSIShareHash();
+    p_share->i_key_size = i_share_key_size;
+    p_share->p_key = malloc( i_share_key_size );
+    memcpy( p_share->p_key, p_share_key, i_share_key_size );
+    p_share->p_section = p_section;
+    p_share->p_packets = NULL;
+    p_share->i_nb_packets = 0;
+
+    do
+    {
+        uint8_t i_ts_offset = 0;
+        uint8_t *p;
+
+        p_share->p_packets = realloc( p_share->p_packets,
+                                      (p_share->i_nb_packets + 1) * TS_SIZE );
+        p = p_share->p_packets + p_share->i_nb_packets++ * TS_SIZE;
+
+        psi_split_section( p, &i_ts_offset, p_section, &i_section_offset );
+        if ( i_section_offset == i_section_length )
+            psi_split_end( p, &i_ts_offset );
+    }
+    while ( i_section_offset < i_section_length );
+
+    pp_bucket = &pp_psi_shares[i_share_table][p_share->i_hash
+                                                % PSI_SHARE_BUCKETS];
+    p_share->p_next = *pp_bucket;
+    p_share->b_hashed = true;
+    *pp_bucket = p_share;
+    return p_share;
+}
+
+/*****************************************************************************
+ * PSIShareUnhash
+ *****************************************************************************/
+static void PSIShareUnhash( psi_share_t *p_share )
+{
+    psi_share_t **pp_share = &pp_psi_shares[p_share->i_table][p_share->i_hash
+                                                    % PSI_SHARE_BUCKETS];
+
+    while ( *pp_share != p_share )
+        pp_share = &(*pp_share)->p_next;
+    *pp_share = p_share->p_next;
+    p_share->b_hashed = false;
+}
+
+/*****************************************************************************
+ * PSIShareRelease
+ *****************************************************************************/
+static void PSIShareRelease( psi_share_t **pp_share )
+{
+    psi_share_t *p_share = *pp_share;
+
+    *pp_share = NULL;
+    if ( p_share == NULL || --p_share->i_refcount )
+        return;
+
+    if ( p_share->b_hashed )
+        PSIShareUnhash( p_share );
+    free( p_share->p_key );
+    free( p_share->p_section );
+    free( p_share->p_packets );
+    free( p_share );
+}
+
+/*****************************************************************************
+ * PSIShareRetire : prevents the reuse of the sections generated from an
+ * input table which changed; their current users keep them until they
+ * are regenerated
+ *****************************************************************************/
+static void PSIShareRetire( int i_table, uint16_t i_sid )
+{
+    int i;
+
+    for ( i = 0; i < PSI_SHARE_BUCKETS; i++ )
+    {
+        psi_share_t **pp_share = &pp_psi_shares[i_table][i];
 
-        if ( i_section_offset == i_section_length )
+        while ( *pp_share != NULL )
         {
-            if ( i_ts_offset < TS_SIZE - MIN_SECTION_FRAGMENT
-                  && pp_ts_buffer != NULL )
+            psi_share_t *p_share = *pp_share;
+            if ( p_share->i_sid == i_sid )
             {
-                *pp_ts_buffer = p_block;
-                *pi_ts_buffer_offset = i_ts_offset;
-                break;
+                *pp_share = p_share->p_next;
+                p_share->b_hashed = false;
             }
             else
-                psi_split_end( p, &i_ts_offset );
+                pp_share = &p_share->p_next;
         }
+    }
+}
+
+/*****************************************************************************
+ * demux_CloseOutput : called when an output is closed
+ *****************************************************************************/
+void demux_CloseOutput( output_t *p_output )
+{
+    p_output->config.i_config &= ~OUTPUT_VALID;
+    IndexOutput( p_output );
+
+    PSIShareRelease( &p_output->p_pat_share );
+    PSIShareRelease( &p_output->p_pmt_share );
+    PSIShareRelease( &p_output->p_nit_share );
+    PSIShareRelease( &p_output->p_sdt_share );
+    p_output->p_pat_section = NULL;
+    p_output->p_pmt_section = NULL;
+    p_output->p_nit_section = NULL;
+    p_output->p_sdt_section = NULL;
+}
+
+/*****************************************************************************
+ * OutputPSIPackets : sends a generated section, only the PID and CC of its
+ * packets are set for each repetition
+ *****************************************************************************/
+static void OutputPSIPackets( output_t *p_output, const psi_share_t *p_share,
+                              uint16_t i_pid, uint8_t *pi_cc, mtime_t i_dts )
+{
+    int i;
+
+    for ( i = 0; i < p_share->i_nb_packets; i++ )
+    {
+        block_t *p_block = block_New();
+        uint8_t *p = p_block->p_ts;
+
+        memcpy( p, p_share->p_packets + i * TS_SIZE, TS_SIZE );
+        ts_set_pid( p, i_pid );
+        ts_set_cc( p, *pi_cc );
+        (*pi_cc)++;
+        *pi_cc &= 0xf;
 
         p_block->i_dts = i_dts;
         p_block->i_refcount--;
         output_Put( p_output, p_block );
-        if ( pp_ts_buffer != NULL )
-        {
-            *pp_ts_buffer = NULL;
-            *pi_ts_buffer_offset = 0;
-        }
     }
-    while ( i_section_offset < i_section_length );
 }
 
 /*****************************************************************************
@@ -1303,24 +2437,37 @@ static void SendPAT( mtime_t i_dts )
              psi_table_validate(pp_current_pat_sections) )
         {
             /* SID doesn't exist - build an empty PAT. */
-            uint8_t *p;
-            p_output->i_pat_version++;
+            psi_share_key_t key;
 
-            p = p_output->p_pat_section = psi_allocate();
-            pat_init( p );
-            pat_set_length( p, 0 );
-            pat_set_tsid( p, p_output->i_tsid );
-            psi_set_version( p, p_output->i_pat_version );
-            psi_set_current( p );
-            psi_set_section( p, 0 );
-            psi_set_lastsection( p, 0 );
-            psi_set_crc( p_output->p_pat_section );
+            memset( &key, 0, sizeof(key) );
+            key.i_tsid = p_output->i_tsid;
+            PSIShareKeyInit( PSI_SHARE_PAT, &key );
+
+            if ( !PSIShareGet( &p_output->p_pat_share,
+                               &p_output->p_pat_section,
+                               &p_output->i_pat_version ) )
+            {
+                uint8_t *p;
+                p_output->i_pat_version++;
+
+                p = p_output->p_pat_section = psi_allocate();
+                pat_init( p );
+                pat_set_length( p, 0 );
+                pat_set_tsid( p, p_output->i_tsid );
+                psi_set_version( p, p_output->i_pat_version );
+                psi_set_current( p );
+                psi_set_section( p, 0 );
+                psi_set_lastsection( p, 0 );
+                psi_set_crc_fast( p_output->p_pat_section );
+                p_output->p_pat_share = PSIShareAdd( p_output->p_pat_section,
+                                                     0 );
+            }
         }
 
 
         if ( p_output->p_pat_section != NULL )
-            OutputPSISection( p_output, p_output->p_pat_section, PAT_PID,
-                              &p_output->i_pat_cc, i_dts, NULL, NULL );
+            OutputPSIPackets( p_output, p_output->p_pat_share, PAT_PID,
+                              &p_output->i_pat_cc, i_dts );
     }
 }
 
@@ -1329,26 +2476,24 @@ static void SendPAT( mtime_t i_dts )
  *****************************************************************************/
 static void SendPMT( sid_t *p_sid, mtime_t i_dts )
 {
+    sid_outputs_t *p_list = &p_sid_outputs[p_sid->i_sid];
     int i;
     int i_pmt_pid = p_sid->i_pmt_pid;
 
     if ( b_do_remap )
         i_pmt_pid = pi_newpids[ I_PMTPID ];
 
-    for ( i = 0; i < i_nb_outputs; i++ )
+    for ( i = 0; i < p_list->i_nb_outputs; i++ )
     {
-        output_t *p_output = pp_outputs[i];
+        output_t *p_output = p_list->pp_outputs[i];
 
-        if ( (p_output->config.i_config & OUTPUT_VALID)
-               && p_output->config.i_sid == p_sid->i_sid
-               && p_output->p_pmt_section != NULL )
+        if ( p_output->p_pmt_section != NULL )
         {
             if ( p_output->config.b_do_remap && p_output->config.pi_confpids[I_PMTPID] )
                 i_pmt_pid = p_output->config.pi_confpids[I_PMTPID];
 
-            OutputPSISection( p_output, p_output->p_pmt_section,
-                              i_pmt_pid, &p_output->i_pmt_cc, i_dts,
-                              NULL, NULL );
+            OutputPSIPackets( p_output, p_output->p_pmt_share, i_pmt_pid,
+                              &p_output->i_pmt_cc, i_dts );
         }
     }
 }
@@ -1368,8 +2513,8 @@ static void SendNIT( mtime_t i_dts )
                && !p_output->config.b_passthrough
                && (p_output->config.i_config & OUTPUT_DVB)
                && p_output->p_nit_section != NULL )
-            OutputPSISection( p_output, p_output->p_nit_section, NIT_PID,
-                              &p_output->i_nit_cc, i_dts, NULL, NULL );
+            OutputPSIPackets( p_output, p_output->p_nit_share, NIT_PID,
+                              &p_output->i_nit_cc, i_dts );
     }
 }
 
@@ -1388,8 +2533,8 @@ static void SendSDT( mtime_t i_dts )
                && !p_output->config.b_passthrough
                && (p_output->config.i_config & OUTPUT_DVB)
                && p_output->p_sdt_section != NULL )
-            OutputPSISection( p_output, p_output->p_sdt_section, SDT_PID,
-                              &p_output->i_sdt_cc, i_dts, NULL, NULL );
+            OutputPSIPackets( p_output, p_output->p_sdt_share, SDT_PID,
+                              &p_output->i_sdt_cc, i_dts );
     }
 }
 
@@ -1401,17 +2546,20 @@ static void SendEIT( sid_t *p_sid, mtime_t i_dts, uint8_t *p_eit )
     uint8_t i_table_id = psi_get_tableid( p_eit );
     bool b_epg = i_table_id >= EIT_TABLE_ID_SCHED_ACTUAL_FIRST &&
                  i_table_id <= EIT_TABLE_ID_SCHED_ACTUAL_LAST;
+    /* Only the service and TS IDs differ between the outputs, so the CRC
+     * is computed once and then patched */
+    uint8_t p_crc_header[EIT_CRC_HEADER_SIZE];
+    bool b_crc = false;
+    sid_outputs_t *p_list = &p_sid_outputs[p_sid->i_sid];
     int i;
 
-    for ( i = 0; i < i_nb_outputs; i++ )
+    for ( i = 0; i < p_list->i_nb_outputs; i++ )
     {
-        output_t *p_output = pp_outputs[i];
+        output_t *p_output = p_list->pp_outputs[i];
 
-        if ( (p_output->config.i_config & OUTPUT_VALID)
-               && !p_output->config.b_passthrough
+        if ( !p_output->config.b_passthrough
                && (p_output->config.i_config & OUTPUT_DVB)
-               && (!b_epg || (p_output->config.i_config & OUTPUT_EPG))
-               && p_output->config.i_sid == p_sid->i_sid )
+               && (!b_epg || (p_output->config.i_config & OUTPUT_EPG)) )
         {
             eit_set_tsid( p_eit, p_output->i_tsid );
 
@@ -1420,7 +2568,12 @@ static void SendEIT( sid_t *p_sid, mtime_t i_dts, uint8_t *p_eit )
             else
                 eit_set_sid( p_eit, p_output->config.i_sid );
 
-            psi_set_crc( p_eit );
+            if ( b_crc )
+                psi_patch_crc( p_eit, p_crc_header, EIT_CRC_HEADER_SIZE );
+            else
+                psi_set_crc_fast( p_eit );
+            memcpy( p_crc_header, p_eit, EIT_CRC_HEADER_SIZE );
+            b_crc = true;
 
             OutputPSISection( p_output, p_eit, EIT_PID, &p_output->i_eit_cc,
                               i_dts, &p_output->p_eit_ts_buffer,
@@ -1487,10 +2640,10 @@ static void NewPAT( output_t *p_output )
     const uint8_t *p_program;
     uint8_t *p;
     uint8_t k = 0;
+    psi_share_key_t key;
 
-    free( p_output->p_pat_section );
+    PSIShareRelease( &p_output->p_pat_share );
     p_output->p_pat_section = NULL;
-    p_output->i_pat_version++;
 
     if ( !p_output->config.i_sid ) return;
     if ( !psi_table_validate(pp_current_pat_sections) ) return;
@@ -1499,6 +2652,20 @@ static void NewPAT( output_t *p_output )
                                         p_output->config.i_sid );
     if ( p_program == NULL ) return;
 
+    memset( &key, 0, sizeof(key) );
+    key.i_sid = p_output->config.i_sid;
+    key.i_new_sid = p_output->config.i_new_sid;
+    key.i_tsid = p_output->i_tsid;
+    key.i_pmt_pid = patn_get_pid( p_program );
+    key.b_dvb = !!(p_output->config.i_config & OUTPUT_DVB);
+    key.b_do_remap = p_output->config.b_do_remap;
+    key.pi_confpids[I_PMTPID] = p_output->config.pi_confpids[I_PMTPID];
+    PSIShareKeyInit( PSI_SHARE_PAT, &key );
+    if ( PSIShareGet( &p_output->p_pat_share, &p_output->p_pat_section,
+                      &p_output->i_pat_version ) )
+        return;
+    p_output->i_pat_version++;
+
     p = p_output->p_pat_section = psi_allocate();
     pat_init( p );
     psi_set_length( p, PSI_MAX_SIZE );
@@ -1542,7 +2709,9 @@ static void NewPAT( output_t *p_output )
     p = pat_get_program( p_output->p_pat_section, k );
     pat_set_length( p_output->p_pat_section,
                     p - p_output->p_pat_section - PAT_HEADER_SIZE );
-    psi_set_crc( p_output->p_pat_section );
+    psi_set_crc_fast( p_output->p_pat_section );
+    p_output->p_pat_share = PSIShareAdd( p_output->p_pat_section,
+                                         p_output->config.i_sid );
 }
 
 /*****************************************************************************
@@ -1578,6 +2747,14 @@ static void CopyDescriptors( uint8_t *p_descs, uint8_t *p_current_descs )
         descs_set_length( p_descs, p_desc - p_descs - DESCS_HEADER_SIZE );
 }
 
+static bool OutputHasES( output_t *p_output, uint8_t *p_es )
+{
+    if ( !p_output->config.i_nb_pids && PIDWouldBeSelected( p_es ) )
+        return true;
+    return IsIn( p_output->config.pi_pids, p_output->config.i_nb_pids,
+                 pmtn_get_pid( p_es ) );
+}
+
 static void NewPMT( output_t *p_output )
 {
     sid_t *p_sid;
@@ -1586,10 +2763,10 @@ static void NewPMT( output_t *p_output )
     uint8_t *p;
     uint16_t j, k;
     uint16_t i_pcrpid;
+    psi_share_key_t key;
 
-    free( p_output->p_pmt_section );
+    PSIShareRelease( &p_output->p_pmt_share );
     p_output->p_pmt_section = NULL;
-    p_output->i_pmt_version++;
 
     if ( !p_output->config.i_sid ) return;
 
@@ -1599,6 +2776,37 @@ static void NewPMT( output_t *p_output )
     if ( p_sid->p_current_pmt == NULL ) return;
     p_current_pmt = p_sid->p_current_pmt;
 
+    memset( &key, 0, sizeof(key) );
+    key.i_sid = p_output->config.i_sid;
+    key.i_new_sid = p_output->config.i_new_sid;
+    memcpy( &key.i_crc, p_current_pmt + psi_get_length( p_current_pmt )
+                         + PSI_HEADER_SIZE - PSI_CRC_SIZE, PSI_CRC_SIZE );
+    key.b_do_remap = p_output->config.b_do_remap;
+    memcpy( key.pi_confpids, p_output->config.pi_confpids,
+            sizeof(key.pi_confpids) );
+    PSIShareKeyInit( PSI_SHARE_PMT, &key );
+    PSIShareKeyAppend( &p_output->config.i_nb_pids,
+                       sizeof(p_output->config.i_nb_pids) );
+    PSIShareKeyAppend( p_output->config.pi_pids,
+                       p_output->config.i_nb_pids * sizeof(uint16_t) );
+    if ( PSIShareGet( &p_output->p_pmt_share, &p_output->p_pmt_section,
+                      &p_output->i_pmt_version ) )
+    {
+        /* The section is shared, but the PID mapping of the output is
+         * still needed to remap its packets */
+        init_pid_mapping( p_output );
+        if ( b_do_remap || p_output->config.b_do_remap )
+        {
+            j = 0;
+            while ( (p_current_es = pmt_get_es( p_current_pmt, j++ )) != NULL )
+                if ( OutputHasES( p_output, p_current_es ) )
+                    map_es_pid( p_output, p_current_es,
+                                pmtn_get_pid( p_current_es ) );
+        }
+        return;
+    }
+    p_output->i_pmt_version++;
+
     p = p_output->p_pmt_section = psi_allocate();
     pmt_init( p );
     psi_set_length( p, PSI_MAX_SIZE );
@@ -1624,9 +2832,7 @@ static void NewPMT( output_t *p_output )
         uint16_t i_pid = pmtn_get_pid( p_current_es );
 
         j++;
-        if ( (p_output->config.i_nb_pids || !PIDWouldBeSelected( p_current_es ))
-              && !IsIn( p_output->config.pi_pids, p_output->config.i_nb_pids,
-                        i_pid ) )
+        if ( !OutputHasES( p_output, p_current_es ) )
             continue;
 
         p_es = pmt_get_es( p, k );
@@ -1643,10 +2849,11 @@ static void NewPMT( output_t *p_output )
 
     /* Do the pcr pid after everything else as it may have been remapped */
     i_pcrpid = pmt_get_pcrpid( p_current_pmt );
-    if ( p_output->pi_newpids[i_pcrpid] != UNUSED_PID ) {
+    if ( output_MapPID( p_output, i_pcrpid ) != UNUSED_PID ) {
+        uint16_t i_newpcrpid = output_MapPID( p_output, i_pcrpid );
         msg_Dbg( NULL, "REMAP: The PCR PID was changed from 0x%x (%u) to 0x%x (%u)",
-                 i_pcrpid, i_pcrpid, p_output->pi_newpids[i_pcrpid], p_output->pi_newpids[i_pcrpid] );
-        i_pcrpid = p_output->pi_newpids[i_pcrpid];
+                 i_pcrpid, i_pcrpid, i_newpcrpid, i_newpcrpid );
+        i_pcrpid = i_newpcrpid;
     } else {
         msg_Dbg( NULL, "The PCR PID has kept its original value of 0x%x (%u)", i_pcrpid, i_pcrpid);
     }
@@ -1657,7 +2864,8 @@ static void NewPMT( output_t *p_output )
         pmt_set_length( p, 0 );
     else
         pmt_set_length( p, p_es - p - PMT_HEADER_SIZE );
-    psi_set_crc( p );
+    psi_set_crc_fast( p );
+    p_output->p_pmt_share = PSIShareAdd( p, p_output->config.i_sid );
 }
 
 /*****************************************************************************
@@ -1668,9 +2876,20 @@ static void NewNIT( output_t *p_output )
     uint8_t *p_ts;
     uint8_t *p_header2;
     uint8_t *p;
+    psi_share_key_t key;
 
-    free( p_output->p_nit_section );
+    PSIShareRelease( &p_output->p_nit_share );
     p_output->p_nit_section = NULL;
+
+    memset( &key, 0, sizeof(key) );
+    key.i_tsid = p_output->i_tsid;
+    key.i_onid = p_output->config.i_onid;
+    key.i_network_id = p_output->config.i_network_id;
+    PSIShareKeyInit( PSI_SHARE_NIT, &key );
+    PSIShareKeyString( &p_output->config.network_name );
+    if ( PSIShareGet( &p_output->p_nit_share, &p_output->p_nit_section,
+                      &p_output->i_nit_version ) )
+        return;
     p_output->i_nit_version++;
 
     p = p_output->p_nit_section = psi_allocate();
@@ -1717,7 +2936,8 @@ static void NewNIT( output_t *p_output )
         nit_set_length( p, 0 );
     else
         nit_set_length( p, p_ts - p - NIT_HEADER_SIZE );
-    psi_set_crc( p_output->p_nit_section );
+    psi_set_crc_fast( p_output->p_nit_section );
+    p_output->p_nit_share = PSIShareAdd( p_output->p_nit_section, 0 );
 }
 
 /*****************************************************************************
@@ -1727,10 +2947,10 @@ static void NewSDT( output_t *p_output )
 {
     uint8_t *p_service, *p_current_service;
     uint8_t *p;
+    psi_share_key_t key;
 
-    free( p_output->p_sdt_section );
+    PSIShareRelease( &p_output->p_sdt_share );
     p_output->p_sdt_section = NULL;
-    p_output->i_sdt_version++;
 
     if ( !p_output->config.i_sid ) return;
     if ( !psi_table_validate(pp_current_sdt_sections) ) return;
@@ -1744,13 +2964,31 @@ static void NewSDT( output_t *p_output )
              pat_get_program( p_output->p_pat_section, 0 ) == NULL )
         {
             /* Empty PAT and no SDT anymore */
-            free( p_output->p_pat_section );
+            PSIShareRelease( &p_output->p_pat_share );
             p_output->p_pat_section = NULL;
             p_output->i_pat_version++;
         }
         return;
     }
 
+    memset( &key, 0, sizeof(key) );
+    key.i_sid = p_output->config.i_sid;
+    key.i_new_sid = p_output->config.i_new_sid;
+    key.i_tsid = p_output->i_tsid;
+    if ( p_output->config.i_onid )
+        key.i_onid = p_output->config.i_onid;
+    else
+        key.i_onid =
+            sdt_get_onid( psi_table_get_section( pp_current_sdt_sections, 0 ) );
+    key.b_epg = (p_output->config.i_config & OUTPUT_EPG) == OUTPUT_EPG;
+    PSIShareKeyInit( PSI_SHARE_SDT, &key );
+    PSIShareKeyString( &p_output->config.provider_name );
+    PSIShareKeyString( &p_output->config.service_name );
+    if ( PSIShareGet( &p_output->p_sdt_share, &p_output->p_sdt_section,
+                      &p_output->i_sdt_version ) )
+        return;
+    p_output->i_sdt_version++;
+
     p = p_output->p_sdt_section = psi_allocate();
     sdt_init( p, true );
     sdt_set_length( p, PSI_MAX_SIZE );
@@ -1856,7 +3094,9 @@ static void NewSDT( output_t *p_output )
         sdt_set_length( p, 0 );
     else
         sdt_set_length( p, p_service - p - SDT_HEADER_SIZE );
-    psi_set_crc( p_output->p_sdt_section );
+    psi_set_crc_fast( p_output->p_sdt_section );
+    p_output->p_sdt_share = PSIShareAdd( p_output->p_sdt_section,
+                                         p_output->config.i_sid );
 }
 
 /*****************************************************************************
@@ -1867,10 +3107,9 @@ static void Update##table( uint16_t i_sid )                                 \
 {                                                                           \
     int i;                                                                  \
                                                                             \
-    for ( i = 0; i < i_nb_outputs; i++ )                                    \
-        if ( ( pp_outputs[i]->config.i_config & OUTPUT_VALID )              \
-             && pp_outputs[i]->config.i_sid == i_sid )                      \
-            New##table( pp_outputs[i] );                                    \
+    PSIShareRetire( PSI_SHARE_##table, i_sid );                             \
+    for ( i = 0; i < p_sid_outputs[i_sid].i_nb_outputs; i++ )               \
+        New##table( p_sid_outputs[i_sid].pp_outputs[i] );                   \
 }
 
 DECLARE_UPDATE_FUNC(PAT)
@@ -1903,14 +3142,7 @@ static void UpdateTSID(void)
  *****************************************************************************/
 static bool SIDIsSelected( uint16_t i_sid )
 {
-    int i;
-
-    for ( i = 0; i < i_nb_outputs; i++ )
-        if ( (pp_outputs[i]->config.i_config & OUTPUT_VALID)
-             && pp_outputs[i]->config.i_sid == i_sid )
-            return true;
-
-    return false;
+    return p_sid_outputs[i_sid].i_nb_outputs != 0;
 }
 
 /*****************************************************************************
@@ -2141,11 +3373,14 @@ static void DeleteProgram( uint16_t i_sid, uint16_t i_pid )
             }
         }
 
-        free( p_pmt );
+        SectionRelease( p_pmt );
         p_sid->p_current_pmt = NULL;
     }
+    if ( pp_sid_index[p_sid->i_sid] == p_sid )
+        pp_sid_index[p_sid->i_sid] = NULL;
     p_sid->i_sid = 0;
     p_sid->i_pmt_pid = 0;
+    b_pid_classes_dirty = true;
 }
 
 /*****************************************************************************
@@ -2242,7 +3477,7 @@ static void HandlePAT( mtime_t i_dts )
          psi_table_compare( pp_current_pat_sections, pp_next_pat_sections ) )
     {
         /* Identical PAT. Shortcut. */
-        psi_table_free( pp_next_pat_sections );
+        SectionTableRelease( pp_next_pat_sections );
         psi_table_init( pp_next_pat_sections );
         goto out_pat;
     }
@@ -2260,7 +3495,7 @@ static void HandlePAT( mtime_t i_dts )
         default:
             break;
         }
-        psi_table_free( pp_next_pat_sections );
+        SectionTableRelease( pp_next_pat_sections );
         psi_table_init( pp_next_pat_sections );
         goto out_pat;
     }
@@ -2269,6 +3504,7 @@ static void HandlePAT( mtime_t i_dts )
     psi_table_copy( pp_old_pat_sections, pp_current_pat_sections );
     psi_table_copy( pp_current_pat_sections, pp_next_pat_sections );
     psi_table_init( pp_next_pat_sections );
+    b_pid_classes_dirty = true;
 
     if ( !psi_table_validate( pp_old_pat_sections )
           || psi_table_get_tableidext( pp_current_pat_sections )
@@ -2315,7 +3551,7 @@ static void HandlePAT( mtime_t i_dts )
 
                 SelectPMT( i_sid, i_pid );
 
-                p_sid = FindSID( 0 );
+                p_sid = FindFreeSID();
                 if ( p_sid == NULL )
                 {
                     p_sid = malloc( sizeof(sid_t) );
@@ -2327,6 +3563,7 @@ static void HandlePAT( mtime_t i_dts )
 
                 p_sid->i_sid = i_sid;
                 p_sid->i_pmt_pid = i_pid;
+                pp_sid_index[i_sid] = p_sid;
 
                 UpdatePAT( i_sid );
             }
@@ -2361,7 +3598,7 @@ static void HandlePAT( mtime_t i_dts )
             }
         }
 
-        psi_table_free( pp_old_pat_sections );
+        SectionTableRelease( pp_old_pat_sections );
     }
 
     pat_table_print( pp_current_pat_sections, msg_Dbg, NULL, PRINT_TEXT );
@@ -2383,6 +3620,14 @@ out_pat:
 static void HandlePATSection( uint16_t i_pid, uint8_t *p_section,
                               mtime_t i_dts )
 {
+    if ( i_pid == PAT_PID && SectionIsCurrent( pp_current_pat_sections,
+                                               pp_next_pat_sections,
+                                               p_section ) )
+    {
+        SendPAT( i_dts );
+        return;
+    }
+
     if ( i_pid != PAT_PID || !pat_validate( p_section ) )
     {
         msg_Warn( NULL, "invalid PAT section received on PID %hu", i_pid );
@@ -2396,7 +3641,7 @@ static void HandlePATSection( uint16_t i_pid, uint8_t *p_section,
         default:
             break;
         }
-        free( p_section );
+        SectionRelease( p_section );
         return;
     }
 
@@ -2422,7 +3667,7 @@ static void HandleCAT( mtime_t i_dts )
          psi_table_compare( pp_current_cat_sections, pp_next_cat_sections ) )
     {
         /* Identical CAT. Shortcut. */
-        psi_table_free( pp_next_cat_sections );
+        SectionTableRelease( pp_next_cat_sections );
         psi_table_init( pp_next_cat_sections );
         goto out_cat;
     }
@@ -2440,7 +3685,7 @@ static void HandleCAT( mtime_t i_dts )
         default:
             break;
         }
-        psi_table_free( pp_next_cat_sections );
+        SectionTableRelease( pp_next_cat_sections );
         psi_table_init( pp_next_cat_sections );
         goto out_cat;
     }
@@ -2449,6 +3694,7 @@ static void HandleCAT( mtime_t i_dts )
     psi_table_copy( pp_old_cat_sections, pp_current_cat_sections );
     psi_table_copy( pp_current_cat_sections, pp_next_cat_sections );
     psi_table_init( pp_next_cat_sections );
+    b_pid_classes_dirty = true;
 
     for ( i = 0; i <= i_last_section; i++ )
     {
@@ -2505,7 +3751,7 @@ static void HandleCAT( mtime_t i_dts )
             }
         }
 
-        psi_table_free( pp_old_cat_sections );
+        SectionTableRelease( pp_old_cat_sections );
     }
 
     cat_table_print( pp_current_cat_sections, msg_Dbg, NULL, PRINT_TEXT );
@@ -2527,6 +3773,11 @@ out_cat:
 static void HandleCATSection( uint16_t i_pid, uint8_t *p_section,
                               mtime_t i_dts )
 {
+    if ( i_pid == CAT_PID && SectionIsCurrent( pp_current_cat_sections,
+                                               pp_next_cat_sections,
+                                               p_section ) )
+        return;
+
     if ( i_pid != CAT_PID || !cat_validate( p_section ) )
     {
         msg_Warn( NULL, "invalid CAT section received on PID %hu", i_pid );
@@ -2540,7 +3791,7 @@ static void HandleCATSection( uint16_t i_pid, uint8_t *p_section,
         default:
             break;
         }
-        free( p_section );
+        SectionRelease( p_section );
         return;
     }
 
@@ -2550,8 +3801,12 @@ static void HandleCATSection( uint16_t i_pid, uint8_t *p_section,
     HandleCAT( i_dts );
 }
 
-static void mark_pmt_pids( uint8_t *p_pmt, uint8_t pid_map[], uint8_t marker )
+/*****************************************************************************
+ * get_pmt_pids : fills the sorted list of the PIDs a PMT selects
+ *****************************************************************************/
+static int get_pmt_pids( uint8_t *p_pmt, uint16_t *pi_pids )
 {
+    int i_nb_pids = 0;
     uint16_t j, k;
     uint8_t *p_es;
     uint8_t *p_desc;
@@ -2565,12 +3820,12 @@ static void mark_pmt_pids( uint8_t *p_pmt, uint8_t pid_map[], uint8_t marker )
         {
             if ( desc_get_tag( p_desc ) != 0x09 || !desc09_validate( p_desc ) )
                 continue;
-            pid_map[ desc09_get_pid( p_desc ) ] |= marker;
+            pidlist_Add( pi_pids, &i_nb_pids, desc09_get_pid( p_desc ) );
         }
     }
 
     if ( i_pcr_pid != PADDING_PID )
-        pid_map[ i_pcr_pid ] |= marker;
+        pidlist_Add( pi_pids, &i_nb_pids, i_pcr_pid );
 
     j = 0;
     while ( (p_es = pmt_get_es( p_pmt, j )) != NULL )
@@ -2579,7 +3834,7 @@ static void mark_pmt_pids( uint8_t *p_pmt, uint8_t pid_map[], uint8_t marker )
         j++;
 
         if ( PIDWouldBeSelected( p_es ) )
-            pid_map[ i_pid ] |= marker;
+            pidlist_Add( pi_pids, &i_nb_pids, i_pid );
 
         p_pids[i_pid].b_pes = PIDCarriesPES( p_es );
 
@@ -2590,10 +3845,12 @@ static void mark_pmt_pids( uint8_t *p_pmt, uint8_t pid_map[], uint8_t marker )
             {
                 if ( desc_get_tag( p_desc ) != 0x09 || !desc09_validate( p_desc ) )
                     continue;
-                pid_map[ desc09_get_pid( p_desc ) ] |= marker;
+                pidlist_Add( pi_pids, &i_nb_pids, desc09_get_pid( p_desc ) );
             }
         }
     }
+
+    return i_nb_pids;
 }
 
 /*****************************************************************************
@@ -2604,14 +3861,17 @@ static void HandlePMT( uint16_t i_pid, uint8_t *p_pmt, mtime_t i_dts )
     uint16_t i_sid = pmt_get_program( p_pmt );
     sid_t *p_sid;
     bool b_needs_descrambling, b_needed_descrambling, b_is_selected;
-    uint8_t pid_map[MAX_PIDS];
+    /* Each PID takes at least one byte of the PMT */
+    uint16_t pi_old_pids[PSI_MAX_SIZE], pi_new_pids[PSI_MAX_SIZE];
+    uint16_t pi_diff[2 * PSI_MAX_SIZE];
+    int i_nb_old_pids = 0, i_nb_new_pids, i_nb_diff, i;
 
     p_sid = FindSID( i_sid );
     if ( p_sid == NULL )
     {
         /* Unwanted SID (happens when the same PMT PID is used for several
          * programs). */
-        free( p_pmt );
+        SectionRelease( p_pmt );
         return;
     }
 
@@ -2630,7 +3890,7 @@ static void HandlePMT( uint16_t i_pid, uint8_t *p_pmt, mtime_t i_dts )
         default:
             break;
         }
-        free( p_pmt );
+        SectionRelease( p_pmt );
         return;
     }
 
@@ -2638,7 +3898,7 @@ static void HandlePMT( uint16_t i_pid, uint8_t *p_pmt, mtime_t i_dts )
          psi_compare( p_sid->p_current_pmt, p_pmt ) )
     {
         /* Identical PMT. Shortcut. */
-        free( p_pmt );
+        SectionRelease( p_pmt );
         goto out_pmt;
     }
 
@@ -2657,12 +3917,10 @@ static void HandlePMT( uint16_t i_pid, uint8_t *p_pmt, mtime_t i_dts )
         default:
             break;
         }
-        free( p_pmt );
+        SectionRelease( p_pmt );
         goto out_pmt;
     }
 
-    memset( pid_map, 0, sizeof(pid_map) );
-
     b_needs_descrambling = PMTNeedsDescrambling( p_pmt );
     b_needed_descrambling = p_sid->p_current_pmt != NULL ?
                             PMTNeedsDescrambling( p_sid->p_current_pmt ) :
@@ -2675,40 +3933,39 @@ static void HandlePMT( uint16_t i_pid, uint8_t *p_pmt, mtime_t i_dts )
 
     if ( p_sid->p_current_pmt != NULL )
     {
-        mark_pmt_pids( p_sid->p_current_pmt, pid_map, 0x02 );
-        free( p_sid->p_current_pmt );
+        i_nb_old_pids = get_pmt_pids( p_sid->p_current_pmt, pi_old_pids );
+        SectionRelease( p_sid->p_current_pmt );
     }
 
-    mark_pmt_pids( p_pmt, pid_map, 0x01 );
+    i_nb_new_pids = get_pmt_pids( p_pmt, pi_new_pids );
 
     uint16_t i_pcr_pid = pmt_get_pcrpid( p_pmt );
-    int i;
-    for ( i = 0; i < i_nb_outputs; i++ )
-        if ( (pp_outputs[i]->config.i_config & OUTPUT_VALID)
-              && pp_outputs[i]->config.i_sid == i_sid )
-            pp_outputs[i]->i_pcr_pid = 0;
+    sid_outputs_t *p_list = &p_sid_outputs[i_sid];
+    for ( i = 0; i < p_list->i_nb_outputs; i++ )
+    {
+        if ( p_list->pp_outputs[i]->i_pcr_pid )
+            demux_Unshard( p_list->pp_outputs[i]->i_pcr_pid );
+        p_list->pp_outputs[i]->i_pcr_pid = 0;
+    }
 
-    /* Start to stream PIDs */
-    int pid;
-    for ( pid = 0; pid < MAX_PIDS; pid++ )
+    /* Start to stream PIDs, in PID order; the PIDs in the old PMT and in
+     * the new PMT are already selected. */
+    i_nb_diff = pidlist_Diff( pi_old_pids, i_nb_old_pids,
+                              pi_new_pids, i_nb_new_pids, pi_diff );
+    for ( i = 0; i < i_nb_diff; i++ )
     {
-        /* The pid does not exist in the old PMT and in the new PMT. Ignore this pid. */
-        if ( !pid_map[ pid ] )
-            continue;
+        uint16_t i_diff_pid = pi_diff[i] & ~PIDLIST_ADDED;
 
-        switch ( pid_map[ pid ] & 0x03 ) {
-        case 0x03: /* The pid exists in the old PMT and in the new PMT. The pid was already selected in case 0x01. */
-            continue;
-        case 0x02: /* The pid does not exist in the new PMT but exists in the old PMT. Unselect it. */
-            UnselectPID( i_sid, pid );
-            break;
-        case 0x01: /* The pid exists in new PMT. Select it. */
-            SelectPID( i_sid, pid, pid == i_pcr_pid );
-            break;
-        }
+        if ( pi_diff[i] & PIDLIST_ADDED )
+            /* The pid exists in new PMT. Select it. */
+            SelectPID( i_sid, i_diff_pid, i_diff_pid == i_pcr_pid );
+        else
+            /* The pid does not exist in the new PMT but exists in the old PMT. Unselect it. */
+            UnselectPID( i_sid, i_diff_pid );
     }
 
     p_sid->p_current_pmt = p_pmt;
+    b_pid_classes_dirty = true;
 
     if ( i_ca_handle && b_is_selected )
     {
@@ -2742,7 +3999,7 @@ static void HandleNIT( mtime_t i_dts )
          psi_table_compare( pp_current_nit_sections, pp_next_nit_sections ) )
     {
         /* Identical NIT. Shortcut. */
-        psi_table_free( pp_next_nit_sections );
+        SectionTableRelease( pp_next_nit_sections );
         psi_table_init( pp_next_nit_sections );
         goto out_nit;
     }
@@ -2760,13 +4017,13 @@ static void HandleNIT( mtime_t i_dts )
         default:
             break;
         }
-        psi_table_free( pp_next_nit_sections );
+        SectionTableRelease( pp_next_nit_sections );
         psi_table_init( pp_next_nit_sections );
         goto out_nit;
     }
 
     /* Switch tables. */
-    psi_table_free( pp_current_nit_sections );
+    SectionTableRelease( pp_current_nit_sections );
     psi_table_copy( pp_current_nit_sections, pp_next_nit_sections );
     psi_table_init( pp_next_nit_sections );
 
@@ -2790,6 +4047,14 @@ out_nit:
 static void HandleNITSection( uint16_t i_pid, uint8_t *p_section,
                               mtime_t i_dts )
 {
+    if ( i_pid == NIT_PID && SectionIsCurrent( pp_current_nit_sections,
+                                               pp_next_nit_sections,
+                                               p_section ) )
+    {
+        SendNIT( i_dts );
+        return;
+    }
+
     if ( i_pid != NIT_PID || !nit_validate( p_section ) )
     {
         msg_Warn( NULL, "invalid NIT section received on PID %hu", i_pid );
@@ -2805,7 +4070,7 @@ static void HandleNITSection( uint16_t i_pid, uint8_t *p_section,
         default:
             break;
         }
-        free( p_section );
+        SectionRelease( p_section );
         return;
     }
 
@@ -2833,7 +4098,7 @@ static void HandleSDT( mtime_t i_dts )
          psi_table_compare( pp_current_sdt_sections, pp_next_sdt_sections ) )
     {
         /* Identical SDT. Shortcut. */
-        psi_table_free( pp_next_sdt_sections );
+        SectionTableRelease( pp_next_sdt_sections );
         psi_table_init( pp_next_sdt_sections );
         goto out_sdt;
     }
@@ -2851,7 +4116,7 @@ static void HandleSDT( mtime_t i_dts )
         default:
             break;
         }
-        psi_table_free( pp_next_sdt_sections );
+        SectionTableRelease( pp_next_sdt_sections );
         psi_table_init( pp_next_sdt_sections );
         goto out_sdt;
     }
@@ -2898,7 +4163,7 @@ static void HandleSDT( mtime_t i_dts )
             }
         }
 
-        psi_table_free( pp_old_sdt_sections );
+        SectionTableRelease( pp_old_sdt_sections );
     }
 
     sdt_table_print( pp_current_sdt_sections, msg_Dbg, NULL,
@@ -2921,6 +4186,14 @@ out_sdt:
 static void HandleSDTSection( uint16_t i_pid, uint8_t *p_section,
                               mtime_t i_dts )
 {
+    if ( i_pid == SDT_PID && SectionIsCurrent( pp_current_sdt_sections,
+                                               pp_next_sdt_sections,
+                                               p_section ) )
+    {
+        SendSDT( i_dts );
+        return;
+    }
+
     if ( i_pid != SDT_PID || !sdt_validate( p_section ) )
     {
         msg_Warn( NULL, "invalid SDT section received on PID %hu", i_pid );
@@ -2936,7 +4209,7 @@ static void HandleSDTSection( uint16_t i_pid, uint8_t *p_section,
         default:
             break;
         }
-        free( p_section );
+        SectionRelease( p_section );
         return;
     }
 
@@ -2958,7 +4231,7 @@ static void HandleEIT( uint16_t i_pid, uint8_t *p_eit, mtime_t i_dts )
     if ( p_sid == NULL )
     {
         /* Not a selected program. */
-        free( p_eit );
+        SectionRelease( p_eit );
         return;
     }
 
@@ -2977,12 +4250,227 @@ static void HandleEIT( uint16_t i_pid, uint8_t *p_eit, mtime_t i_dts )
         default:
             break;
         }
-        free( p_eit );
+        SectionRelease( p_eit );
         return;
     }
 
     SendEIT( p_sid, i_dts, p_eit );
-    free( p_eit );
+    SectionRelease( p_eit );
+}
+
+/*****************************************************************************
+ * SectionNew/SectionRelease : input sections are all allocated with the
+ * size of the largest private section, as their size isn't known when they
+ * start to be assembled, so their buffers are recycled without size
+ * classes. biTStream frees the sections it replaces in a table with free(),
+ * which is still fine.
+ *****************************************************************************/
+static uint8_t *SectionNew( void )
+{
+    if ( i_section_pool )
+        return pp_section_pool[--i_section_pool];
+    return psi_private_allocate();
+}
+
+static void SectionRelease( uint8_t *p_section )
+{
+    if ( p_section == NULL )
+        return;
+    if ( i_section_pool < SECTION_POOL )
+        pp_section_pool[i_section_pool++] = p_section;
+    else
+        free( p_section );
+}
+
+static void SectionTableRelease( uint8_t **pp_sections )
+{
+    int i;
+
+    for ( i = 0; i < PSI_TABLE_MAX_SECTIONS; i++ )
+        SectionRelease( pp_sections[i] );
+}
+
+/*****************************************************************************
+ * SectionIsCurrent : shortcut for the repetitions of a single-section table,
+ * which is released right away instead of going through pp_next_sections
+ *****************************************************************************/
+static bool SectionIsCurrent( uint8_t **pp_current_sections,
+                              uint8_t **pp_next_sections, uint8_t *p_section )
+{
+    uint8_t *p_current;
+
+    if ( psi_get_lastsection( p_section ) != 0
+          || !psi_table_validate( pp_current_sections )
+          || psi_table_get_lastsection( pp_current_sections ) != 0 )
+        return false;
+
+    p_current = psi_table_get_section( pp_current_sections, 0 );
+    if ( p_current == NULL || !psi_compare( p_current, p_section ) )
+        return false;
+
+    SectionRelease( p_section );
+    SectionTableRelease( pp_next_sections );
+    psi_table_init( pp_next_sections );
+    return true;
+}
+
+/*****************************************************************************
+ * AssembleSection : same as psi_assemble_payload(), with recycled buffers
+ *****************************************************************************/
+static void AssembleReset( ts_pid_cold_t *p_pid )
+{
+    SectionRelease( p_pid->p_psi_buffer );
+    p_pid->p_psi_buffer = NULL;
+    p_pid->i_psi_buffer_used = 0;
+}
+
+static uint8_t *AssembleSection( ts_pid_cold_t *p_pid, const uint8_t **pp_payload,
+                                 uint8_t *pi_length )
+{
+    uint16_t i_remaining_size = PSI_PRIVATE_MAX_SIZE + PSI_HEADER_SIZE
+                                 - p_pid->i_psi_buffer_used;
+    uint16_t i_copy_size = *pi_length < i_remaining_size ? *pi_length
+                                                         : i_remaining_size;
+    uint8_t *p_section = NULL;
+
+    if ( p_pid->p_psi_buffer == NULL )
+    {
+        if ( **pp_payload == 0xff )
+        {
+            /* Padding until the end of the packet */
+            *pi_length = 0;
+            return NULL;
+        }
+        p_pid->p_psi_buffer = SectionNew();
+    }
+
+    memcpy( p_pid->p_psi_buffer + p_pid->i_psi_buffer_used, *pp_payload,
+            i_copy_size );
+    p_pid->i_psi_buffer_used += i_copy_size;
+
+    if ( p_pid->i_psi_buffer_used >= PSI_HEADER_SIZE )
+    {
+        uint16_t i_section_size = psi_get_length( p_pid->p_psi_buffer )
+                                   + PSI_HEADER_SIZE;
+
+        if ( i_section_size > PSI_PRIVATE_MAX_SIZE + PSI_HEADER_SIZE )
+        {
+            /* Invalid section */
+            AssembleReset( p_pid );
+            *pi_length = 0;
+            return NULL;
+        }
+        if ( i_section_size <= p_pid->i_psi_buffer_used )
+        {
+            p_section = p_pid->p_psi_buffer;
+            i_copy_size -= p_pid->i_psi_buffer_used - i_section_size;
+            p_pid->p_psi_buffer = NULL;
+            p_pid->i_psi_buffer_used = 0;
+        }
+    }
+
+    *pp_payload += i_copy_size;
+    *pi_length -= i_copy_size;
+    return p_section;
+}
+
+/*****************************************************************************
+ * HandleUnchangedSection : repetitions of an accepted section are recognized
+ * by their header (table_id, extension, version, section numbers) and the
+ * bytes of their CRC, without validating or parsing them
+ *****************************************************************************/
+static bool HandleUnchangedSection( uint16_t i_pid, uint8_t *p_section,
+                                    mtime_t i_dts )
+{
+    ts_pid_cold_t *p_pid = &p_pids_cold[i_pid];
+    uint8_t i_table_id = psi_get_tableid( p_section );
+    uint16_t i_size = psi_get_length( p_section ) + PSI_HEADER_SIZE;
+    uint8_t **pp_current_sections = NULL;
+    const uint8_t *p_current;
+    sid_t *p_sid = NULL;
+
+    if ( !psi_get_syntax( p_section )
+          || i_size < PSI_HEADER_SIZE_SYNTAX1 + PSI_CRC_SIZE )
+        return false;
+
+    switch ( i_table_id )
+    {
+    case PAT_TABLE_ID:
+        if ( i_pid == PAT_PID )
+            pp_current_sections = pp_current_pat_sections;
+        break;
+    case CAT_TABLE_ID:
+        if ( i_pid == CAT_PID )
+            pp_current_sections = pp_current_cat_sections;
+        break;
+    case NIT_TABLE_ID_ACTUAL:
+        if ( i_pid == NIT_PID )
+            pp_current_sections = pp_current_nit_sections;
+        break;
+    case SDT_TABLE_ID_ACTUAL:
+        if ( i_pid == SDT_PID )
+            pp_current_sections = pp_current_sdt_sections;
+        break;
+    case PMT_TABLE_ID:
+        p_sid = FindSID( psi_get_tableidext( p_section ) );
+        if ( p_sid == NULL || p_sid->i_pmt_pid != i_pid )
+            return false;
+        break;
+    default:
+        return false;
+    }
+
+    if ( p_sid != NULL )
+        p_current = p_sid->p_current_pmt;
+    else if ( pp_current_sections != NULL
+               && psi_table_validate( pp_current_sections ) )
+        p_current = psi_table_get_section( pp_current_sections,
+                                           psi_get_section( p_section ) );
+    else
+        return false;
+
+    if ( p_current == NULL
+          || psi_get_length( p_current ) + PSI_HEADER_SIZE != i_size
+          || memcmp( p_current, p_section, PSI_HEADER_SIZE_SYNTAX1 )
+          || memcmp( p_current + i_size - PSI_CRC_SIZE,
+                     p_section + i_size - PSI_CRC_SIZE, PSI_CRC_SIZE ) )
+    {
+        p_pid->i_psi_unchanged = 0;
+        return false;
+    }
+
+    if ( ++p_pid->i_psi_unchanged >= SECTION_RECHECK )
+    {
+        /* Periodically validate and parse it again; note that
+         * psi_validate() checks the header, not the CRC */
+        p_pid->i_psi_unchanged = 0;
+        return false;
+    }
+
+    SectionRelease( p_section );
+
+    /* Refresh the outputs once per table, as the full path would */
+    if ( p_sid != NULL )
+        SendPMT( p_sid, i_dts );
+    else if ( psi_get_section( p_current )
+               == psi_get_lastsection( p_current ) )
+    {
+        switch ( i_table_id )
+        {
+        case PAT_TABLE_ID:
+            SendPAT( i_dts );
+            break;
+        case NIT_TABLE_ID_ACTUAL:
+            SendNIT( i_dts );
+            break;
+        case SDT_TABLE_ID_ACTUAL:
+            SendSDT( i_dts );
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
 }
 
 /*****************************************************************************
@@ -2992,6 +4480,9 @@ static void HandleSection( uint16_t i_pid, uint8_t *p_section, mtime_t i_dts )
 {
     uint8_t i_table_id = psi_get_tableid( p_section );
 
+    if ( HandleUnchangedSection( i_pid, p_section, i_dts ) )
+        return;
+
     if ( !psi_validate( p_section ) )
     {
         msg_Warn( NULL, "invalid section on PID %hu", i_pid );
@@ -3005,14 +4496,14 @@ static void HandleSection( uint16_t i_pid, uint8_t *p_section, mtime_t i_dts )
         default:
             break;
         }
-        free( p_section );
+        SectionRelease( p_section );
         return;
     }
 
     if ( !psi_get_current( p_section ) )
     {
         /* Ignore sections which are not in use yet. */
-        free( p_section );
+        SectionRelease( p_section );
         return;
     }
 
@@ -3047,7 +4538,7 @@ static void HandleSection( uint16_t i_pid, uint8_t *p_section, mtime_t i_dts )
             HandleEIT( i_pid, p_section, i_dts );
             break;
         }
-        free( p_section );
+        SectionRelease( p_section );
         break;
     }
 }
@@ -3058,28 +4549,26 @@ static void HandleSection( uint16_t i_pid, uint8_t *p_section, mtime_t i_dts )
 static void HandlePSIPacket( uint8_t *p_ts, mtime_t i_dts )
 {
     uint16_t i_pid = ts_get_pid( p_ts );
-    ts_pid_t *p_pid = &p_pids[i_pid];
+    int8_t i_last_cc = p_pids[i_pid].i_last_cc;
+    ts_pid_cold_t *p_pid = &p_pids_cold[i_pid];
     uint8_t i_cc = ts_get_cc( p_ts );
     const uint8_t *p_payload;
     uint8_t i_length;
 
-    if ( ts_check_duplicate( i_cc, p_pid->i_last_cc )
+    if ( ts_check_duplicate( i_cc, i_last_cc )
           || !ts_has_payload( p_ts ) )
         return;
 
-    if ( p_pid->i_last_cc != -1
-          && ts_check_discontinuity( i_cc, p_pid->i_last_cc ) )
-        psi_assemble_reset( &p_pid->p_psi_buffer, &p_pid->i_psi_buffer_used );
+    if ( i_last_cc != -1
+          && ts_check_discontinuity( i_cc, i_last_cc ) )
+        AssembleReset( p_pid );
 
     p_payload = ts_section( p_ts );
     i_length = p_ts + TS_SIZE - p_payload;
 
-    if ( !psi_assemble_empty( &p_pid->p_psi_buffer,
-                              &p_pid->i_psi_buffer_used ) )
+    if ( p_pid->p_psi_buffer != NULL )
     {
-        uint8_t *p_section = psi_assemble_payload( &p_pid->p_psi_buffer,
-                                                   &p_pid->i_psi_buffer_used,
-                                                   &p_payload, &i_length );
+        uint8_t *p_section = AssembleSection( p_pid, &p_payload, &i_length );
         if ( p_section != NULL )
             HandleSection( i_pid, p_section, i_dts );
     }
@@ -3089,9 +4578,7 @@ static void HandlePSIPacket( uint8_t *p_ts, mtime_t i_dts )
 
     while ( i_length )
     {
-        uint8_t *p_section = psi_assemble_payload( &p_pid->p_psi_buffer,
-                                                   &p_pid->i_psi_buffer_used,
-                                                   &p_payload, &i_length );
+        uint8_t *p_section = AssembleSection( p_pid, &p_payload, &i_length );
         if ( p_section != NULL )
             HandleSection( i_pid, p_section, i_dts );
     }
@@ -3138,22 +4625,49 @@ static const char *h222_stream_type_desc(uint8_t i_stream_type) {
     }
 }
 
-static const char *get_pid_desc(uint16_t i_pid, uint16_t *i_sid) {
+/*****************************************************************************
+ * ClassifyPID : sets the classification of a PID, unless an earlier rule of
+ * ClassifyPIDs() already did
+ *****************************************************************************/
+static void ClassifyPID( uint16_t i_pid, uint8_t i_type, uint16_t i_sid,
+                         uint8_t i_stream_type )
+{
+    ts_pid_info_t *p_info = &p_pids_cold[i_pid].info;
+
+    if ( p_info->i_type != PID_TYPE_UNKNOWN )
+        return;
+    p_info->i_type = i_type;
+    p_info->i_stream_type = i_stream_type;
+    p_info->i_sid = i_sid;
+}
+
+/*****************************************************************************
+ * ClassifyPIDs : rebuilds the classification of all PIDs from the current
+ * PAT, CAT and PMTs
+ *****************************************************************************/
+static void ClassifyPIDs( void )
+{
     int i, j, k;
     uint8_t i_last_section;
     uint8_t *p_desc;
-    uint16_t i_nit_pid = NIT_PID, i_pcr_pid = 0;
+    uint16_t i_nit_pid = NIT_PID;
 
-    /* Simple cases */
-    switch (i_pid)
+    b_pid_classes_dirty = false;
+
+    for ( i = 0; i < MAX_PIDS; i++ )
     {
-        case 0x00: return "PAT";
-        case 0x01: return "CAT";
-        case 0x11: return "SDT";
-        case 0x12: return "EPG";
-        case 0x14: return "TDT/TOT";
+        p_pids_cold[i].info.i_type = PID_TYPE_UNKNOWN;
+        p_pids_cold[i].info.i_stream_type = 0;
+        p_pids_cold[i].info.i_sid = 0;
     }
 
+    /* Simple cases */
+    ClassifyPID( PAT_PID, PID_TYPE_PAT, 0, 0 );
+    ClassifyPID( CAT_PID, PID_TYPE_CAT, 0, 0 );
+    ClassifyPID( SDT_PID, PID_TYPE_SDT, 0, 0 );
+    ClassifyPID( EIT_PID, PID_TYPE_EIT, 0, 0 );
+    ClassifyPID( TDT_PID, PID_TYPE_TDT, 0, 0 );
+
     /* Detect NIT pid */
     if ( psi_table_validate( pp_current_pat_sections ) )
     {
@@ -3190,9 +4704,7 @@ static const char *get_pid_desc(uint16_t i_pid, uint16_t *i_sid) {
                 if ( desc_get_tag( p_desc ) != 0x09 || !desc09_validate( p_desc ) )
                     continue;
 
-                if ( desc09_get_pid( p_desc ) == i_pid ) {
-                    return "EMM";
-                }
+                ClassifyPID( desc09_get_pid( p_desc ), PID_TYPE_EMM, 0, 0 );
             }
         }
     }
@@ -3201,27 +4713,14 @@ static const char *get_pid_desc(uint16_t i_pid, uint16_t *i_sid) {
     for ( k = 0; k < i_nb_sids; k++ )
     {
         sid_t *p_sid = pp_sids[k];
-        if ( p_sid->i_pmt_pid == i_pid )
-        {
-            if ( i_sid )
-                *i_sid = p_sid->i_sid;
-            return "PMT";
-        }
+        if ( p_sid->i_pmt_pid )
+            ClassifyPID( p_sid->i_pmt_pid, PID_TYPE_PMT, p_sid->i_sid, 0 );
 
         if ( p_sid->i_sid && p_sid->p_current_pmt != NULL )
         {
             uint8_t *p_current_pmt = p_sid->p_current_pmt;
             uint8_t *p_current_es;
 
-            /* The PCR PID can be alone or PCR can be carried in some other PIDs (mostly video)
-               so just remember the pid and if it is alone it will be reported as PCR, otherwise
-               stream type of the PID will be reported */
-            if ( i_pid == pmt_get_pcrpid( p_current_pmt ) ) {
-                if ( i_sid )
-                    *i_sid = p_sid->i_sid;
-                i_pcr_pid = pmt_get_pcrpid( p_current_pmt );
-            }
-
             /* Look for ECMs */
             j = 0;
             while ((p_desc = descs_get_desc( pmt_get_descs( p_current_pmt ), j++ )) != NULL)
@@ -3229,35 +4728,44 @@ static const char *get_pid_desc(uint16_t i_pid, uint16_t *i_sid) {
                 if ( desc_get_tag( p_desc ) != 0x09 || !desc09_validate( p_desc ) )
                     continue;
 
-                if ( desc09_get_pid( p_desc ) == i_pid ) {
-                    if ( i_sid )
-                        *i_sid = p_sid->i_sid;
-                    return "ECM";
-                }
+                ClassifyPID( desc09_get_pid( p_desc ), PID_TYPE_ECM,
+                             p_sid->i_sid, 0 );
             }
 
             /* Detect stream types */
             j = 0;
             while ( (p_current_es = pmt_get_es( p_current_pmt, j++ )) != NULL )
-            {
-                if ( pmtn_get_pid( p_current_es ) == i_pid )
-                {
-                    if ( i_sid )
-                        *i_sid = p_sid->i_sid;
-                    return h222_stream_type_desc( pmtn_get_streamtype( p_current_es ) );
-                }
-            }
+                ClassifyPID( pmtn_get_pid( p_current_es ), PID_TYPE_ES,
+                             p_sid->i_sid,
+                             pmtn_get_streamtype( p_current_es ) );
         }
     }
 
     /* Are there any other PIDs? */
-    if (i_pid == i_nit_pid)
-        return "NIT";
+    ClassifyPID( i_nit_pid, PID_TYPE_NIT, 0, 0 );
+
+    /* The PCR PID can be alone or PCR can be carried in some other PIDs
+       (mostly video), so it is only reported as PCR if it is alone */
+    for ( k = 0; k < i_nb_sids; k++ )
+    {
+        sid_t *p_sid = pp_sids[k];
+        if ( p_sid->i_sid && p_sid->p_current_pmt != NULL )
+            ClassifyPID( pmt_get_pcrpid( p_sid->p_current_pmt ), PID_TYPE_PCR,
+                         p_sid->i_sid, 0 );
+    }
+}
+
+static const char *get_pid_desc(uint16_t i_pid, uint16_t *i_sid) {
+    ts_pid_info_t *p_info = &p_pids_cold[i_pid].info;
 
-    if (i_pid == i_pcr_pid)
-        return "PCR";
+    if ( b_pid_classes_dirty )
+        ClassifyPIDs();
 
-    return "...";
+    if ( i_sid )
+        *i_sid = p_info->i_sid;
+    if ( p_info->i_type == PID_TYPE_ES )
+        return h222_stream_type_desc( p_info->i_stream_type );
+    return pid_type_name( p_info->i_type );
 }
 
 /*****************************************************************************
@@ -3288,7 +4796,9 @@ uint8_t *demux_get_packed_PMT( uint16_t i_sid, unsigned int *pi_pack_size ) {
 
 inline void demux_get_PID_info( uint16_t i_pid, uint8_t *p_data ) {
     ts_pid_info_t *p_info = (ts_pid_info_t *)p_data;
-    *p_info = p_pids[i_pid].info;
+    if ( b_pid_classes_dirty )
+        ClassifyPIDs();
+    *p_info = p_pids_cold[i_pid].info;
 }
 
 inline void demux_get_PIDS_info( uint8_t *p_data ) {
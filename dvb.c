@@ -68,19 +68,27 @@
 #define DVR_READ_TIMEOUT 30000000 /* 30 s */
 #define MAX_READ_ONCE 50
 #define DVR_BUFFER_SIZE 40*188*1024 /* bytes */
+#define DVR_CHUNK_MIN (16 * TS_SIZE)
+#define DVR_SHRINK_READS 16
 
 int i_dvr_buffer_size = DVR_BUFFER_SIZE;
+int i_dvr_chunk_max = 0;
 
 static int i_frontend, i_dvr;
 static struct ev_io frontend_watcher, dvr_watcher;
 static struct ev_timer lock_watcher, mute_watcher, print_watcher;
 static fe_status_t i_last_status;
 static block_t *p_freelist = NULL;
+static int i_dvr_chunk = MAX_READ_ONCE * TS_SIZE;
+static int i_dvr_small_reads = 0;
 
 /*****************************************************************************
  * Local prototypes
  *****************************************************************************/
 static void DVRRead(struct ev_loop *loop, struct ev_io *w, int revents);
+static void DVRReadChunk(struct ev_loop *loop, struct ev_io *w, int revents);
+static block_t *DVRHandle( block_t *p_ts, ssize_t i_len,
+                           const uint8_t *p_header );
 static void DVRMuteCb(struct ev_loop *loop, struct ev_timer *w, int revents);
 static void FrontendRead(struct ev_loop *loop, struct ev_io *w, int revents);
 static void FrontendLockCb(struct ev_loop *loop, struct ev_timer *w, int revents);
@@ -127,8 +135,32 @@ void dvb_Open( void )
                  strerror(errno) );
     }
 
-    ev_io_init(&dvr_watcher, DVRRead, i_dvr, EV_READ);
-    ev_io_start(event_loop, &dvr_watcher);
+    if ( i_dvr_chunk_max && i_input_ring )
+    {
+        msg_Warn( NULL, "contiguous DVR reads are not used with an input thread" );
+        i_dvr_chunk_max = 0;
+    }
+
+    if ( i_input_ring )
+        input_Start( i_dvr, MAX_READ_ONCE, 0, DVRHandle );
+    else if ( i_dvr_chunk_max )
+    {
+        i_dvr_chunk_max -= i_dvr_chunk_max % TS_SIZE;
+        if ( i_dvr_chunk_max < DVR_CHUNK_MIN )
+            i_dvr_chunk_max = DVR_CHUNK_MIN;
+        if ( i_dvr_chunk > i_dvr_chunk_max )
+            i_dvr_chunk = i_dvr_chunk_max;
+        msg_Dbg( NULL, "reading DVR by chunks of up to %d bytes",
+                 i_dvr_chunk_max );
+
+        ev_io_init(&dvr_watcher, DVRReadChunk, i_dvr, EV_READ);
+        ev_io_start(event_loop, &dvr_watcher);
+    }
+    else
+    {
+        ev_io_init(&dvr_watcher, DVRRead, i_dvr, EV_READ);
+        ev_io_start(event_loop, &dvr_watcher);
+    }
 
     if ( i_frontend != -1 )
     {
@@ -160,7 +192,8 @@ void dvb_Reset( void )
  *****************************************************************************/
 static void DVRRead(struct ev_loop *loop, struct ev_io *w, int revents)
 {
-    int i, i_len;
+    int i;
+    ssize_t i_len;
     block_t *p_ts = p_freelist, **pp_current = &p_ts;
     struct iovec p_iov[MAX_READ_ONCE];
 
@@ -172,7 +205,74 @@ static void DVRRead(struct ev_loop *loop, struct ev_io *w, int revents)
         pp_current = &(*pp_current)->p_next;
     }
 
-    if ( (i_len = readv(i_dvr, p_iov, MAX_READ_ONCE)) < 0 )
+    i_len = readv(i_dvr, p_iov, MAX_READ_ONCE);
+    p_freelist = DVRHandle( p_ts, i_len, NULL );
+}
+
+/*****************************************************************************
+ * DVRReadChunk: reads into one contiguous buffer, referenced by the blocks
+ *****************************************************************************/
+static void DVRAdaptChunk( ssize_t i_len )
+{
+    if ( i_len == i_dvr_chunk && i_dvr_chunk < i_dvr_chunk_max )
+    {
+        /* The kernel had more data than we asked for. */
+        i_dvr_chunk *= 2;
+        if ( i_dvr_chunk > i_dvr_chunk_max )
+            i_dvr_chunk = i_dvr_chunk_max;
+        i_dvr_small_reads = 0;
+        msg_Dbg( NULL, "DVR chunk size is now %d bytes", i_dvr_chunk );
+    }
+    else if ( i_len < i_dvr_chunk / 4 && i_dvr_chunk > DVR_CHUNK_MIN )
+    {
+        if ( ++i_dvr_small_reads < DVR_SHRINK_READS )
+            return;
+
+        i_dvr_chunk = i_dvr_chunk / TS_SIZE / 2 * TS_SIZE;
+        if ( i_dvr_chunk < DVR_CHUNK_MIN )
+            i_dvr_chunk = DVR_CHUNK_MIN;
+        i_dvr_small_reads = 0;
+        msg_Dbg( NULL, "DVR chunk size is now %d bytes", i_dvr_chunk );
+    }
+    else
+        i_dvr_small_reads = 0;
+}
+
+static void DVRReadChunk(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    block_buffer_t *p_buffer = block_BufferNew( i_dvr_chunk );
+    block_t *p_ts = NULL, **pp_current = &p_ts;
+    ssize_t i_len, i_offset;
+
+    if ( p_buffer == NULL )
+    {
+        msg_Err( NULL, "couldn't allocate DVR buffer" );
+        return;
+    }
+
+    i_len = read( i_dvr, p_buffer->p_data, i_dvr_chunk );
+    for ( i_offset = 0; i_offset + TS_SIZE <= i_len; i_offset += TS_SIZE )
+    {
+        *pp_current = block_NewView( p_buffer, i_offset );
+        pp_current = &(*pp_current)->p_next;
+    }
+    if ( i_len >= 0 )
+        DVRAdaptChunk( i_len );
+
+    /* The chain matches the data read, nothing is left over. */
+    DVRHandle( p_ts, i_len, NULL );
+    block_BufferRelease( p_buffer );
+}
+
+/*****************************************************************************
+ * DVRHandle: passes the i_len bytes read to the demux, returns unused blocks
+ *****************************************************************************/
+static block_t *DVRHandle( block_t *p_ts, ssize_t i_len,
+                           const uint8_t *p_header )
+{
+    block_t *p_unused, **pp_current;
+
+    if ( i_len < 0 )
     {
         msg_Err( NULL, "couldn't read from DVR device (%s)",
                  strerror(errno) );
@@ -181,7 +281,7 @@ static void DVRRead(struct ev_loop *loop, struct ev_io *w, int revents)
     i_len /= TS_SIZE;
 
     if ( i_len )
-        ev_timer_again(loop, &mute_watcher);
+        ev_timer_again(event_loop, &mute_watcher);
 
     pp_current = &p_ts;
     while ( i_len && *pp_current )
@@ -190,10 +290,11 @@ static void DVRRead(struct ev_loop *loop, struct ev_io *w, int revents)
         i_len--;
     }
 
-    p_freelist = *pp_current;
+    p_unused = *pp_current;
     *pp_current = NULL;
 
     demux_Run( p_ts );
+    return p_unused;
 }
 
 static void DVRMuteCb(struct ev_loop *loop, struct ev_timer *w, int revents)
@@ -59,7 +59,7 @@ output_t **pp_outputs = NULL;
 int i_nb_outputs = 0;
 output_t output_dup;
 bool b_passthrough = false;
-static const char *psz_conf_file = NULL;
+const char *psz_conf_file = NULL;
 char *psz_srv_socket = NULL;
 static int i_priority = -1;
 int i_adapter = 0;
@@ -91,6 +91,9 @@ int b_any_type = 0;
 int b_select_pmts = 0;
 int b_random_tsid = 0;
 char *psz_udp_src = NULL;
+char *psz_file_src = NULL;
+bool b_file_fast = false;
+bool b_file_loop = false;
 int i_asi_adapter = 0;
 const char *psz_native_charset = "UTF-8";
 print_type_t i_print_type = PRINT_TEXT;
@@ -98,6 +101,12 @@ bool b_print_enabled = false;
 FILE *print_fh;
 mtime_t i_print_period = 0;
 mtime_t i_es_timeout = 0;
+int i_input_ring = 0;
+int i_output_workers = 0;
+int i_demux_shards = 0;
+static unsigned int i_block_pool = DEFAULT_BLOCK_POOL;
+static bool b_block_hugepages = false;
+static bool b_block_prefault = false;
 
 int i_verbose = DEFAULT_VERBOSITY;
 int i_syslog = 0;
@@ -132,6 +141,20 @@ void (*pf_Reset)( void ) = NULL;
 int (*pf_SetFilter)( uint16_t i_pid ) = NULL;
 void (*pf_UnsetFilter)( int i_fd, uint16_t i_pid ) = NULL;
 
+/* Long options without a short equivalent */
+enum
+{
+    OPT_INPUT_THREAD = 256,
+    OPT_BLOCK_POOL,
+    OPT_BLOCK_HUGEPAGES,
+    OPT_BLOCK_PREFAULT,
+    OPT_DVR_CONTIGUOUS,
+    OPT_FILE_FAST,
+    OPT_FILE_LOOP,
+    OPT_OUTPUT_WORKERS,
+    OPT_DEMUX_SHARDS,
+};
+
 /*****************************************************************************
  * Configuration files
  *****************************************************************************/
@@ -598,6 +621,7 @@ void usage()
         "[-G <guard interval>] [-H <hierarchy>] [-X <transmission>] [-O <lock timeout>] "
 #endif
         "[-D [<src host>[:<src port>]@]<src mcast>[:<port>][/<opts>]*] "
+        "[-4 <file>] "
         "[-u] [-w] [-U] [-L <latency>] [-E <retention>] [-d <dest IP>[<:port>][/<opts>]*] [-3] "
         "[-z] [-C [-e] [-M <network name>] [-N <network ID>]] [-T] [-j <system charset>] "
         "[-W] [-Y] [-l] [-g <logger ident>] [-Z <mrtg file>] [-V] [-h] [-B <provider_name>] "
@@ -614,6 +638,10 @@ void usage()
     msg_Raw( NULL, "  -b --bandwidth        frontend bandwidth" );
 #endif
     msg_Raw( NULL, "  -D --rtp-input        read packets from a multicast address instead of a DVB card" );
+    msg_Raw( NULL, "  -4 --file-input       read packets from a file or a FIFO (- for stdin), paced by the PCRs" );
+    msg_Raw( NULL, "     --file-fast        read the file as fast as possible, dating packets from the PCRs" );
+    msg_Raw( NULL, "     --file-loop        rewind the file when its end is reached" );
+    msg_Raw( NULL, "     --input-thread[=<buffers>] read packets from a dedicated thread (default: 64 buffers)" );
 #ifdef HAVE_DVB_SUPPORT
     msg_Raw( NULL, "  -5 --delsys           delivery system" );
     msg_Raw( NULL, "    DVBS|DVBS2|DVBC_ANNEX_A|DVBT|DVBT2|ATSC (default guessed)");
@@ -646,6 +674,7 @@ void usage()
     msg_Raw( NULL, "  -O --lock-timeout     timeout for the lock operation (in ms)" );
     msg_Raw( NULL, "  -y --ca-number <ca_device_number>" );
     msg_Raw( NULL, "  -2 --dvr-buf-size <size> set the size of the DVR TS buffer in bytes (default: %d)", i_dvr_buffer_size);
+    msg_Raw( NULL, "     --dvr-contiguous[=<size>] read the DVR into contiguous buffers of up to <size> bytes (default: %d)", DEFAULT_DVR_CHUNK_MAX );
 #endif
 
     msg_Raw( NULL, "Output:" );
@@ -667,6 +696,8 @@ void usage()
     msg_Raw( NULL, "  -U --udp              use raw UDP rather than RTP (required by some IPTV set top boxes)" );
     msg_Raw( NULL, "  -z --any-type         pass through all ESs from the PMT, of any type" );
     msg_Raw( NULL, "  -0 --pidmap <pmt_pid,audio_pid,video_pid,spu_pid>");
+    msg_Raw( NULL, "     --output-workers <n> send the outputs from n threads (default: 0, main thread)" );
+    msg_Raw( NULL, "     --demux-shards <n> demux the ES PIDs of worker outputs from n threads (default: 0)" );
 
     msg_Raw( NULL, "Misc:" );
     msg_Raw( NULL, "  -h --help             display this full help" );
@@ -681,6 +712,9 @@ void usage()
     msg_Raw( NULL, "  -6 --print-period     periodicity at which we print bitrate and errors (in ms)" );
     msg_Raw( NULL, "  -7 --es-timeout       time of inactivy before which a PID is reported down (in ms)" );
     msg_Raw( NULL, "  -r --remote-socket <remote socket>" );
+    msg_Raw( NULL, "     --block-pool <n>   number of preallocated packet buffers (default: %d)", DEFAULT_BLOCK_POOL );
+    msg_Raw( NULL, "     --block-hugepages  allocate the packet buffers from huge pages" );
+    msg_Raw( NULL, "     --block-prefault   fault the packet buffers in at startup" );
     msg_Raw( NULL, "  -Z --mrtg-file <file> Log input packets and errors into mrtg-file" );
     msg_Raw( NULL, "  -V --version          only display the version" );
     exit(1);
@@ -746,6 +780,7 @@ int main( int i_argc, char **pp_argv )
         { "passthrough",     no_argument,       NULL, '3' },
         { "rtp-input",       required_argument, NULL, 'D' },
         { "asi-adapter",     required_argument, NULL, 'A' },
+        { "file-input",      required_argument, NULL, '4' },
         { "any-type",        no_argument,       NULL, 'z' },
         { "dvb-compliance",  no_argument,       NULL, 'C' },
         { "emm-passthrough", no_argument,       NULL, 'W' },
@@ -769,10 +804,19 @@ int main( int i_argc, char **pp_argv )
         { "ca-number",       required_argument, NULL, 'y' },
         { "pidmap",          required_argument, NULL, '0' },
         { "dvr-buf-size",    required_argument, NULL, '2' },
+        { "input-thread",    optional_argument, NULL, OPT_INPUT_THREAD },
+        { "block-pool",      required_argument, NULL, OPT_BLOCK_POOL },
+        { "block-hugepages", no_argument,       NULL, OPT_BLOCK_HUGEPAGES },
+        { "block-prefault",  no_argument,       NULL, OPT_BLOCK_PREFAULT },
+        { "dvr-contiguous",  optional_argument, NULL, OPT_DVR_CONTIGUOUS },
+        { "file-fast",       no_argument,       NULL, OPT_FILE_FAST },
+        { "file-loop",       no_argument,       NULL, OPT_FILE_LOOP },
+        { "output-workers",  required_argument, NULL, OPT_OUTPUT_WORKERS },
+        { "demux-shards",    required_argument, NULL, OPT_DEMUX_SHARDS },
         { 0, 0, 0, 0 }
     };
 
-    while ( (c = getopt_long(i_argc, pp_argv, "q::c:r:t:o:i:a:n:5:f:F:R:s:S:k:v:pb:I:m:P:K:G:H:X:O:uwUTL:E:d:3D:A:lg:zCWYeM:N:j:J:B:x:Q:6:7:hVZ:y:0:1:2:9:", long_options, NULL)) != -1 )
+    while ( (c = getopt_long(i_argc, pp_argv, "q::c:r:t:o:i:a:n:5:f:F:R:s:S:k:v:pb:I:m:P:K:G:H:X:O:uwUTL:E:d:3D:A:4:lg:zCWYeM:N:j:J:B:x:Q:6:7:hVZ:y:0:1:2:9:", long_options, NULL)) != -1 )
     {
         switch ( c )
         {
@@ -971,6 +1015,16 @@ int main( int i_argc, char **pp_argv )
             pf_UnsetFilter = udp_UnsetFilter;
             break;
 
+        case '4':
+            psz_file_src = optarg;
+            if ( pf_Open != NULL )
+                usage();
+            pf_Open = file_Open;
+            pf_Reset = file_Reset;
+            pf_SetFilter = file_SetFilter;
+            pf_UnsetFilter = file_UnsetFilter;
+            break;
+
         case 'A':
 #ifdef HAVE_ASI_SUPPORT
             if ( pf_Open != NULL )
@@ -1120,7 +1174,52 @@ int main( int i_argc, char **pp_argv )
             i_dvr_buffer_size /= TS_SIZE;
             i_dvr_buffer_size *= TS_SIZE;
             break;
+
+        case OPT_DVR_CONTIGUOUS:
+            i_dvr_chunk_max = optarg ? strtol( optarg, NULL, 0 )
+                                     : DEFAULT_DVR_CHUNK_MAX;
+            if ( i_dvr_chunk_max <= 0 )
+                usage();
+            break;
 #endif
+        case OPT_INPUT_THREAD:
+            i_input_ring = optarg ? strtol( optarg, NULL, 0 ) : 64;
+            if ( i_input_ring <= 0 )
+                usage();
+            break;
+
+        case OPT_FILE_FAST:
+            b_file_fast = true;
+            break;
+
+        case OPT_FILE_LOOP:
+            b_file_loop = true;
+            break;
+
+        case OPT_OUTPUT_WORKERS:
+            i_output_workers = strtol( optarg, NULL, 0 );
+            if ( i_output_workers < 0 )
+                usage();
+            break;
+
+        case OPT_DEMUX_SHARDS:
+            i_demux_shards = strtol( optarg, NULL, 0 );
+            if ( i_demux_shards < 0 )
+                usage();
+            break;
+
+        case OPT_BLOCK_POOL:
+            i_block_pool = strtoul( optarg, NULL, 0 );
+            break;
+
+        case OPT_BLOCK_HUGEPAGES:
+            b_block_hugepages = true;
+            break;
+
+        case OPT_BLOCK_PREFAULT:
+            b_block_prefault = true;
+            break;
+
         case 'h':
         default:
             usage();
@@ -1129,6 +1228,18 @@ int main( int i_argc, char **pp_argv )
     if ( optind < i_argc || pf_Open == NULL )
         usage();
 
+    if ( i_output_workers && b_file_fast )
+    {
+        msg_Warn( NULL, "--file-fast sends from the main thread, ignoring --output-workers" );
+        i_output_workers = 0;
+    }
+
+    if ( i_demux_shards && (!i_output_workers || b_do_remap || i_es_timeout) )
+    {
+        msg_Warn( NULL, "demux shards require --output-workers, and neither -0 nor -7, ignoring --demux-shards" );
+        i_demux_shards = 0;
+    }
+
     if ( b_enable_syslog )
         msg_Connect( psz_syslog_ident ? psz_syslog_ident : pp_argv[0] );
 
@@ -1171,6 +1282,9 @@ int main( int i_argc, char **pp_argv )
         exit(EXIT_FAILURE);
     }
 
+    block_Init( i_block_pool, b_block_hugepages, b_block_prefault );
+    outputs_Init();
+
     memset( &output_dup, 0, sizeof(output_dup) );
     if ( psz_dup_config != NULL )
     {
@@ -1198,11 +1312,7 @@ int main( int i_argc, char **pp_argv )
 
     srand( time(NULL) * getpid() );
 
-    demux_Open();
-
-    // init the mrtg logfile
-    mrtgInit(psz_mrtg_file);
-
+    /* Before demux_Open(), so that the input thread inherits it */
     if ( i_priority > 0 )
     {
         memset( &param, 0, sizeof(struct sched_param) );
@@ -1215,6 +1325,11 @@ int main( int i_argc, char **pp_argv )
         }
     }
 
+    demux_Open();
+
+    // init the mrtg logfile
+    mrtgInit(psz_mrtg_file);
+
     config_ReadFile();
 
     if ( psz_srv_socket != NULL )
@@ -1227,13 +1342,12 @@ int main( int i_argc, char **pp_argv )
         ev_timer_start(event_loop, &quit_watcher);
     }
 
-    outputs_Init();
-
     ev_run(event_loop, 0);
 
+    input_Close();
     mrtgClose();
-    outputs_Close( i_nb_outputs );
     demux_Close();
+    outputs_Close( i_nb_outputs );
     dvb_string_clean( &network_name );
     dvb_string_clean( &provider_name );
     if ( conf_iconv != (iconv_t)-1 )
@@ -100,16 +100,57 @@ struct udprawpkt {
 
 typedef int64_t mtime_t;
 
+/* Large buffer shared by several blocks (see block_NewView) */
+typedef struct block_buffer_t
+{
+    uint8_t *p_data;
+    size_t i_size;
+    int i_refcount;
+    struct block_buffer_t *p_next;
+} block_buffer_t;
+
 typedef struct block_t
 {
-    uint8_t p_ts[TS_SIZE];
+    uint8_t *p_ts; /* points to p_data, or into p_buffer for a view */
     int i_refcount;
     mtime_t i_dts;
-    uint16_t tmp_pid;
     struct block_t *p_next;
+    block_buffer_t *p_buffer;
+    uint8_t p_data[TS_SIZE];
 } block_t;
 
+/* TS headers of a batch of input packets, decoded once by demux_Run() */
+#define TS_HEADER_NOSYNC    0x01
+#define TS_HEADER_UNITSTART 0x40
+#define TS_HEADER_TEI       0x80
+
+typedef struct ts_headers_t
+{
+    unsigned int i_nb, i_size;
+    block_t **pp_blocks;
+    uint32_t *pi_words; /* first 4 bytes of the packets, as stored */
+    uint16_t *pi_pids;
+    uint8_t *pi_flags;  /* TS_HEADER_* */
+    uint8_t *pi_ccs;    /* 4th byte: scrambling, adaptation field and CC */
+} ts_headers_t;
+
+typedef struct block_stats_t
+{
+    unsigned int i_pool;        /* blocks in the preallocated pool */
+    unsigned int i_used;        /* blocks currently allocated */
+    unsigned int i_highwater;   /* maximum of i_used */
+    uint64_t i_hits;            /* allocations served without malloc() */
+    uint64_t i_misses;          /* allocations served by malloc() */
+} block_stats_t;
+
 typedef struct packet_t packet_t;
+typedef struct output_worker_t output_worker_t;
+typedef struct psi_share_t psi_share_t;
+
+typedef struct pid_pair_t
+{
+    uint16_t i_pid, i_newpid;
+} pid_pair_t;
 
 typedef struct dvb_string_t
 {
@@ -166,6 +207,11 @@ typedef struct output_t
     packet_t *p_packet_lifo;
     unsigned int i_packet_count;
     uint16_t i_seqnum;
+    /* thread sending the output (NULL for the main thread) */
+    output_worker_t *p_worker;
+    /* position in the send queue (-1 if idle), and deadline of p_packets */
+    int i_heap_index;
+    mtime_t i_send_date;
 
     /* demux */
     int i_nb_errors;
@@ -178,15 +224,20 @@ typedef struct output_t
     uint8_t i_nit_version, i_nit_cc;
     uint8_t *p_sdt_section;
     uint8_t i_sdt_version, i_sdt_cc;
+    /* owners of p_*_section, shared with the outputs having the same
+     * PSI-affecting configuration */
+    psi_share_t *p_pat_share, *p_pmt_share, *p_nit_share, *p_sdt_share;
+    /* SID under which the demux indexes the output, or -1 */
+    int i_indexed_sid;
     block_t *p_eit_ts_buffer;
     uint8_t i_eit_ts_buffer_offset, i_eit_cc;
     uint16_t i_tsid;
     /* incomplete PID (only PCR packets) */
     uint16_t i_pcr_pid;
-    // Arrays used for mapping pids.
-    // newpids is indexed using the original pid
-    uint16_t pi_newpids[MAX_PIDS];
-    uint16_t pi_freepids[MAX_PIDS];   // used where multiple streams of the same type are used
+    /* PID mapping, sorted by original PID; only allocated by the outputs
+     * which remap */
+    pid_pair_t *p_pid_pairs;
+    int i_nb_pid_pairs;
 
     struct udprawpkt raw_pkt_header;
 } output_t;
@@ -203,11 +254,52 @@ typedef struct ts_pid_info {
        1 = Reserved for future use
        2 = Scrambled with even key
        3 = Scrambled with odd key */
+    /* Classification of the PID from the PAT, CAT and PMTs; these fields
+       fit in the padding of the structure, so its size is unchanged */
+    uint8_t  i_type;                    /* PID_TYPE_* */
+    uint8_t  i_stream_type;             /* PMT stream type if PID_TYPE_ES */
+    uint16_t i_sid;                     /* Service of the PID, or 0 */
 } ts_pid_info_t;
 
+enum
+{
+    PID_TYPE_UNKNOWN = 0,
+    PID_TYPE_PAT,
+    PID_TYPE_CAT,
+    PID_TYPE_NIT,
+    PID_TYPE_SDT,
+    PID_TYPE_EIT,
+    PID_TYPE_TDT,
+    PID_TYPE_PMT,
+    PID_TYPE_ECM,
+    PID_TYPE_EMM,
+    PID_TYPE_PCR,
+    PID_TYPE_ES,
+};
+
+static inline const char *pid_type_name( uint8_t i_type )
+{
+    switch ( i_type )
+    {
+        case PID_TYPE_PAT: return "PAT";
+        case PID_TYPE_CAT: return "CAT";
+        case PID_TYPE_NIT: return "NIT";
+        case PID_TYPE_SDT: return "SDT";
+        case PID_TYPE_EIT: return "EPG";
+        case PID_TYPE_TDT: return "TDT/TOT";
+        case PID_TYPE_PMT: return "PMT";
+        case PID_TYPE_ECM: return "ECM";
+        case PID_TYPE_EMM: return "EMM";
+        case PID_TYPE_PCR: return "PCR";
+        case PID_TYPE_ES:  return "ES";
+        default:           return "...";
+    }
+}
+
 extern struct ev_loop *event_loop;
 extern int i_syslog;
 extern int i_verbose;
+extern const char *psz_conf_file;
 extern output_t **pp_outputs;
 extern int i_nb_outputs;
 extern output_t output_dup;
@@ -218,6 +310,7 @@ extern int i_fenum;
 extern int i_canum;
 extern char *psz_delsys;
 extern int i_dvr_buffer_size;
+extern int i_dvr_chunk_max;
 extern int i_frequency;
 extern int i_srate;
 extern int i_satnum;
@@ -246,6 +339,9 @@ extern bool b_enable_emm;
 extern bool b_enable_ecm;
 extern mtime_t i_wallclock;
 extern char *psz_udp_src;
+extern char *psz_file_src;
+extern bool b_file_fast;
+extern bool b_file_loop;
 extern int i_asi_adapter;
 extern const char *psz_native_charset;
 extern enum print_type_t i_print_type;
@@ -253,12 +349,36 @@ extern bool b_print_enabled;
 extern FILE *print_fh;
 extern mtime_t i_print_period;
 extern mtime_t i_es_timeout;
+extern int i_input_ring;
+extern int i_output_workers;
+extern int i_demux_shards;
 
 /* pid mapping */
 extern bool b_do_remap;
 extern uint16_t pi_newpids[N_MAP_PIDS];
 extern void init_pid_mapping( output_t * );
 
+/*****************************************************************************
+ * output_MapPID : returns the PID an output remaps i_pid to, or UNUSED_PID
+ *****************************************************************************/
+static inline uint16_t output_MapPID( const output_t *p_output, uint16_t i_pid )
+{
+    int i_min = 0, i_max = p_output->i_nb_pid_pairs;
+
+    while ( i_min < i_max )
+    {
+        int i = (i_min + i_max) / 2;
+        if ( p_output->p_pid_pairs[i].i_pid < i_pid )
+            i_min = i + 1;
+        else
+            i_max = i;
+    }
+    if ( i_min < p_output->i_nb_pid_pairs
+          && p_output->p_pid_pairs[i_min].i_pid == i_pid )
+        return p_output->p_pid_pairs[i_min].i_newpid;
+    return UNUSED_PID;
+}
+
 extern void (*pf_Open)( void );
 extern void (*pf_Reset)( void );
 extern int (*pf_SetFilter)( uint16_t i_pid );
@@ -292,6 +412,7 @@ void dvb_string_copy(dvb_string_t *p_dst, const dvb_string_t *p_src);
 int dvb_string_cmp(const dvb_string_t *p_1, const dvb_string_t *p_2);
 
 mtime_t mdate( void );
+void mdate_Force( mtime_t i_date );
 void msleep( mtime_t delay );
 void hexDump( uint8_t *p_data, uint32_t i_len );
 struct addrinfo *ParseNodeService( char *_psz_string, char **ppsz_end,
@@ -301,6 +422,11 @@ void config_ReadFile(void);
 
 uint8_t *psi_pack_section( uint8_t *p_sections, unsigned int *pi_size );
 uint8_t *psi_pack_sections( uint8_t **pp_sections, unsigned int *pi_size );
+uint32_t psi_crc32( uint32_t i_crc, const uint8_t *p, size_t i_len );
+uint32_t psi_crc32_zeros( uint32_t i_crc, size_t i_len );
+void psi_set_crc_fast( uint8_t *p_section );
+void psi_patch_crc( uint8_t *p_section, const uint8_t *p_old_header,
+                    uint16_t i_size );
 uint8_t **psi_unpack_sections( uint8_t *p_flat_sections, unsigned int i_size );
 
 void dvb_Open( void );
@@ -314,6 +440,11 @@ void udp_Reset( void );
 int udp_SetFilter( uint16_t i_pid );
 void udp_UnsetFilter( int i_fd, uint16_t i_pid );
 
+void file_Open( void );
+void file_Reset( void );
+int file_SetFilter( uint16_t i_pid );
+void file_UnsetFilter( int i_fd, uint16_t i_pid );
+
 void asi_Open( void );
 void asi_Reset( void );
 int asi_SetFilter( uint16_t i_pid );
@@ -326,10 +457,20 @@ int asi_deltacast_SetFilter( uint16_t i_pid );
 void asi_deltacast_UnsetFilter( int i_fd, uint16_t i_pid );
 #endif
 
+/* Called on the main thread with the blocks filled by the input thread;
+ * returns the blocks it did not use. */
+typedef block_t *(*input_handler_t)( block_t *p_ts, ssize_t i_len,
+                                     const uint8_t *p_header );
+void input_Start( int i_fd, int i_blocks, size_t i_header,
+                  input_handler_t pf_handler );
+void input_Close( void );
+
 void demux_Open( void );
 void demux_Run( block_t *p_ts );
 void demux_Change( output_t *p_output, const output_config_t *p_config );
 void demux_ResendCAPMTs( void );
+void demux_Quiesce( void );
+void demux_CloseOutput( output_t *p_output );
 bool demux_PIDIsSelected( uint16_t i_pid );
 char *demux_Iconv(void *_unused, const char *psz_encoding,
                   char *p_string, size_t i_length);
@@ -350,15 +491,39 @@ void output_Put( output_t *p_output, block_t *p_block );
 output_t *output_Find( const output_config_t *p_config );
 void output_Change( output_t *p_output, const output_config_t *p_config );
 void outputs_Init( void );
+void outputs_SetProducer( int i_producer );
+void outputs_Commit( void );
+mtime_t outputs_Run( void );
 void outputs_Close( int i_num_outputs );
 
 void comm_Open( void );
 void comm_Close( void );
 
+void block_Init( unsigned int i_pool, bool b_hugepages, bool b_prefault );
 block_t *block_New( void );
+block_buffer_t *block_BufferNew( size_t i_size );
+void block_BufferRelease( block_buffer_t *p_buffer );
+block_t *block_NewView( block_buffer_t *p_buffer, size_t i_offset );
 void block_Delete( block_t *p_block );
+void block_SetGarbage( block_t **pp_garbage );
+void block_Release( block_t *p_block );
+void block_Collect( block_t **pp_garbage );
+void block_GetStats( block_stats_t *p_stats );
 void block_Vacuum( void );
 
+/*****************************************************************************
+ * block_Ref, block_Unref: blocks may be released by worker threads
+ *****************************************************************************/
+static inline void block_Ref( block_t *p_block )
+{
+    __atomic_add_fetch( &p_block->i_refcount, 1, __ATOMIC_RELAXED );
+}
+
+static inline int block_Unref( block_t *p_block )
+{
+    return __atomic_sub_fetch( &p_block->i_refcount, 1, __ATOMIC_ACQ_REL );
+}
+
 /*****************************************************************************
  * block_DeleteChain
  *****************************************************************************/
@@ -178,8 +178,11 @@ void print_pid(uint16_t i_pid, ts_pid_info_t *p_info)
     if ( p_info->i_packets == 0 )
         return;
     if ( i_print_type == PRINT_TEXT )
-        printf("pid %d packn %lu ccerr %lu tserr %lu scramble %d Bps %lu seen %"PRId64"\n",
+        printf("pid %d type %s sid %u stype %u packn %lu ccerr %lu tserr %lu scramble %d Bps %lu seen %"PRId64"\n",
             i_pid,
+            pid_type_name( p_info->i_type ),
+            p_info->i_sid,
+            p_info->i_stream_type,
             p_info->i_packets,
             p_info->i_cc_errors,
             p_info->i_transport_errors,
@@ -188,8 +191,11 @@ void print_pid(uint16_t i_pid, ts_pid_info_t *p_info)
             now - p_info->i_last_packet_ts
         );
     else
-        printf("<PID pid=\"%d\" packn=\"%lu\" ccerr=\"%lu\" tserr=\"%lu\" scramble=\"%d\" Bps=\"%lu\" seen=\"%"PRId64"\" />\n",
+        printf("<PID pid=\"%d\" type=\"%s\" sid=\"%u\" stype=\"%u\" packn=\"%lu\" ccerr=\"%lu\" tserr=\"%lu\" scramble=\"%d\" Bps=\"%lu\" seen=\"%"PRId64"\" />\n",
             i_pid,
+            pid_type_name( p_info->i_type ),
+            p_info->i_sid,
+            p_info->i_stream_type,
             p_info->i_packets,
             p_info->i_cc_errors,
             p_info->i_transport_errors,
@@ -0,0 +1,438 @@
+/*****************************************************************************
+ * file.c: file and FIFO input for DVBlast
+ *****************************************************************************
+ * Copyright (C) 2016 VideoLAN
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*
+ * The file is read by chunks, and each chunk is given a date derived from
+ * the PCRs of the first PID carrying them, interpolated in between at the
+ * bitrate measured between the last two PCRs. In paced mode a chunk is
+ * handed to the demux when the system clock reaches its date. In fast mode
+ * it is handed over at once, and mdate() is forced to its date so that the
+ * demux and the outputs run on the stream clock instead of the system one.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <ev.h>
+
+#include <bitstream/common.h>
+#include <bitstream/mpeg/ts.h>
+
+#include "dvblast.h"
+
+/*****************************************************************************
+ * Local declarations
+ *****************************************************************************/
+#define FILE_READ_ONCE 64 /* packets */
+#define FILE_CHUNK_SIZE (FILE_READ_ONCE * TS_SIZE)
+#define FILE_MAX_CHUNKS 16 /* per callback, before letting other events in */
+#define FILE_MAX_PCR_GAP INT64_C(27000000) /* 1 s */
+#define FILE_PCR_WRAP (INT64_C(300) << 33)
+
+static int i_file_fd = -1;
+static bool b_file_fifo = false;
+static bool b_file_eof = false;
+static struct ev_io file_watcher;
+static struct ev_idle file_idle;
+static struct ev_timer file_timer;
+static struct ev_timer print_watcher;
+
+/* Partial packet left over by the previous read */
+static uint8_t p_remain[TS_SIZE];
+static size_t i_remain = 0;
+
+/* Chunk waiting for its date */
+static block_t *p_pending = NULL;
+static mtime_t i_pending_date;
+
+/* Stream clock: i_pcr_clock is in 27 MHz ticks and i_file_date in us, both
+ * since i_file_start */
+static mtime_t i_file_start = -1;
+static mtime_t i_file_date = 0;
+static int i_pcr_pid = -1;
+static int64_t i_last_pcr = -1;
+static int64_t i_pcr_clock = 0;
+static uint64_t i_pcr_packet = 0;
+static int64_t i_packet_duration;
+static uint64_t i_nb_packets = 0;
+
+/* Statistics */
+static bool b_file_sync = true;
+static uint64_t i_nb_discontinuities = 0, i_nb_resyncs = 0;
+static uint64_t i_print_packets = 0;
+static mtime_t i_print_date = 0;
+
+static void FileReadCb(struct ev_loop *loop, struct ev_io *w, int revents);
+static void FileIdleCb(struct ev_loop *loop, struct ev_idle *w, int revents);
+static void FileTimerCb(struct ev_loop *loop, struct ev_timer *w, int revents);
+static void FilePrintCb(struct ev_loop *loop, struct ev_timer *w, int revents);
+
+/*****************************************************************************
+ * file_Open
+ *****************************************************************************/
+void file_Open( void )
+{
+    struct stat st;
+
+    if ( !strcmp( psz_file_src, "-" ) )
+        i_file_fd = STDIN_FILENO;
+    /* Blocks until a writer shows up if this is a FIFO. */
+    else if ( (i_file_fd = open( psz_file_src, O_RDONLY )) < 0 )
+    {
+        msg_Err( NULL, "couldn't open %s (%s)", psz_file_src,
+                 strerror(errno) );
+        exit(EXIT_FAILURE);
+    }
+
+    if ( fstat( i_file_fd, &st ) < 0 )
+    {
+        msg_Err( NULL, "couldn't stat %s (%s)", psz_file_src,
+                 strerror(errno) );
+        exit(EXIT_FAILURE);
+    }
+
+    b_file_fifo = S_ISFIFO( st.st_mode ) || S_ISSOCK( st.st_mode );
+    if ( b_file_fifo )
+    {
+        fcntl( i_file_fd, F_SETFL, fcntl( i_file_fd, F_GETFL ) | O_NONBLOCK );
+        if ( b_file_loop )
+        {
+            msg_Warn( NULL, "%s cannot be rewound, not looping",
+                      psz_file_src );
+            b_file_loop = false;
+        }
+    }
+
+    if ( i_input_ring )
+        msg_Warn( NULL, "files are not read from an input thread" );
+
+    /* Until two PCRs have been seen */
+    i_packet_duration = INT64_C(27000000) * TS_SIZE * 8
+                         / DEFAULT_FILE_BITRATE;
+
+    ev_io_init( &file_watcher, FileReadCb, i_file_fd, EV_READ );
+    ev_idle_init( &file_idle, FileIdleCb );
+    ev_timer_init( &file_timer, FileTimerCb, 0, 0 );
+    ev_idle_start( event_loop, &file_idle );
+
+    if ( i_print_period )
+    {
+        ev_timer_init( &print_watcher, FilePrintCb,
+                       i_print_period / 1000000., i_print_period / 1000000. );
+        ev_timer_start( event_loop, &print_watcher );
+    }
+
+    msg_Dbg( NULL, "reading %s %s", psz_file_src,
+             b_file_fast ? "as fast as possible" : "at the PCR pace" );
+}
+
+/*****************************************************************************
+ * FileDate: date of the next packet
+ *****************************************************************************/
+static mtime_t FileDate( void )
+{
+    mtime_t i_date = (i_pcr_clock + (i_nb_packets - i_pcr_packet)
+                                     * i_packet_duration) / 27;
+
+    /* The extrapolation may overshoot the next PCR, never go back. */
+    if ( i_date > i_file_date )
+        i_file_date = i_date;
+    return i_file_start + i_file_date;
+}
+
+/*****************************************************************************
+ * FileHandlePCR: updates the stream clock with the packet at i_nb_packets
+ *****************************************************************************/
+static void FileHandlePCR( const uint8_t *p_ts )
+{
+    int64_t i_pcr, i_delta;
+    uint16_t i_pid = ts_get_pid( p_ts );
+
+    if ( !ts_has_adaptation( p_ts ) || !ts_get_adaptation( p_ts )
+          || !tsaf_has_pcr( p_ts ) )
+        return;
+
+    if ( i_pcr_pid == -1 )
+    {
+        msg_Dbg( NULL, "pacing on the PCRs of PID %hu", i_pid );
+        i_pcr_pid = i_pid;
+    }
+    else if ( i_pid != i_pcr_pid )
+        return;
+
+    i_pcr = tsaf_get_pcr( p_ts ) * 300 + tsaf_get_pcrext( p_ts );
+    i_delta = (i_pcr - i_last_pcr + FILE_PCR_WRAP) % FILE_PCR_WRAP;
+
+    if ( i_last_pcr != -1 && i_delta > 0 && i_delta < FILE_MAX_PCR_GAP
+          && i_nb_packets > i_pcr_packet )
+    {
+        i_packet_duration = i_delta / (i_nb_packets - i_pcr_packet);
+        i_pcr_clock += i_delta;
+    }
+    else
+    {
+        /* First PCR or discontinuity: go on at the current rate. */
+        if ( i_last_pcr != -1 )
+        {
+            msg_Dbg( NULL, "PCR discontinuity in %s", psz_file_src );
+            i_nb_discontinuities++;
+        }
+        i_pcr_clock += (i_nb_packets - i_pcr_packet) * i_packet_duration;
+    }
+
+    i_last_pcr = i_pcr;
+    i_pcr_packet = i_nb_packets;
+}
+
+/*****************************************************************************
+ * FileReadChunk: reads the next chunk into p_pending, returns the number of
+ * bytes read, 0 at the end of the file, -1 if nothing is available yet
+ *****************************************************************************/
+static ssize_t FileReadChunk( void )
+{
+    block_buffer_t *p_buffer = block_BufferNew( FILE_CHUNK_SIZE );
+    block_t **pp_current = &p_pending;
+    size_t i_offset = 0, i_size;
+    ssize_t i_len;
+
+    if ( p_buffer == NULL )
+    {
+        msg_Err( NULL, "couldn't allocate file buffer" );
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy( p_buffer->p_data, p_remain, i_remain );
+    i_len = read( i_file_fd, p_buffer->p_data + i_remain,
+                  FILE_CHUNK_SIZE - i_remain );
+    if ( i_len <= 0 )
+    {
+        block_BufferRelease( p_buffer );
+        if ( i_len < 0 && (errno == EAGAIN || errno == EINTR) )
+            return -1;
+        if ( i_len < 0 )
+            msg_Err( NULL, "couldn't read from %s (%s)", psz_file_src,
+                     strerror(errno) );
+        return 0;
+    }
+
+    if ( i_file_start == -1 )
+        i_file_start = mdate();
+
+    i_size = i_remain + i_len;
+    while ( i_offset + TS_SIZE <= i_size )
+    {
+        if ( !ts_validate( p_buffer->p_data + i_offset ) )
+        {
+            if ( b_file_sync )
+            {
+                msg_Warn( NULL, "lost TS sync in %s", psz_file_src );
+                i_nb_resyncs++;
+                b_file_sync = false;
+            }
+            i_offset++;
+            continue;
+        }
+        b_file_sync = true;
+
+        *pp_current = block_NewView( p_buffer, i_offset );
+        FileHandlePCR( (*pp_current)->p_ts );
+        i_nb_packets++;
+        pp_current = &(*pp_current)->p_next;
+        i_offset += TS_SIZE;
+    }
+
+    i_remain = i_size - i_offset;
+    memcpy( p_remain, p_buffer->p_data + i_offset, i_remain );
+    block_BufferRelease( p_buffer );
+
+    i_pending_date = FileDate();
+    return i_len;
+}
+
+/*****************************************************************************
+ * FileDrain: lets the outputs send what they still hold, then quits
+ *****************************************************************************/
+static void FileDrain( struct ev_loop *loop )
+{
+    mtime_t i_next;
+
+    while ( (i_next = outputs_Run()) != INT64_MAX )
+    {
+        if ( !b_file_fast )
+        {
+            ev_timer_set( &file_timer, (i_next - mdate()) / 1000000., 0 );
+            ev_timer_start( loop, &file_timer );
+            return;
+        }
+        mdate_Force( i_next );
+    }
+
+    ev_break( loop, EVBREAK_ALL );
+}
+
+/*****************************************************************************
+ * FileEnd
+ *****************************************************************************/
+static void FileEnd( struct ev_loop *loop )
+{
+    if ( b_file_loop && lseek( i_file_fd, 0, SEEK_SET ) == 0 )
+    {
+        msg_Dbg( NULL, "end of %s, rewinding", psz_file_src );
+        /* The clock goes on at the current rate until the first PCR. */
+        i_remain = 0;
+        i_last_pcr = -1;
+        ev_idle_start( loop, &file_idle );
+        return;
+    }
+
+    msg_Info( NULL, "end of %s", psz_file_src );
+    b_file_eof = true;
+    FileDrain( loop );
+}
+
+/*****************************************************************************
+ * FileProcess: hands over the chunks which are due
+ *****************************************************************************/
+static void FileProcess( struct ev_loop *loop )
+{
+    int i;
+
+    for ( i = 0; i < FILE_MAX_CHUNKS; i++ )
+    {
+        if ( p_pending == NULL )
+        {
+            ssize_t i_len = FileReadChunk();
+
+            if ( i_len < 0 )
+            {
+                ev_io_start( loop, &file_watcher );
+                return;
+            }
+            if ( i_len == 0 )
+            {
+                FileEnd( loop );
+                return;
+            }
+            if ( p_pending == NULL )
+                continue;
+        }
+
+        if ( b_file_fast )
+            mdate_Force( i_pending_date );
+        else if ( i_pending_date > mdate() )
+        {
+            ev_timer_set( &file_timer,
+                          (i_pending_date - mdate()) / 1000000., 0 );
+            ev_timer_start( loop, &file_timer );
+            return;
+        }
+
+        demux_Run( p_pending );
+        p_pending = NULL;
+        if ( b_file_fast )
+            outputs_Run();
+    }
+
+    ev_idle_start( loop, &file_idle );
+}
+
+/*****************************************************************************
+ * File events
+ *****************************************************************************/
+static void FileReadCb(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    ev_io_stop( loop, w );
+    FileProcess( loop );
+}
+
+static void FileIdleCb(struct ev_loop *loop, struct ev_idle *w, int revents)
+{
+    ev_idle_stop( loop, w );
+    FileProcess( loop );
+}
+
+static void FileTimerCb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+    if ( b_file_eof )
+        FileDrain( loop );
+    else
+        FileProcess( loop );
+}
+
+/*****************************************************************************
+ * FilePrintCb
+ *****************************************************************************/
+static void FilePrintCb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+    uint64_t i_packets = i_nb_packets - i_print_packets;
+    float f_bitrate = (float)i_packets * TS_SIZE * 8 / i_print_period;
+    float f_speed = (float)(i_file_date - i_print_date) / i_print_period;
+
+    i_print_packets = i_nb_packets;
+    i_print_date = i_file_date;
+
+    switch (i_print_type)
+    {
+        case PRINT_XML:
+            fprintf(print_fh,
+                    "<STATUS type=\"file\" packets=\"%"PRIu64"\" bitrate=\"%.2f\" speed=\"%.2f\" discontinuities=\"%"PRIu64"\" resyncs=\"%"PRIu64"\" />\n",
+                    i_packets, f_bitrate, f_speed, i_nb_discontinuities,
+                    i_nb_resyncs);
+            break;
+        case PRINT_TEXT:
+            fprintf(print_fh, "file: %"PRIu64" packets (%.2f Mbi/s, %.2fx real time), %"PRIu64" discontinuities, %"PRIu64" resyncs\n",
+                    i_packets, f_bitrate, f_speed, i_nb_discontinuities,
+                    i_nb_resyncs);
+            break;
+        default:
+            break;
+    }
+}
+
+/*****************************************************************************
+ * file_SetFilter: normally never called
+ *****************************************************************************/
+int file_SetFilter( uint16_t i_pid )
+{
+    return -1;
+}
+
+/*****************************************************************************
+ * file_UnsetFilter: normally never called
+ *****************************************************************************/
+void file_UnsetFilter( int i_fd, uint16_t i_pid )
+{
+}
+
+/*****************************************************************************
+ * file_Reset:
+ *****************************************************************************/
+void file_Reset( void )
+{
+}
@@ -0,0 +1,295 @@
+/*****************************************************************************
+ * input.c: dedicated input thread for DVBlast
+ *****************************************************************************
+ * Copyright (C) 2016 VideoLAN
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*
+ * The thread only does poll() and readv() into blocks which were allocated
+ * beforehand by the main thread, so that neither the block allocator nor
+ * libev (apart from ev_async_send) are touched outside of the event loop.
+ * Buffers circulate between two rings: the main thread refills them and
+ * pushes them on the free ring, the thread fills them and pushes them on
+ * the full ring.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include <ev.h>
+
+#include <bitstream/common.h>
+
+#include "dvblast.h"
+#include "ring.h"
+
+/*****************************************************************************
+ * Local declarations
+ *****************************************************************************/
+#define INPUT_POLL_TIMEOUT 100 /* ms */
+#define INPUT_FULL_WAIT 1000 /* 1 ms */
+#define INPUT_MAX_HEADER 16
+
+typedef struct input_buffer_t
+{
+    block_t *p_blocks;
+    ssize_t i_len;
+    int i_errno;
+    uint8_t p_header[INPUT_MAX_HEADER];
+} input_buffer_t;
+
+static int i_input_fd = -1;
+static int i_input_blocks;
+static size_t i_input_header;
+static input_handler_t pf_input_handler;
+
+static input_buffer_t *p_input_buffers = NULL;
+static unsigned int i_nb_input_buffers;
+static ring_t free_ring, full_ring;
+static pthread_t input_thread;
+static int b_input_die = 0;
+
+static struct ev_async input_watcher;
+static struct ev_timer print_watcher;
+
+/* Statistics, written by the input thread */
+static unsigned int i_ring_highwater = 0;
+static uint64_t i_ring_overruns = 0;
+
+/*****************************************************************************
+ * input_Refill: tops up the buffer with fresh blocks (main thread)
+ *****************************************************************************/
+static void input_Refill( input_buffer_t *p_buffer, block_t *p_unused )
+{
+    block_t **pp_current = &p_unused;
+    int i;
+
+    for ( i = 0; i < i_input_blocks; i++ )
+    {
+        if ( *pp_current == NULL )
+            *pp_current = block_New();
+        pp_current = &(*pp_current)->p_next;
+    }
+
+    p_buffer->p_blocks = p_unused;
+}
+
+/*****************************************************************************
+ * input_Thread
+ *****************************************************************************/
+static void *input_Thread( void *_unused )
+{
+    struct pollfd pfd = { .fd = i_input_fd, .events = POLLIN };
+    struct iovec p_iov[i_input_blocks + 1];
+    input_buffer_t *p_buffer = NULL;
+    bool b_overrun = false;
+
+    while ( !__atomic_load_n( &b_input_die, __ATOMIC_ACQUIRE ) )
+    {
+        unsigned int i_occupancy;
+        block_t *p_block;
+        int i_iov = 0;
+
+        if ( p_buffer == NULL &&
+             (p_buffer = ring_Pop( &free_ring )) == NULL )
+        {
+            /* The main loop lags behind, let the kernel buffer the data.
+             * An overrun is counted once, however long it lasts. */
+            if ( !b_overrun )
+                __atomic_add_fetch( &i_ring_overruns, 1, __ATOMIC_RELAXED );
+            b_overrun = true;
+            msleep( INPUT_FULL_WAIT );
+            continue;
+        }
+        b_overrun = false;
+
+        if ( poll( &pfd, 1, INPUT_POLL_TIMEOUT ) <= 0 )
+            continue;
+
+        if ( i_input_header )
+        {
+            p_iov[0].iov_base = p_buffer->p_header;
+            p_iov[0].iov_len = i_input_header;
+            i_iov = 1;
+        }
+        for ( p_block = p_buffer->p_blocks;
+              p_block != NULL && i_iov < i_input_blocks + 1;
+              p_block = p_block->p_next )
+        {
+            p_iov[i_iov].iov_base = p_block->p_ts;
+            p_iov[i_iov].iov_len = TS_SIZE;
+            i_iov++;
+        }
+
+        p_buffer->i_len = readv( i_input_fd, p_iov, i_iov );
+        if ( p_buffer->i_len < 0 )
+        {
+            if ( errno == EAGAIN || errno == EINTR )
+                continue;
+            p_buffer->i_errno = errno;
+        }
+
+        /* Cannot fail, there are as many buffers as ring slots. */
+        ring_Push( &full_ring, p_buffer );
+        p_buffer = NULL;
+
+        i_occupancy = ring_Count( &full_ring );
+        if ( i_occupancy > __atomic_load_n( &i_ring_highwater,
+                                            __ATOMIC_RELAXED ) )
+            __atomic_store_n( &i_ring_highwater, i_occupancy,
+                              __ATOMIC_RELAXED );
+
+        ev_async_send( event_loop, &input_watcher );
+    }
+
+    return NULL;
+}
+
+/*****************************************************************************
+ * input_Drain: hands the filled buffers over to the input (main thread)
+ *****************************************************************************/
+static void input_Drain( struct ev_loop *loop, struct ev_async *w,
+                         int revents )
+{
+    input_buffer_t *p_buffer;
+
+    while ( (p_buffer = ring_Pop( &full_ring )) != NULL )
+    {
+        block_t *p_unused;
+
+        errno = p_buffer->i_errno;
+        p_unused = pf_input_handler( p_buffer->p_blocks, p_buffer->i_len,
+                                     p_buffer->p_header );
+        input_Refill( p_buffer, p_unused );
+        ring_Push( &free_ring, p_buffer );
+    }
+}
+
+/*****************************************************************************
+ * input_PrintCb
+ *****************************************************************************/
+static void input_PrintCb( struct ev_loop *loop, struct ev_timer *w,
+                           int revents )
+{
+    unsigned int i_occupancy = ring_Count( &full_ring );
+    unsigned int i_highwater = __atomic_exchange_n( &i_ring_highwater, 0,
+                                                    __ATOMIC_RELAXED );
+    uint64_t i_overruns = __atomic_exchange_n( &i_ring_overruns, 0,
+                                               __ATOMIC_RELAXED );
+
+    switch (i_print_type)
+    {
+        case PRINT_XML:
+            fprintf(print_fh,
+                    "<STATUS type=\"input_ring\" size=\"%u\" occupancy=\"%u\" highwater=\"%u\" overruns=\"%"PRIu64"\" />\n",
+                    i_nb_input_buffers, i_occupancy, i_highwater, i_overruns);
+            break;
+        case PRINT_TEXT:
+            fprintf(print_fh, "input ring: %u/%u (high-water %u, overruns %"PRIu64")\n",
+                    i_occupancy, i_nb_input_buffers, i_highwater, i_overruns);
+            break;
+        default:
+            break;
+    }
+}
+
+/*****************************************************************************
+ * input_Start: reads i_fd from a dedicated thread; each read is done into
+ * an optional header of i_header bytes followed by i_blocks TS packets
+ *****************************************************************************/
+void input_Start( int i_fd, int i_blocks, size_t i_header,
+                  input_handler_t pf_handler )
+{
+    unsigned int i;
+    int i_error;
+
+    if ( i_header > INPUT_MAX_HEADER )
+    {
+        msg_Err( NULL, "input header too large (%zu)", i_header );
+        exit(EXIT_FAILURE);
+    }
+
+    i_input_fd = i_fd;
+    i_input_blocks = i_blocks;
+    i_input_header = i_header;
+    pf_input_handler = pf_handler;
+
+    i_nb_input_buffers = ring_Init( &free_ring, i_input_ring );
+    ring_Init( &full_ring, i_nb_input_buffers );
+    p_input_buffers = calloc( i_nb_input_buffers, sizeof(input_buffer_t) );
+    for ( i = 0; i < i_nb_input_buffers; i++ )
+    {
+        input_Refill( &p_input_buffers[i], NULL );
+        ring_Push( &free_ring, &p_input_buffers[i] );
+    }
+
+    ev_async_init( &input_watcher, input_Drain );
+    ev_async_start( event_loop, &input_watcher );
+
+    if ( i_print_period )
+    {
+        ev_timer_init( &print_watcher, input_PrintCb,
+                       i_print_period / 1000000., i_print_period / 1000000. );
+        ev_timer_start( event_loop, &print_watcher );
+    }
+
+    if ( (i_error = pthread_create( &input_thread, NULL, input_Thread,
+                                    NULL )) )
+    {
+        msg_Err( NULL, "couldn't create input thread (%s)",
+                 strerror(i_error) );
+        exit(EXIT_FAILURE);
+    }
+
+    msg_Dbg( NULL, "reading input from a thread (%u buffers of %d packets)",
+             i_nb_input_buffers, i_blocks );
+}
+
+/*****************************************************************************
+ * input_Close
+ *****************************************************************************/
+void input_Close( void )
+{
+    unsigned int i;
+
+    if ( p_input_buffers == NULL )
+        return;
+
+    __atomic_store_n( &b_input_die, 1, __ATOMIC_RELEASE );
+    pthread_join( input_thread, NULL );
+
+    ev_async_stop( event_loop, &input_watcher );
+    if ( i_print_period )
+        ev_timer_stop( event_loop, &print_watcher );
+
+    for ( i = 0; i < i_nb_input_buffers; i++ )
+        block_DeleteChain( p_input_buffers[i].p_blocks );
+    free( p_input_buffers );
+    p_input_buffers = NULL;
+
+    ring_Clean( &free_ring );
+    ring_Clean( &full_ring );
+}
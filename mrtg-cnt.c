@@ -31,34 +31,29 @@
 
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/time.h>
+#include <ev.h>
 
 #include "dvblast.h"
+#include "mrtg-cnt.h"
 
 // File handle
 static FILE *mrtg_fh = NULL;
 
+// Set when the counters are maintained by the demux
+bool b_mrtg = false;
+
 // Counts
-static long long l_mrtg_packets = 0;            // Packets received
-static long long l_mrtg_seq_err_packets = 0;    // Out of sequence packets received
-static long long l_mrtg_error_packets = 0;      // Packets received with the error flag set
-static long long l_mrtg_scram_packets = 0;      // Scrambled Packets received
+long long l_mrtg_packets = 0;           // Packets received
+long long l_mrtg_seq_err_packets = 0;   // Out of sequence packets received
+long long l_mrtg_error_packets = 0;     // Packets received with the error flag set
+long long l_mrtg_scram_packets = 0;     // Scrambled Packets received
 
 // Reporting timer
-#if defined( WIN32 )
-static LARGE_INTEGER mrtg_time;
-static LARGE_INTEGER mrtg_inc;
-#else
-static struct timeval mrtg_time = { 0, 0 };
-#endif
+static struct ev_timer mrtg_watcher;
 
 // Define the dump period in seconds
 #define MRTG_INTERVAL   10
 
-// Pid sequence numbers
-#define PIDS    0x2000
-static signed char i_pid_seq[PIDS];
-
 // Report the mrtg counters: bytes received, error packets & sequence errors
 static void dumpCounts()
 {
@@ -68,95 +63,20 @@ static void dumpCounts()
         fprintf(mrtg_fh, "%lld %lld %lld %lld\n",
                 l_mrtg_packets * 188 * multiplier,
                 l_mrtg_error_packets * multiplier,
-                l_mrtg_seq_err_packets * multiplier,
+                __atomic_load_n(&l_mrtg_seq_err_packets, __ATOMIC_RELAXED)
+                    * multiplier,
                 l_mrtg_scram_packets * multiplier);
         fflush(mrtg_fh);
     }
 }
 
-// analyse the input block counting packets and errors
-// The input is a pointer to a block_t structure, which might be a linked list
-// of blocks. Each block has one TS packet.
-void mrtgAnalyse(block_t * p_ts)
+// The counters themselves are updated by the demux, in its per-packet pass
+// (see mrtgCount and mrtgCheckCC); the timer only has to dump them.
+// Being a periodic ev timer, a late dump doesn't shift the next ones, and
+// a long stall of the input doesn't delay the reports either.
+static void mrtgCb(struct ev_loop *loop, struct ev_timer *w, int revents)
 {
-    unsigned int i_pid;
-    block_t *p_block = p_ts;
-
-    if (mrtg_fh == NULL) return;
-
-    while (p_block != NULL) {
-        uint8_t *ts_packet = p_block->p_ts;
-
-        char i_seq, i_last_seq;
-        l_mrtg_packets++;
-
-        if (ts_packet[0] != 0x47) {
-            l_mrtg_error_packets++;
-            p_block = p_block->p_next;
-            continue;
-        }
-
-        if (ts_packet[1] & 0x80) {
-            l_mrtg_error_packets++;
-            p_block = p_block->p_next;
-            continue;
-        }
-
-        i_pid = (ts_packet[1] & 0x1f) << 8 | ts_packet[2];
-
-        // Just count null packets - don't check the sequence numbering
-        if (i_pid == 0x1fff) {
-            p_block = p_block->p_next;
-            continue;
-        }
-
-        if (ts_packet[3] & 0xc0) {
-            l_mrtg_scram_packets++;
-        }
-        // Check the sequence numbering
-        i_seq = ts_packet[3] & 0xf;
-        i_last_seq = i_pid_seq[i_pid];
-
-        if (i_last_seq == -1) {
-            // First packet - ignore the sequence
-        } else if (ts_packet[3] & 0x10) {
-            // Packet contains payload - sequence should be up by one
-            if (i_seq != ((i_last_seq + 1) & 0x0f)) {
-                l_mrtg_seq_err_packets++;
-            }
-        } else {
-            // Packet contains no payload - sequence should be unchanged
-            if (i_seq != i_last_seq) {
-                l_mrtg_seq_err_packets++;
-            }
-        }
-        i_pid_seq[i_pid] = i_seq;
-
-        // Look at next block
-        p_block = p_block->p_next;
-    }
-
-    // All blocks processed. See if we need to dump the stats
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    if (timercmp(&now, &mrtg_time, >)) {
-        // Time to report the mrtg counters
-        dumpCounts();
-
-        // Set the timer for next time
-        //
-        // Normally we add the interval to the previous time so that if one
-        // dump is a bit late, the next one still occurs at the correct time.
-        // However, if there is a long gap (e.g. because the channel has
-        // stopped for some time), then just rebase the timing to the current
-        // time.  I've chosen MRTG_INTERVAL as the long gap - this is arbitary
-        if ((now.tv_sec - mrtg_time.tv_sec) > MRTG_INTERVAL) {
-            msg_Dbg(NULL, "Dump is %d seconds late - reset timing\n",
-                    (int) (now.tv_sec - mrtg_time.tv_sec));
-            mrtg_time = now;
-        }
-        mrtg_time.tv_sec += MRTG_INTERVAL;
-    }
+    dumpCounts();
 }
 
 int mrtgInit(char *mrtg_file)
@@ -174,12 +94,12 @@ int mrtgInit(char *mrtg_file)
     fprintf(mrtg_fh, "0 0 0 0\n");
     fflush(mrtg_fh);
 
-    // Initialise the sequence numbering
-    memset(&i_pid_seq[0], -1, sizeof(signed char) * PIDS);
+    // The sequence numbering is tracked by the demux
+    b_mrtg = true;
 
     // Set the reporting timer
-    gettimeofday(&mrtg_time, NULL);
-    mrtg_time.tv_sec += MRTG_INTERVAL;
+    ev_timer_init(&mrtg_watcher, mrtgCb, MRTG_INTERVAL, MRTG_INTERVAL);
+    ev_timer_start(event_loop, &mrtg_watcher);
 
     return 0;
 }
@@ -188,6 +108,8 @@ void mrtgClose()
 {
     // This is only for testing when using filetest.
     if (mrtg_fh) {
+        ev_timer_stop(event_loop, &mrtg_watcher);
+        b_mrtg = false;
         dumpCounts();
         fclose(mrtg_fh);
         mrtg_fh = NULL;
@@ -25,8 +25,53 @@
 #ifndef MRTG_CNT_H
 #define MRTG_CNT_H
 
+extern bool b_mrtg;
+extern long long l_mrtg_packets;
+extern long long l_mrtg_seq_err_packets;
+extern long long l_mrtg_error_packets;
+extern long long l_mrtg_scram_packets;
+
 int mrtgInit(char *mrtg_file);
 void mrtgClose();
-void mrtgAnalyse(block_t * p_ts);
+
+// Count a packet from its decoded TS header (main demux thread)
+static inline void mrtgCount(uint16_t i_pid, uint8_t i_flags,
+                             uint8_t i_cc_byte)
+{
+    l_mrtg_packets++;
+
+    if (i_flags & (TS_HEADER_NOSYNC | TS_HEADER_TEI)) {
+        l_mrtg_error_packets++;
+        return;
+    }
+
+    // Just count null packets - don't check the sequence numbering
+    if (i_pid != 0x1fff && (i_cc_byte & 0xc0))
+        l_mrtg_scram_packets++;
+}
+
+// Check the sequence numbering of a valid, non-null packet against the
+// continuity counter of the previous one, as kept by the demux (from the
+// thread demuxing the PID)
+static inline void mrtgCheckCC(int8_t i_last_cc, uint8_t i_cc_byte)
+{
+    uint8_t i_seq = i_cc_byte & 0xf;
+
+    if (i_last_cc == -1) {
+        // First packet - ignore the sequence
+        return;
+    }
+
+    if (i_cc_byte & 0x10) {
+        // Packet contains payload - sequence should be up by one
+        if (i_seq == ((i_last_cc + 1) & 0x0f))
+            return;
+    } else {
+        // Packet contains no payload - sequence should be unchanged
+        if (i_seq == i_last_cc)
+            return;
+    }
+    __atomic_add_fetch(&l_mrtg_seq_err_packets, 1, __ATOMIC_RELAXED);
+}
 
 #endif
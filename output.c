@@ -21,10 +21,12 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
  *****************************************************************************/
 
+#define _GNU_SOURCE /* sendmmsg() */
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/socket.h>
@@ -34,9 +36,11 @@
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <errno.h>
+#include <pthread.h>
 #include <ev.h>
 
 #include "dvblast.h"
+#include "ring.h"
 
 #include <bitstream/mpeg/ts.h>
 #include <bitstream/ietf/rtp.h>
@@ -45,9 +49,74 @@
  * Local declarations
  *****************************************************************************/
 #define MAX_PACKETS 100
+#define OUTPUT_BATCH 64 /* datagrams per output_Flush() */
+#define WORKER_BATCH 256 /* blocks per hand-over to a worker */
+#define WORKER_BATCHES 64 /* hand-overs in flight per worker and producer */
+#define WORKER_DRAIN_WAIT 100 /* 100 us */
 
-static struct ev_timer output_watcher;
-static mtime_t i_next_send = INT64_MAX;
+/* Send queue of the main thread, or of an output worker */
+typedef struct output_sched_t
+{
+    struct ev_loop *p_loop;
+    struct ev_timer watcher;
+    mtime_t i_next_send;
+    mtime_t *pi_wallclock;
+
+    /* Outputs having packets to send, as a binary min-heap on i_send_date */
+    output_t **pp_heap;
+    int i_heap_size, i_heap_alloc;
+} output_sched_t;
+
+/*
+ * Outputs may be sharded over worker threads, each with its own event loop,
+ * send queue and sockets. The demux hands the blocks over in batches,
+ * through a ring per worker and per producer thread: the main thread, and
+ * the demux shards if any. Since the block allocator belongs to the main
+ * thread, the blocks released by a worker are handed back with
+ * block_Release(). The output configuration is modified by the main thread
+ * with the worker lock held.
+ */
+typedef struct output_batch_t
+{
+    unsigned int i_count;
+    struct
+    {
+        output_t *p_output;
+        block_t *p_block;
+    } p_items[WORKER_BATCH];
+} output_batch_t;
+
+/* Blocks handed over to a worker by one producer thread */
+typedef struct output_feed_t
+{
+    output_batch_t *p_batches;
+    output_batch_t *p_pending; /* being filled by the producer */
+    ring_t queue, free_ring;
+    uint64_t i_overruns;
+} output_feed_t;
+
+struct output_worker_t
+{
+    output_sched_t sched;
+    mtime_t i_wallclock;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct ev_async wakeup_watcher;
+    int b_die;
+
+    output_feed_t *p_feeds; /* indexed by producer, 0 is the main thread */
+    block_t *p_garbage;
+
+    unsigned int i_nb_outputs;
+};
+
+static output_sched_t main_sched;
+static output_worker_t *p_workers = NULL;
+static int i_nb_workers = 0;
+static int i_nb_producers = 1;
+static __thread output_worker_t *p_current_worker = NULL;
+static __thread int i_current_producer = 0;
+static struct ev_timer print_watcher;
 
 struct packet_t
 {
@@ -185,6 +254,361 @@ void output_PacketVacuum( output_t *p_output )
     }
 }
 
+/*****************************************************************************
+ * Send queue
+ *****************************************************************************/
+static inline output_sched_t *output_Sched( output_t *p_output )
+{
+    return p_output->p_worker != NULL ? &p_output->p_worker->sched
+                                      : &main_sched;
+}
+
+static void output_HeapSet( output_sched_t *p_sched, int i,
+                            output_t *p_output )
+{
+    p_sched->pp_heap[i] = p_output;
+    p_output->i_heap_index = i;
+}
+
+static void output_HeapUp( output_sched_t *p_sched, int i )
+{
+    output_t **pp_heap = p_sched->pp_heap;
+    output_t *p_output = pp_heap[i];
+
+    while ( i > 0 && pp_heap[(i - 1) / 2]->i_send_date > p_output->i_send_date )
+    {
+        output_HeapSet( p_sched, i, pp_heap[(i - 1) / 2] );
+        i = (i - 1) / 2;
+    }
+    output_HeapSet( p_sched, i, p_output );
+}
+
+static void output_HeapDown( output_sched_t *p_sched, int i )
+{
+    output_t **pp_heap = p_sched->pp_heap;
+    output_t *p_output = pp_heap[i];
+
+    for ( ; ; )
+    {
+        int i_child = 2 * i + 1;
+
+        if ( i_child >= p_sched->i_heap_size )
+            break;
+        if ( i_child + 1 < p_sched->i_heap_size
+              && pp_heap[i_child + 1]->i_send_date
+                  < pp_heap[i_child]->i_send_date )
+            i_child++;
+        if ( pp_heap[i_child]->i_send_date >= p_output->i_send_date )
+            break;
+        output_HeapSet( p_sched, i, pp_heap[i_child] );
+        i = i_child;
+    }
+    output_HeapSet( p_sched, i, p_output );
+}
+
+/*****************************************************************************
+ * output_Unschedule : removes the output from its send queue
+ *****************************************************************************/
+static void output_Unschedule( output_t *p_output )
+{
+    output_sched_t *p_sched = output_Sched( p_output );
+    int i = p_output->i_heap_index;
+    output_t *p_last;
+
+    if ( i == -1 )
+        return;
+    p_output->i_heap_index = -1;
+    if ( i == --p_sched->i_heap_size )
+        return;
+
+    /* Replace it with the last entry. */
+    p_last = p_sched->pp_heap[p_sched->i_heap_size];
+    output_HeapSet( p_sched, i, p_last );
+    output_HeapUp( p_sched, i );
+    output_HeapDown( p_sched, p_last->i_heap_index );
+}
+
+/*****************************************************************************
+ * output_Schedule : updates the position of the output in the send queue
+ * after its first packet changed
+ *****************************************************************************/
+static void output_Schedule( output_t *p_output )
+{
+    output_sched_t *p_sched = output_Sched( p_output );
+    int i = p_output->i_heap_index;
+
+    if ( p_output->p_packets == NULL )
+    {
+        /* Nothing left to send */
+        output_Unschedule( p_output );
+        return;
+    }
+
+    p_output->i_send_date = p_output->p_packets->i_dts
+                             + p_output->config.i_output_latency;
+
+    if ( i == -1 )
+    {
+        if ( p_sched->i_heap_size == p_sched->i_heap_alloc )
+        {
+            p_sched->i_heap_alloc = p_sched->i_heap_alloc ?
+                                    2 * p_sched->i_heap_alloc : 16;
+            p_sched->pp_heap = realloc( p_sched->pp_heap,
+                                 p_sched->i_heap_alloc * sizeof(output_t *) );
+        }
+        i = p_sched->i_heap_size++;
+        output_HeapSet( p_sched, i, p_output );
+    }
+
+    output_HeapUp( p_sched, i );
+    output_HeapDown( p_sched, p_output->i_heap_index );
+}
+
+/*****************************************************************************
+ * outputs_Arm : re-arms the timer if the send queue got an earlier deadline
+ * (from the thread running the send queue)
+ *****************************************************************************/
+static void outputs_Arm( output_sched_t *p_sched )
+{
+    if ( p_sched->i_heap_size
+          && p_sched->i_next_send > p_sched->pp_heap[0]->i_send_date )
+    {
+        p_sched->i_next_send = p_sched->pp_heap[0]->i_send_date;
+        ev_timer_stop( p_sched->p_loop, &p_sched->watcher );
+        ev_timer_set( &p_sched->watcher,
+                      (p_sched->i_next_send - *p_sched->pi_wallclock)
+                       / 1000000., 0 );
+        ev_timer_start( p_sched->p_loop, &p_sched->watcher );
+    }
+}
+
+/*****************************************************************************
+ * Output workers
+ *****************************************************************************/
+static void output_Queue( output_t *p_output, block_t *p_block );
+
+/*****************************************************************************
+ * output_WorkerCommit : hands the pending batch of the current producer over
+ * to the worker
+ *****************************************************************************/
+static void output_WorkerCommit( output_worker_t *p_worker )
+{
+    output_feed_t *p_feed = &p_worker->p_feeds[i_current_producer];
+
+    if ( p_feed->p_pending == NULL || !p_feed->p_pending->i_count )
+        return;
+
+    /* Cannot fail, there are as many batches as ring slots. */
+    ring_Push( &p_feed->queue, p_feed->p_pending );
+    p_feed->p_pending = NULL;
+    ev_async_send( p_worker->sched.p_loop, &p_worker->wakeup_watcher );
+}
+
+/*****************************************************************************
+ * output_WorkerPut : adds a block to the pending batch of the current
+ * producer
+ *****************************************************************************/
+static void output_WorkerPut( output_worker_t *p_worker, output_t *p_output,
+                              block_t *p_block )
+{
+    output_feed_t *p_feed = &p_worker->p_feeds[i_current_producer];
+    output_batch_t *p_batch = p_feed->p_pending;
+
+    if ( p_batch == NULL )
+    {
+        p_batch = p_feed->p_pending = ring_Pop( &p_feed->free_ring );
+        if ( p_batch == NULL )
+        {
+            /* The worker lags behind, drop the block. */
+            __atomic_add_fetch( &p_feed->i_overruns, 1, __ATOMIC_RELAXED );
+            return;
+        }
+    }
+
+    block_Ref( p_block );
+    p_batch->p_items[p_batch->i_count].p_output = p_output;
+    p_batch->p_items[p_batch->i_count].p_block = p_block;
+    if ( ++p_batch->i_count == WORKER_BATCH )
+        output_WorkerCommit( p_worker );
+}
+
+/*****************************************************************************
+ * output_WorkerSync : waits until the worker has processed all the blocks
+ * handed over, and takes its lock (main thread, with the demux shards idle)
+ *****************************************************************************/
+static void output_WorkerSync( output_worker_t *p_worker )
+{
+    int i;
+
+    output_WorkerCommit( p_worker );
+    for ( i = 0; i < i_nb_producers; i++ )
+        while ( ring_Count( &p_worker->p_feeds[i].queue ) )
+            msleep( WORKER_DRAIN_WAIT );
+
+    /* The worker pops and processes the batches with the lock held. */
+    pthread_mutex_lock( &p_worker->lock );
+}
+
+/*****************************************************************************
+ * output_WorkerWakeup : processes the blocks handed over (worker thread)
+ *****************************************************************************/
+static void output_WorkerWakeup( struct ev_loop *loop, struct ev_async *w,
+                                 int revents )
+{
+    output_worker_t *p_worker = w->data;
+    int i_producer;
+
+    pthread_mutex_lock( &p_worker->lock );
+    p_worker->i_wallclock = mdate();
+
+    for ( i_producer = 0; i_producer < i_nb_producers; i_producer++ )
+    {
+        output_feed_t *p_feed = &p_worker->p_feeds[i_producer];
+        output_batch_t *p_batch;
+
+        while ( (p_batch = ring_Pop( &p_feed->queue )) != NULL )
+        {
+            unsigned int i;
+
+            for ( i = 0; i < p_batch->i_count; i++ )
+                output_Queue( p_batch->p_items[i].p_output,
+                              p_batch->p_items[i].p_block );
+            p_batch->i_count = 0;
+            ring_Push( &p_feed->free_ring, p_batch );
+        }
+    }
+
+    /* The main thread may also have changed the send dates. */
+    p_worker->sched.i_next_send = INT64_MAX;
+    outputs_Arm( &p_worker->sched );
+    pthread_mutex_unlock( &p_worker->lock );
+
+    if ( __atomic_load_n( &p_worker->b_die, __ATOMIC_ACQUIRE ) )
+        ev_break( loop, EVBREAK_ALL );
+}
+
+/*****************************************************************************
+ * output_WorkerThread
+ *****************************************************************************/
+static void *output_WorkerThread( void *_p_worker )
+{
+    output_worker_t *p_worker = _p_worker;
+
+    p_current_worker = p_worker;
+    block_SetGarbage( &p_worker->p_garbage );
+    ev_run( p_worker->sched.p_loop, 0 );
+    return NULL;
+}
+
+/*****************************************************************************
+ * output_Attach : picks the thread running the output
+ *****************************************************************************/
+static void output_Attach( output_t *p_output, const output_config_t *p_config )
+{
+    output_worker_t *p_worker = NULL;
+    int i;
+
+    /* The demux rewrites the PID map of remapping outputs without
+     * synchronization, keep them on the main thread. */
+    if ( p_config->b_do_remap )
+        return;
+
+    for ( i = 0; i < i_nb_workers; i++ )
+        if ( p_worker == NULL
+              || p_workers[i].i_nb_outputs < p_worker->i_nb_outputs )
+            p_worker = &p_workers[i];
+
+    if ( p_worker != NULL )
+        p_worker->i_nb_outputs++;
+    p_output->p_worker = p_worker;
+}
+
+/*****************************************************************************
+ * output_Detach : moves the output back to the main thread
+ *****************************************************************************/
+static void output_Detach( output_t *p_output )
+{
+    output_worker_t *p_worker = p_output->p_worker;
+
+    /* The demux shards only hand blocks over to worker outputs. */
+    demux_Quiesce();
+    output_WorkerSync( p_worker );
+    output_Unschedule( p_output );
+    p_output->p_worker = NULL;
+    p_worker->i_nb_outputs--;
+    pthread_mutex_unlock( &p_worker->lock );
+
+    output_Schedule( p_output );
+    outputs_Arm( &main_sched );
+}
+
+/*****************************************************************************
+ * outputs_SetProducer : declares the calling thread as demux shard
+ * i_producer (1 and above)
+ *****************************************************************************/
+void outputs_SetProducer( int i_producer )
+{
+    i_current_producer = i_producer;
+}
+
+/*****************************************************************************
+ * outputs_Commit : hands the blocks put by the calling thread since the last
+ * call over to the output workers; on the main thread, also deletes the
+ * blocks they released
+ *****************************************************************************/
+void outputs_Commit( void )
+{
+    int i;
+
+    for ( i = 0; i < i_nb_workers; i++ )
+    {
+        output_WorkerCommit( &p_workers[i] );
+        if ( i_current_producer == 0 )
+            block_Collect( &p_workers[i].p_garbage );
+    }
+}
+
+/*****************************************************************************
+ * outputs_PrintCb
+ *****************************************************************************/
+static void outputs_PrintCb( struct ev_loop *loop, struct ev_timer *w,
+                             int revents )
+{
+    int i;
+
+    for ( i = 0; i < i_nb_workers; i++ )
+    {
+        output_worker_t *p_worker = &p_workers[i];
+        unsigned int i_occupancy = 0;
+        uint64_t i_overruns = 0;
+        int j;
+
+        for ( j = 0; j < i_nb_producers; j++ )
+        {
+            output_feed_t *p_feed = &p_worker->p_feeds[j];
+            i_occupancy += ring_Count( &p_feed->queue );
+            i_overruns += __atomic_exchange_n( &p_feed->i_overruns, 0,
+                                               __ATOMIC_RELAXED );
+        }
+
+        switch (i_print_type)
+        {
+            case PRINT_XML:
+                fprintf(print_fh,
+                        "<STATUS type=\"output_worker\" id=\"%d\" outputs=\"%u\" queue=\"%u\" overruns=\"%"PRIu64"\" />\n",
+                        i, p_worker->i_nb_outputs, i_occupancy, i_overruns);
+                break;
+            case PRINT_TEXT:
+                fprintf(print_fh, "output worker %d: %u outputs, queue %u/%d (overruns %"PRIu64")\n",
+                        i, p_worker->i_nb_outputs, i_occupancy,
+                        WORKER_BATCHES * i_nb_producers, i_overruns);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
 /*****************************************************************************
  * output_Create : create and insert the output_t structure
  *****************************************************************************/
@@ -219,11 +643,7 @@ output_t *output_Create( const output_config_t *p_config )
 /* Init the mapped pids to unused */
 void init_pid_mapping( output_t *p_output )
 {
-    unsigned int i;
-    for ( i = 0; i < MAX_PIDS; i++ ) {
-        p_output->pi_newpids[i]  = UNUSED_PID;
-        p_output->pi_freepids[i] = UNUSED_PID;
-    }
+    p_output->i_nb_pid_pairs = 0;
 }
 
 /*****************************************************************************
@@ -236,6 +656,7 @@ int output_Init( output_t *p_output, const output_config_t *p_config )
                                sizeof(struct sockaddr_in6);
 
     memset( p_output, 0, sizeof(output_t) );
+    p_output->i_heap_index = -1;
     config_Init( &p_output->config );
 
     /* Init run-time values */
@@ -256,6 +677,11 @@ int output_Init( output_t *p_output, const output_config_t *p_config )
     p_output->p_pmt_section = NULL;
     p_output->p_nit_section = NULL;
     p_output->p_sdt_section = NULL;
+    p_output->p_pat_share = NULL;
+    p_output->p_pmt_share = NULL;
+    p_output->p_nit_share = NULL;
+    p_output->p_sdt_share = NULL;
+    p_output->i_indexed_sid = -1;
     p_output->p_eit_ts_buffer = NULL;
     if ( b_random_tsid )
         p_output->i_tsid = rand() & 0xffff;
@@ -342,6 +768,7 @@ int output_Init( output_t *p_output, const output_config_t *p_config )
         return -errno;
     }
 
+    output_Attach( p_output, p_config );
     p_output->config.i_config |= OUTPUT_VALID;
 
     return 0;
@@ -352,17 +779,22 @@ int output_Init( output_t *p_output, const output_config_t *p_config )
  *****************************************************************************/
 void output_Close( output_t *p_output )
 {
-    packet_t *p_packet = p_output->p_packets;
+    output_worker_t *p_worker = p_output->p_worker;
+    packet_t *p_packet;
+
+    if ( p_worker != NULL )
+    {
+        demux_Quiesce();
+        output_WorkerSync( p_worker );
+    }
+
+    p_packet = p_output->p_packets;
     while ( p_packet != NULL )
     {
         int i;
 
         for ( i = 0; i < p_packet->i_depth; i++ )
-        {
-            p_packet->pp_blocks[i]->i_refcount--;
-            if ( !p_packet->pp_blocks[i]->i_refcount )
-                block_Delete( p_packet->pp_blocks[i] );
-        }
+            block_Release( p_packet->pp_blocks[i] );
         p_output->p_packets = p_packet->p_next;
         output_PacketDelete( p_output, p_packet );
         p_packet = p_output->p_packets;
@@ -370,27 +802,34 @@ void output_Close( output_t *p_output )
     output_PacketVacuum( p_output );
 
     p_output->p_packets = p_output->p_last_packet = NULL;
-    free( p_output->p_pat_section );
-    free( p_output->p_pmt_section );
-    free( p_output->p_nit_section );
-    free( p_output->p_sdt_section );
+    output_Schedule( p_output );
+    demux_CloseOutput( p_output );
     free( p_output->p_eit_ts_buffer );
+    free( p_output->p_pid_pairs );
+    p_output->p_pid_pairs = NULL;
+    p_output->i_nb_pid_pairs = 0;
     p_output->config.i_config &= ~OUTPUT_VALID;
 
     close( p_output->i_handle );
 
     config_Free( &p_output->config );
+
+    if ( p_worker != NULL )
+    {
+        p_worker->i_nb_outputs--;
+        pthread_mutex_unlock( &p_worker->lock );
+    }
 }
 
 /*****************************************************************************
- * output_Flush
+ * output_Prepare : fills p_iov with the datagram carrying p_packet, and
+ * returns the number of entries used (up to 2 * i_block_cnt + 2)
  *****************************************************************************/
-static void output_Flush( output_t *p_output )
+static int output_Prepare( output_t *p_output, packet_t *p_packet,
+                           int i_block_cnt, struct iovec *p_iov,
+                           uint8_t *p_rtp_hdr,
+                           uint8_t (*p_ts_hdrs)[TS_HEADER_SIZE] )
 {
-    packet_t *p_packet = p_output->p_packets;
-    int i_block_cnt = output_BlockCount( p_output );
-    struct iovec p_iov[i_block_cnt + 2];
-    uint8_t p_rtp_hdr[RTP_HEADER_SIZE];
     int i_iov = 0, i_payload_len, i_block;
 
     if ( (p_output->config.i_config & OUTPUT_RAW) )
@@ -403,14 +842,15 @@ static void output_Flush( output_t *p_output )
     if ( !(p_output->config.i_config & OUTPUT_UDP) )
     {
         p_iov[i_iov].iov_base = p_rtp_hdr;
-        p_iov[i_iov].iov_len = sizeof(p_rtp_hdr);
+        p_iov[i_iov].iov_len = RTP_HEADER_SIZE;
 
         rtp_set_hdr( p_rtp_hdr );
         rtp_set_type( p_rtp_hdr, RTP_TYPE_TS );
         rtp_set_seqnum( p_rtp_hdr, p_output->i_seqnum++ );
         /* New timestamp based only on local time when sent */
         /* 90 kHz clock = 90000 counts per second */
-        rtp_set_timestamp( p_rtp_hdr, i_wallclock * 9 / 100);
+        rtp_set_timestamp( p_rtp_hdr,
+                           *output_Sched( p_output )->pi_wallclock * 9 / 100 );
         rtp_set_ssrc( p_rtp_hdr, p_output->config.pi_ssrc );
 
         i_iov++;
@@ -418,25 +858,29 @@ static void output_Flush( output_t *p_output )
 
     for ( i_block = 0; i_block < p_packet->i_depth; i_block++ )
     {
-        /* Do pid mapping here if needed.
-         * save the original pid in the block.
-         * set the pid to the new pid
-         * later we re-instate the old pid for the next output
-         */
-        if ( b_do_remap || p_output->config.b_do_remap ) {
-            block_t *p_block = p_packet->pp_blocks[i_block];
-            uint16_t i_pid = ts_get_pid( p_block->p_ts );
-            p_block->tmp_pid = UNUSED_PID;
-            if ( p_output->pi_newpids[i_pid] != UNUSED_PID )
+        uint8_t *p_ts = p_packet->pp_blocks[i_block]->p_ts;
+
+        /* Do pid mapping here if needed. The block may be shared with
+         * other outputs, so the remapped header is a copy, sent in its
+         * own iovec entry before the rest of the packet. */
+        if ( b_do_remap || p_output->config.b_do_remap )
+        {
+            uint16_t i_newpid = output_MapPID( p_output, ts_get_pid( p_ts ) );
+            if ( i_newpid != UNUSED_PID )
             {
-                uint16_t i_newpid = p_output->pi_newpids[i_pid];
-                /* Need to map this pid to the new pid */
-                ts_set_pid( p_block->p_ts, i_newpid );
-                p_block->tmp_pid = i_pid;
+                memcpy( p_ts_hdrs[i_block], p_ts, TS_HEADER_SIZE );
+                ts_set_pid( p_ts_hdrs[i_block], i_newpid );
+                p_iov[i_iov].iov_base = p_ts_hdrs[i_block];
+                p_iov[i_iov].iov_len = TS_HEADER_SIZE;
+                i_iov++;
+                p_iov[i_iov].iov_base = p_ts + TS_HEADER_SIZE;
+                p_iov[i_iov].iov_len = TS_SIZE - TS_HEADER_SIZE;
+                i_iov++;
+                continue;
             }
         }
 
-        p_iov[i_iov].iov_base = p_packet->pp_blocks[i_block]->p_ts;
+        p_iov[i_iov].iov_base = p_ts;
         p_iov[i_iov].iov_len = TS_SIZE;
         i_iov++;
     }
@@ -458,26 +902,19 @@ static void output_Flush( output_t *p_output )
         p_output->raw_pkt_header.udph.len = htons(sizeof(struct udpheader) + i_payload_len);
     }
 
-    if ( writev( p_output->i_handle, p_iov, i_iov ) < 0 )
-    {
-        msg_Err( NULL, "couldn't writev to %s (%s)",
-                 p_output->config.psz_displayname, strerror(errno) );
-    }
-    /* Update the wallclock because writev() can take some time. */
-    i_wallclock = mdate();
+    return i_iov;
+}
+
+/*****************************************************************************
+ * output_Release : drops the first packet of the output once it is sent
+ *****************************************************************************/
+static void output_Release( output_t *p_output )
+{
+    packet_t *p_packet = p_output->p_packets;
+    int i_block;
 
     for ( i_block = 0; i_block < p_packet->i_depth; i_block++ )
-    {
-        p_packet->pp_blocks[i_block]->i_refcount--;
-        if ( !p_packet->pp_blocks[i_block]->i_refcount )
-            block_Delete( p_packet->pp_blocks[i_block] );
-        else if ( b_do_remap || p_output->config.b_do_remap ) {
-            /* still referenced so re-instate the orignial pid if remapped */
-            block_t * p_block = p_packet->pp_blocks[i_block];
-            if (p_block->tmp_pid != UNUSED_PID)
-                ts_set_pid( p_block->p_ts, p_block->tmp_pid );
-        }
-    }
+        block_Release( p_packet->pp_blocks[i_block] );
     p_output->p_packets = p_packet->p_next;
     output_PacketDelete( p_output, p_packet );
     if ( p_output->p_packets == NULL )
@@ -485,14 +922,76 @@ static void output_Flush( output_t *p_output )
 }
 
 /*****************************************************************************
- * output_Put : called from demux
+ * output_Flush : sends the packets due at i_date, with a single sendmmsg()
+ * when available
  *****************************************************************************/
-void output_Put( output_t *p_output, block_t *p_block )
+static void output_Flush( output_t *p_output, mtime_t i_date )
 {
+    packet_t *p_packet = p_output->p_packets;
     int i_block_cnt = output_BlockCount( p_output );
-    packet_t *p_packet;
+    struct iovec p_iov[OUTPUT_BATCH][2 * i_block_cnt + 2];
+    uint8_t p_rtp_hdrs[OUTPUT_BATCH][RTP_HEADER_SIZE];
+    uint8_t p_ts_hdrs[OUTPUT_BATCH][i_block_cnt][TS_HEADER_SIZE];
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr p_msgs[OUTPUT_BATCH];
+    int i_sent = 0;
+#endif
+    int i_nb_packets = 0;
 
-    p_block->i_refcount++;
+    while ( p_packet != NULL && i_nb_packets < OUTPUT_BATCH
+             && p_packet->i_dts + p_output->config.i_output_latency <= i_date )
+    {
+        int i_iov = output_Prepare( p_output, p_packet, i_block_cnt,
+                                    p_iov[i_nb_packets],
+                                    p_rtp_hdrs[i_nb_packets],
+                                    p_ts_hdrs[i_nb_packets] );
+#ifdef HAVE_SENDMMSG
+        memset( &p_msgs[i_nb_packets], 0, sizeof(struct mmsghdr) );
+        p_msgs[i_nb_packets].msg_hdr.msg_iov = p_iov[i_nb_packets];
+        p_msgs[i_nb_packets].msg_hdr.msg_iovlen = i_iov;
+#else
+        if ( writev( p_output->i_handle, p_iov[i_nb_packets], i_iov ) < 0 )
+        {
+            msg_Err( NULL, "couldn't writev to %s (%s)",
+                     p_output->config.psz_displayname, strerror(errno) );
+        }
+#endif
+        i_nb_packets++;
+        p_packet = p_packet->p_next;
+    }
+
+#ifdef HAVE_SENDMMSG
+    while ( i_sent < i_nb_packets )
+    {
+        int i_ret = sendmmsg( p_output->i_handle, p_msgs + i_sent,
+                              i_nb_packets - i_sent, 0 );
+        if ( i_ret < 0 )
+        {
+            /* Only the first datagram failed, go on with the others. */
+            msg_Err( NULL, "couldn't sendmmsg to %s (%s)",
+                     p_output->config.psz_displayname, strerror(errno) );
+            i_sent++;
+            continue;
+        }
+        i_sent += i_ret;
+    }
+#endif
+
+    /* Update the wallclock because sending can take some time. */
+    *output_Sched( p_output )->pi_wallclock = mdate();
+
+    while ( i_nb_packets-- )
+        output_Release( p_output );
+}
+
+/*****************************************************************************
+ * output_Queue : appends the block to the packets of the output (from the
+ * thread running the output)
+ *****************************************************************************/
+static void output_Queue( output_t *p_output, block_t *p_block )
+{
+    int i_block_cnt = output_BlockCount( p_output );
+    packet_t *p_packet;
 
     if ( p_output->p_last_packet != NULL
           && p_output->p_last_packet->i_depth < i_block_cnt
@@ -519,13 +1018,26 @@ void output_Put( output_t *p_output, block_t *p_block )
     p_packet->pp_blocks[p_packet->i_depth] = p_block;
     p_packet->i_depth++;
 
-    if (i_next_send > p_packet->i_dts + p_output->config.i_output_latency)
+    /* Only the first packet of the output matters to the send queue. */
+    if ( p_packet != p_output->p_packets )
+        return;
+    output_Schedule( p_output );
+    outputs_Arm( output_Sched( p_output ) );
+}
+
+/*****************************************************************************
+ * output_Put : called from demux
+ *****************************************************************************/
+void output_Put( output_t *p_output, block_t *p_block )
+{
+    if ( p_output->p_worker != NULL )
     {
-        i_next_send = p_packet->i_dts + p_output->config.i_output_latency;
-        ev_timer_stop(event_loop, &output_watcher);
-        ev_timer_set(&output_watcher, (i_next_send - i_wallclock) / 1000000., 0);
-        ev_timer_start(event_loop, &output_watcher);
+        output_WorkerPut( p_output->p_worker, p_output, p_block );
+        return;
     }
+
+    block_Ref( p_block );
+    output_Queue( p_output, p_block );
 }
 
 /*****************************************************************************
@@ -533,58 +1045,140 @@ void output_Put( output_t *p_output, block_t *p_block )
  *****************************************************************************/
 static void outputs_Send(struct ev_loop *loop, struct ev_timer *w, int revents)
 {
-    i_wallclock = mdate();
+    output_sched_t *p_sched = w->data;
+    output_worker_t *p_worker = p_current_worker;
+
+    if ( p_worker != NULL )
+        pthread_mutex_lock( &p_worker->lock );
 
-    do
+    *p_sched->pi_wallclock = mdate();
+
+    /* output_Flush() updates the wallclock, since sending takes time. */
+    while ( p_sched->i_heap_size
+             && p_sched->pp_heap[0]->i_send_date <= *p_sched->pi_wallclock )
     {
-        int i;
-        i_next_send = INT64_MAX;
+        output_t *p_output = p_sched->pp_heap[0];
+
+        output_Flush( p_output, *p_sched->pi_wallclock );
+        output_Schedule( p_output );
+    }
 
-        if ( output_dup.config.i_config & OUTPUT_VALID )
+    p_sched->i_next_send = p_sched->i_heap_size ?
+                           p_sched->pp_heap[0]->i_send_date : INT64_MAX;
+    if (p_sched->i_next_send < INT64_MAX)
+    {
+        ev_timer_set(&p_sched->watcher,
+                     (p_sched->i_next_send - *p_sched->pi_wallclock) / 1000000.,
+                     0);
+        ev_timer_start(loop, &p_sched->watcher);
+    }
+
+    if ( p_worker != NULL )
+        pthread_mutex_unlock( &p_worker->lock );
+}
+
+/*****************************************************************************
+ * output_SchedInit
+ *****************************************************************************/
+static void output_SchedInit( output_sched_t *p_sched, struct ev_loop *p_loop,
+                              mtime_t *pi_wallclock )
+{
+    memset( p_sched, 0, sizeof(output_sched_t) );
+    p_sched->p_loop = p_loop;
+    p_sched->i_next_send = INT64_MAX;
+    p_sched->pi_wallclock = pi_wallclock;
+    ev_timer_init(&p_sched->watcher, outputs_Send, 0, 0);
+    p_sched->watcher.data = p_sched;
+}
+
+/*****************************************************************************
+ * output_FeedInit
+ *****************************************************************************/
+static void output_FeedInit( output_feed_t *p_feed )
+{
+    unsigned int i;
+
+    ring_Init( &p_feed->queue, WORKER_BATCHES );
+    ring_Init( &p_feed->free_ring, WORKER_BATCHES );
+    p_feed->p_batches = calloc( WORKER_BATCHES, sizeof(output_batch_t) );
+    for ( i = 0; i < WORKER_BATCHES; i++ )
+        ring_Push( &p_feed->free_ring, &p_feed->p_batches[i] );
+}
+
+/*****************************************************************************
+ * outputs_Init : must be called before any output is created
+ *****************************************************************************/
+void outputs_Init( void )
+{
+    int i;
+
+    output_SchedInit( &main_sched, event_loop, &i_wallclock );
+    i_nb_producers = 1 + i_demux_shards;
+
+    if ( i_output_workers && b_do_remap )
+    {
+        msg_Warn( NULL, "PID remapping is enabled, sending from the main thread" );
+        return;
+    }
+
+    p_workers = calloc( i_output_workers, sizeof(output_worker_t) );
+    for ( i = 0; i < i_output_workers; i++ )
+    {
+        output_worker_t *p_worker = &p_workers[i];
+        struct ev_loop *p_loop = ev_loop_new( EVFLAG_AUTO );
+        int i_error, j;
+
+        if ( p_loop == NULL )
         {
-            while ( output_dup.p_packets != NULL
-                     && output_dup.p_packets->i_dts
-                         + output_dup.config.i_output_latency <= i_wallclock )
-                output_Flush( &output_dup );
-
-            if ( output_dup.p_packets != NULL )
-                i_next_send = output_dup.p_packets->i_dts
-                                + output_dup.config.i_output_latency;
+            msg_Err( NULL, "unable to initialize libev for output worker %d",
+                     i );
+            exit(EXIT_FAILURE);
         }
+        output_SchedInit( &p_worker->sched, p_loop, &p_worker->i_wallclock );
+        p_worker->i_wallclock = mdate();
+        pthread_mutex_init( &p_worker->lock, NULL );
 
-        for ( i = 0; i < i_nb_outputs; i++ )
-        {
-            output_t *p_output = pp_outputs[i];
-            if ( !( p_output->config.i_config & OUTPUT_VALID ) )
-                continue;
+        p_worker->p_feeds = calloc( i_nb_producers, sizeof(output_feed_t) );
+        for ( j = 0; j < i_nb_producers; j++ )
+            output_FeedInit( &p_worker->p_feeds[j] );
 
-            while ( p_output->p_packets != NULL
-                     && p_output->p_packets->i_dts
-                         + p_output->config.i_output_latency <= i_wallclock )
-                output_Flush( p_output );
+        ev_async_init( &p_worker->wakeup_watcher, output_WorkerWakeup );
+        p_worker->wakeup_watcher.data = p_worker;
+        ev_async_start( p_loop, &p_worker->wakeup_watcher );
 
-            if ( p_output->p_packets != NULL
-                  && (p_output->p_packets->i_dts
-                       + p_output->config.i_output_latency < i_next_send) )
-                i_next_send = p_output->p_packets->i_dts
-                                  + p_output->config.i_output_latency;
+        if ( (i_error = pthread_create( &p_worker->thread, NULL,
+                                        output_WorkerThread, p_worker )) )
+        {
+            msg_Err( NULL, "couldn't create output worker (%s)",
+                     strerror(i_error) );
+            exit(EXIT_FAILURE);
         }
+        i_nb_workers++;
     }
-    while (i_next_send <= i_wallclock);
 
-    if (i_next_send < INT64_MAX)
+    if ( i_nb_workers )
     {
-        ev_timer_set(&output_watcher, (i_next_send - i_wallclock) / 1000000., 0);
-        ev_timer_start(loop, &output_watcher);
+        msg_Dbg( NULL, "sending from %d output workers", i_nb_workers );
+        if ( i_print_period )
+        {
+            ev_timer_init( &print_watcher, outputs_PrintCb,
+                           i_print_period / 1000000.,
+                           i_print_period / 1000000. );
+            ev_timer_start( event_loop, &print_watcher );
+        }
     }
 }
 
 /*****************************************************************************
- * outputs_Init :
+ * outputs_Run : sends the packets which are due without waiting for the
+ * timer, and returns the date of the next one (INT64_MAX if none); output
+ * workers are not run
  *****************************************************************************/
-void outputs_Init( void )
+mtime_t outputs_Run( void )
 {
-    ev_timer_init(&output_watcher, outputs_Send, 0, 0);
+    ev_timer_stop(event_loop, &main_sched.watcher);
+    outputs_Send(event_loop, &main_sched.watcher, 0);
+    return main_sched.i_next_send;
 }
 
 /*****************************************************************************
@@ -629,10 +1223,22 @@ output_t *output_Find( const output_config_t *p_config )
  *****************************************************************************/
 void output_Change( output_t *p_output, const output_config_t *p_config )
 {
+    output_worker_t *p_worker;
     int ret = 0;
+
+    if ( p_output->p_worker != NULL && p_config->b_do_remap )
+        output_Detach( p_output );
+
+    p_worker = p_output->p_worker;
+    if ( p_worker != NULL )
+        pthread_mutex_lock( &p_worker->lock );
+
     memcpy( p_output->config.pi_ssrc, p_config->pi_ssrc, 4 * sizeof(uint8_t) );
     p_output->config.i_output_latency = p_config->i_output_latency;
     p_output->config.i_max_retention = p_config->i_max_retention;
+    output_Schedule( p_output );
+    if ( p_worker == NULL )
+        outputs_Arm( &main_sched );
 
     if ( p_output->config.i_ttl != p_config->i_ttl )
     {
@@ -695,6 +1301,13 @@ void output_Change( output_t *p_output, const output_config_t *p_config )
         p_output->raw_pkt_header.iph.saddr = inet_addr(p_config->psz_srcaddr);
         p_output->raw_pkt_header.udph.source = htons(p_config->i_srcport);
     }
+
+    if ( p_worker != NULL )
+    {
+        pthread_mutex_unlock( &p_worker->lock );
+        /* The worker re-arms its timer on wakeup. */
+        ev_async_send( p_worker->sched.p_loop, &p_worker->wakeup_watcher );
+    }
 }
 
 /*****************************************************************************
@@ -702,7 +1315,19 @@ void output_Change( output_t *p_output, const output_config_t *p_config )
  *****************************************************************************/
 void outputs_Close( int i_num_outputs )
 {
-    int i;
+    int i, j;
+
+    /* Let the workers send what they were handed, then stop them. */
+    for ( i = 0; i < i_nb_workers; i++ )
+    {
+        output_worker_t *p_worker = &p_workers[i];
+
+        output_WorkerCommit( p_worker );
+        __atomic_store_n( &p_worker->b_die, 1, __ATOMIC_RELEASE );
+        ev_async_send( p_worker->sched.p_loop, &p_worker->wakeup_watcher );
+        pthread_join( p_worker->thread, NULL );
+        block_Collect( &p_worker->p_garbage );
+    }
 
     for ( i = 0; i < i_num_outputs; i++ )
     {
@@ -712,8 +1337,8 @@ void outputs_Close( int i_num_outputs )
         {
             msg_Dbg( NULL, "removing %s", p_output->config.psz_displayname );
 
-            if ( p_output->p_packets )
-                output_Flush( p_output );
+            while ( p_output->p_packets != NULL )
+                output_Flush( p_output, INT64_MAX );
             output_Close( p_output );
         }
 
@@ -721,4 +1346,30 @@ void outputs_Close( int i_num_outputs )
     }
 
     free( pp_outputs );
+
+    for ( i = 0; i < i_nb_workers; i++ )
+    {
+        output_worker_t *p_worker = &p_workers[i];
+
+        ev_loop_destroy( p_worker->sched.p_loop );
+        pthread_mutex_destroy( &p_worker->lock );
+        for ( j = 0; j < i_nb_producers; j++ )
+        {
+            ring_Clean( &p_worker->p_feeds[j].queue );
+            ring_Clean( &p_worker->p_feeds[j].free_ring );
+            free( p_worker->p_feeds[j].p_batches );
+        }
+        free( p_worker->p_feeds );
+        free( p_worker->sched.pp_heap );
+    }
+    if ( i_nb_workers && i_print_period )
+        ev_timer_stop( event_loop, &print_watcher );
+    free( p_workers );
+    p_workers = NULL;
+    i_nb_workers = 0;
+
+    ev_timer_stop( event_loop, &main_sched.watcher );
+    free( main_sched.pp_heap );
+    main_sched.pp_heap = NULL;
+    main_sched.i_heap_size = main_sched.i_heap_alloc = 0;
 }
@@ -0,0 +1,79 @@
+/*****************************************************************************
+ * pidlist.h: sorted lists of PIDs
+ *****************************************************************************
+ * Copyright (C) 2016 VideoLAN
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef DVBLAST_PIDLIST_H
+#define DVBLAST_PIDLIST_H
+
+/*
+ * A PID list is an array of PIDs kept in ascending order, without
+ * duplicates. The lists are short (the PIDs of a PMT), so the insertion
+ * is a plain memmove().
+ */
+
+/* Set in the entries of a diff for the PIDs added by the new list */
+#define PIDLIST_ADDED 0x8000
+
+/*****************************************************************************
+ * pidlist_Add : inserts a PID in the list, unless it is already there
+ *****************************************************************************/
+static inline void pidlist_Add( uint16_t *pi_pids, int *pi_nb_pids,
+                                uint16_t i_pid )
+{
+    int i = *pi_nb_pids;
+
+    while ( i > 0 && pi_pids[i - 1] > i_pid )
+        i--;
+    if ( i > 0 && pi_pids[i - 1] == i_pid )
+        return;
+
+    memmove( &pi_pids[i + 1], &pi_pids[i],
+             (*pi_nb_pids - i) * sizeof(uint16_t) );
+    pi_pids[i] = i_pid;
+    (*pi_nb_pids)++;
+}
+
+/*****************************************************************************
+ * pidlist_Diff : merges two lists, and returns in ascending PID order the
+ * PIDs only in the old list and the PIDs only in the new list, the latter
+ * with PIDLIST_ADDED set; pi_diff must hold i_nb_old + i_nb_new entries
+ *****************************************************************************/
+static inline int pidlist_Diff( const uint16_t *pi_old, int i_nb_old,
+                                const uint16_t *pi_new, int i_nb_new,
+                                uint16_t *pi_diff )
+{
+    int i = 0, j = 0, i_nb_diff = 0;
+
+    while ( i < i_nb_old || j < i_nb_new )
+    {
+        if ( j == i_nb_new || (i < i_nb_old && pi_old[i] < pi_new[j]) )
+            pi_diff[i_nb_diff++] = pi_old[i++];
+        else if ( i == i_nb_old || pi_new[j] < pi_old[i] )
+            pi_diff[i_nb_diff++] = pi_new[j++] | PIDLIST_ADDED;
+        else
+        {
+            i++;
+            j++;
+        }
+    }
+
+    return i_nb_diff;
+}
+
+#endif
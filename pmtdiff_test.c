@@ -0,0 +1,183 @@
+/*****************************************************************************
+ * pmtdiff_test.c: checks the PMT diff against a sweep of all the PIDs
+ *****************************************************************************
+ * Copyright (C) 2016 VideoLAN
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*
+ * HandlePMT() selects and unselects the PIDs of a changed PMT by merging
+ * the sorted PID lists of the old and the new PMT (pidlist.h). This used
+ * to be done by marking a byte map of all the PIDs and sweeping it. The
+ * test draws random old and new PID sets, shaped like the ones of a PMT
+ * (few PIDs, duplicates, PIDs shared by both), and checks that both
+ * methods call SelectPID() and UnselectPID() with the same arguments, in
+ * the same order.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "pidlist.h"
+
+#define MAX_PIDS    8192
+#define MAX_ES      256
+#define NB_CASES    100000
+
+typedef struct pmt_op_t
+{
+    bool b_select;
+    uint16_t i_pid;
+    bool b_pcr;
+} pmt_op_t;
+
+/*****************************************************************************
+ * RandomPIDs: draws the PIDs of a PMT, in the order they are found in it
+ *****************************************************************************/
+static int RandomPIDs( uint16_t *pi_pids, uint16_t i_base )
+{
+    int i_nb_pids = rand() % MAX_ES, i;
+
+    for ( i = 0; i < i_nb_pids; i++ )
+    {
+        /* Mostly around a base PID, so that the old and new PMT overlap,
+         * and some duplicates as an ECM PID may be listed several times */
+        if ( rand() % 4 )
+            pi_pids[i] = (i_base + rand() % (2 * MAX_ES)) % MAX_PIDS;
+        else
+            pi_pids[i] = rand() % MAX_PIDS;
+    }
+    return i_nb_pids;
+}
+
+/*****************************************************************************
+ * Sweep: the former algorithm
+ *****************************************************************************/
+static int Sweep( const uint16_t *pi_old, int i_nb_old,
+                  const uint16_t *pi_new, int i_nb_new, uint16_t i_pcr_pid,
+                  pmt_op_t *p_ops )
+{
+    uint8_t pid_map[MAX_PIDS];
+    int i, i_nb_ops = 0;
+
+    memset( pid_map, 0, sizeof(pid_map) );
+    for ( i = 0; i < i_nb_old; i++ )
+        pid_map[pi_old[i]] |= 0x02;
+    for ( i = 0; i < i_nb_new; i++ )
+        pid_map[pi_new[i]] |= 0x01;
+
+    for ( i = 0; i < MAX_PIDS; i++ )
+    {
+        switch ( pid_map[i] & 0x03 )
+        {
+        case 0x02:
+            p_ops[i_nb_ops].b_select = false;
+            p_ops[i_nb_ops].i_pid = i;
+            p_ops[i_nb_ops++].b_pcr = false;
+            break;
+        case 0x01:
+            p_ops[i_nb_ops].b_select = true;
+            p_ops[i_nb_ops].i_pid = i;
+            p_ops[i_nb_ops++].b_pcr = i == i_pcr_pid;
+            break;
+        default:
+            break;
+        }
+    }
+    return i_nb_ops;
+}
+
+/*****************************************************************************
+ * Merge: the algorithm of HandlePMT()
+ *****************************************************************************/
+static int Merge( const uint16_t *pi_old, int i_nb_old,
+                  const uint16_t *pi_new, int i_nb_new, uint16_t i_pcr_pid,
+                  pmt_op_t *p_ops )
+{
+    uint16_t pi_old_pids[MAX_ES], pi_new_pids[MAX_ES];
+    uint16_t pi_diff[2 * MAX_ES];
+    int i_nb_old_pids = 0, i_nb_new_pids = 0, i_nb_diff, i;
+
+    for ( i = 0; i < i_nb_old; i++ )
+        pidlist_Add( pi_old_pids, &i_nb_old_pids, pi_old[i] );
+    for ( i = 0; i < i_nb_new; i++ )
+        pidlist_Add( pi_new_pids, &i_nb_new_pids, pi_new[i] );
+
+    i_nb_diff = pidlist_Diff( pi_old_pids, i_nb_old_pids,
+                              pi_new_pids, i_nb_new_pids, pi_diff );
+    for ( i = 0; i < i_nb_diff; i++ )
+    {
+        uint16_t i_pid = pi_diff[i] & ~PIDLIST_ADDED;
+
+        p_ops[i].b_select = !!(pi_diff[i] & PIDLIST_ADDED);
+        p_ops[i].i_pid = i_pid;
+        p_ops[i].b_pcr = p_ops[i].b_select && i_pid == i_pcr_pid;
+    }
+    return i_nb_diff;
+}
+
+int main( int i_argc, char **pp_argv )
+{
+    uint16_t pi_old[MAX_ES], pi_new[MAX_ES];
+    pmt_op_t p_sweep[2 * MAX_ES], p_merge[2 * MAX_ES];
+    unsigned int i_seed = i_argc > 1 ? strtoul( pp_argv[1], NULL, 0 ) : 1;
+    int i_case, i;
+
+    srand( i_seed );
+
+    for ( i_case = 0; i_case < NB_CASES; i_case++ )
+    {
+        uint16_t i_base = rand() % MAX_PIDS;
+        int i_nb_old = RandomPIDs( pi_old, i_base );
+        int i_nb_new = RandomPIDs( pi_new, i_base );
+        /* The PCR PID of the new PMT is usually one of its PIDs */
+        uint16_t i_pcr_pid = i_nb_new && rand() % 8 ?
+                             pi_new[rand() % i_nb_new] : rand() % MAX_PIDS;
+        int i_nb_sweep = Sweep( pi_old, i_nb_old, pi_new, i_nb_new,
+                                i_pcr_pid, p_sweep );
+        int i_nb_merge = Merge( pi_old, i_nb_old, pi_new, i_nb_new,
+                                i_pcr_pid, p_merge );
+
+        if ( i_nb_sweep != i_nb_merge )
+        {
+            fprintf( stderr, "case %d (seed %u): %d operations instead of %d\n",
+                     i_case, i_seed, i_nb_merge, i_nb_sweep );
+            return EXIT_FAILURE;
+        }
+
+        for ( i = 0; i < i_nb_sweep; i++ )
+        {
+            if ( p_sweep[i].b_select != p_merge[i].b_select
+                  || p_sweep[i].i_pid != p_merge[i].i_pid
+                  || p_sweep[i].b_pcr != p_merge[i].b_pcr )
+            {
+                fprintf( stderr, "case %d (seed %u), operation %d: %s %hu%s instead of %s %hu%s\n",
+                         i_case, i_seed, i,
+                         p_merge[i].b_select ? "select" : "unselect",
+                         p_merge[i].i_pid, p_merge[i].b_pcr ? " (PCR)" : "",
+                         p_sweep[i].b_select ? "select" : "unselect",
+                         p_sweep[i].i_pid, p_sweep[i].b_pcr ? " (PCR)" : "" );
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    printf( "pmtdiff: %d cases ok (seed %u)\n", NB_CASES, i_seed );
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+/*****************************************************************************
+ * ring.h: lock-free single-producer/single-consumer ring
+ *****************************************************************************
+ * Copyright (C) 2016 VideoLAN
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef DVBLAST_RING_H
+#define DVBLAST_RING_H
+
+/*
+ * Exactly one thread may call ring_Push() and exactly one thread may call
+ * ring_Pop() on a given ring. The head and tail live on separate cache
+ * lines so that the producer and the consumer do not bounce them.
+ */
+typedef struct ring_t
+{
+    void **pp_items;
+    unsigned int i_mask;
+
+    /* written by the producer only */
+    unsigned int i_head __attribute__((aligned(64)));
+    /* written by the consumer only */
+    unsigned int i_tail __attribute__((aligned(64)));
+} ring_t;
+
+/*****************************************************************************
+ * ring_Init: i_size is rounded up to a power of two
+ *****************************************************************************/
+static inline unsigned int ring_Init( ring_t *p_ring, unsigned int i_size )
+{
+    unsigned int i_real_size = 1;
+
+    while ( i_real_size < i_size )
+        i_real_size <<= 1;
+
+    p_ring->pp_items = malloc( i_real_size * sizeof(void *) );
+    p_ring->i_mask = i_real_size - 1;
+    p_ring->i_head = p_ring->i_tail = 0;
+    return i_real_size;
+}
+
+/*****************************************************************************
+ * ring_Clean
+ *****************************************************************************/
+static inline void ring_Clean( ring_t *p_ring )
+{
+    free( p_ring->pp_items );
+    p_ring->pp_items = NULL;
+}
+
+/*****************************************************************************
+ * ring_Push: returns false if the ring is full
+ *****************************************************************************/
+static inline bool ring_Push( ring_t *p_ring, void *p_item )
+{
+    unsigned int i_head = p_ring->i_head;
+
+    if ( i_head - __atomic_load_n( &p_ring->i_tail, __ATOMIC_ACQUIRE )
+          > p_ring->i_mask )
+        return false;
+
+    p_ring->pp_items[i_head & p_ring->i_mask] = p_item;
+    __atomic_store_n( &p_ring->i_head, i_head + 1, __ATOMIC_RELEASE );
+    return true;
+}
+
+/*****************************************************************************
+ * ring_Pop: returns NULL if the ring is empty
+ *****************************************************************************/
+static inline void *ring_Pop( ring_t *p_ring )
+{
+    unsigned int i_tail = p_ring->i_tail;
+    void *p_item;
+
+    if ( i_tail == __atomic_load_n( &p_ring->i_head, __ATOMIC_ACQUIRE ) )
+        return NULL;
+
+    p_item = p_ring->pp_items[i_tail & p_ring->i_mask];
+    __atomic_store_n( &p_ring->i_tail, i_tail + 1, __ATOMIC_RELEASE );
+    return p_item;
+}
+
+/*****************************************************************************
+ * ring_Count: approximate occupancy, may be called from either side
+ *****************************************************************************/
+static inline unsigned int ring_Count( ring_t *p_ring )
+{
+    return __atomic_load_n( &p_ring->i_head, __ATOMIC_ACQUIRE )
+            - __atomic_load_n( &p_ring->i_tail, __ATOMIC_ACQUIRE );
+}
+
+#endif
@@ -20,10 +20,12 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
  *****************************************************************************/
 
+#define _GNU_SOURCE /* recvmmsg() */
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <string.h>
 #include <sys/types.h>
@@ -50,6 +52,7 @@
  *****************************************************************************/
 #define UDP_LOCK_TIMEOUT 5000000 /* 5 s */
 #define PRINT_REFRACTORY_PERIOD 1000000 /* 1 s */
+#define MAX_BATCH 1024 /* UIO_MAXIOV */
 
 static int i_handle;
 static struct ev_io udp_watcher;
@@ -62,11 +65,29 @@ static bool b_sync = false;
 static mtime_t i_last_print = 0;
 static struct sockaddr_storage last_addr;
 
+/* Batched reception */
+static int i_batch = 1;
+static uint64_t i_nb_batches = 0, i_nb_datagrams = 0;
+static struct ev_timer print_watcher;
+#ifdef HAVE_RECVMMSG
+static struct mmsghdr *p_batch_msgs;
+static struct iovec *p_batch_iov;
+static struct sockaddr_storage *p_batch_addrs;
+static uint8_t (*pp_batch_rtp_hdrs)[RTP_HEADER_SIZE];
+static block_t **pp_batch_blocks;
+#endif
+
 /*****************************************************************************
  * Local prototypes
  *****************************************************************************/
 static void udp_Read(struct ev_loop *loop, struct ev_io *w, int revents);
+static block_t *udp_Handle( block_t *p_ts, ssize_t i_len,
+                            const uint8_t *p_rtp_hdr );
+#ifdef HAVE_RECVMMSG
+static void udp_ReadBatch(struct ev_loop *loop, struct ev_io *w, int revents);
+#endif
 static void udp_MuteCb(struct ev_loop *loop, struct ev_timer *w, int revents);
+static void udp_PrintCb(struct ev_loop *loop, struct ev_timer *w, int revents);
 
 /*****************************************************************************
  * udp_Open
@@ -133,7 +154,10 @@ void udp_Open( void )
             if (strlen(psz_ifname) >= IFNAMSIZ) {
                 psz_ifname[IFNAMSIZ-1] = '\0';
             }
-        } else
+        }
+        else if ( IS_OPTION("batch=") )
+            i_batch = strtol( ARG_OPTION("batch="), NULL, 0 );
+        else
             msg_Warn( NULL, "unrecognized option %s", psz_string );
 
 #undef IS_OPTION
@@ -144,6 +168,22 @@ void udp_Open( void )
         i_mtu = i_family == AF_INET6 ? DEFAULT_IPV6_MTU : DEFAULT_IPV4_MTU;
     i_block_cnt = (i_mtu - (b_udp ? 0 : RTP_HEADER_SIZE)) / TS_SIZE;
 
+    if ( i_batch < 1 )
+        i_batch = 1;
+    else if ( i_batch > MAX_BATCH )
+        i_batch = MAX_BATCH;
+#ifndef HAVE_RECVMMSG
+    if ( i_batch > 1 )
+    {
+        msg_Warn( NULL, "batched reception is unsupported on this platform" );
+        i_batch = 1;
+    }
+#endif
+    if ( i_batch > 1 && i_input_ring )
+    {
+        msg_Warn( NULL, "batched reception is not used with an input thread" );
+        i_batch = 1;
+    }
 
     /* Do stuff. */
 
@@ -274,8 +314,57 @@ void udp_Open( void )
 
     msg_Dbg( NULL, "binding socket to %s", psz_udp_src );
 
-    ev_io_init(&udp_watcher, udp_Read, i_handle, EV_READ);
-    ev_io_start(event_loop, &udp_watcher);
+    if ( i_input_ring )
+        input_Start( i_handle, i_block_cnt, b_udp ? 0 : RTP_HEADER_SIZE,
+                     udp_Handle );
+#ifdef HAVE_RECVMMSG
+    else if ( i_batch > 1 )
+    {
+        int i_iov_per_msg = i_block_cnt + (b_udp ? 0 : 1);
+        int i_msg, i_iov;
+
+        p_batch_msgs = malloc( i_batch * sizeof(struct mmsghdr) );
+        p_batch_iov = malloc( i_batch * i_iov_per_msg * sizeof(struct iovec) );
+        p_batch_addrs = malloc( i_batch * sizeof(struct sockaddr_storage) );
+        pp_batch_rtp_hdrs = malloc( i_batch * RTP_HEADER_SIZE );
+        pp_batch_blocks = calloc( i_batch * i_block_cnt, sizeof(block_t *) );
+
+        for ( i_msg = 0; i_msg < i_batch; i_msg++ )
+        {
+            struct msghdr *p_mh = &p_batch_msgs[i_msg].msg_hdr;
+            memset( p_mh, 0, sizeof(struct msghdr) );
+            p_mh->msg_name = &p_batch_addrs[i_msg];
+            p_mh->msg_iov = &p_batch_iov[i_msg * i_iov_per_msg];
+            p_mh->msg_iovlen = i_iov_per_msg;
+
+            i_iov = 0;
+            if ( !b_udp )
+            {
+                /* FIXME : this is wrong if RTP header > 12 bytes */
+                p_mh->msg_iov[0].iov_base = pp_batch_rtp_hdrs[i_msg];
+                p_mh->msg_iov[0].iov_len = RTP_HEADER_SIZE;
+                i_iov = 1;
+            }
+            for ( ; i_iov < i_iov_per_msg; i_iov++ )
+                p_mh->msg_iov[i_iov].iov_len = TS_SIZE;
+        }
+
+        msg_Dbg( NULL, "receiving up to %d datagrams per wakeup", i_batch );
+        ev_io_init(&udp_watcher, udp_ReadBatch, i_handle, EV_READ);
+
+        if ( i_print_period )
+        {
+            ev_timer_init( &print_watcher, udp_PrintCb,
+                           i_print_period / 1000000.,
+                           i_print_period / 1000000. );
+            ev_timer_start( event_loop, &print_watcher );
+        }
+    }
+#endif
+    else
+        ev_io_init(&udp_watcher, udp_Read, i_handle, EV_READ);
+    if ( !i_input_ring )
+        ev_io_start(event_loop, &udp_watcher);
 
     ev_timer_init(&mute_watcher, udp_MuteCb,
                   UDP_LOCK_TIMEOUT / 1000000., UDP_LOCK_TIMEOUT / 1000000.);
@@ -283,51 +372,106 @@ void udp_Open( void )
 }
 
 /*****************************************************************************
- * UDP events
+ * udp_PrintSource: print the address of the sender when it changes
  *****************************************************************************/
-static void udp_Read(struct ev_loop *loop, struct ev_io *w, int revents)
+static void udp_PrintSource( const struct sockaddr_storage *p_addr,
+                             socklen_t i_addrlen )
 {
-    i_wallclock = mdate();
-    if ( i_last_print + PRINT_REFRACTORY_PERIOD < i_wallclock )
+    char psz_addr[256], psz_port[42];
+
+    if ( i_addrlen < sizeof(struct sockaddr) )
+        return;
+
+    if ( memcmp( p_addr, &last_addr, i_addrlen ) &&
+         getnameinfo( (const struct sockaddr *)p_addr, i_addrlen,
+             psz_addr, sizeof(psz_addr), psz_port, sizeof(psz_port),
+             NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV ) == 0 )
     {
-        i_last_print = i_wallclock;
+        memcpy( &last_addr, p_addr, i_addrlen );
+
+        msg_Info( NULL, "source: %s:%s", psz_addr, psz_port );
+        switch (i_print_type) {
+        case PRINT_XML:
+            fprintf(print_fh, "<STATUS type=\"source\" address=\"%s\" port=\"%s\"/>\n", psz_addr, psz_port);
+            break;
+        case PRINT_TEXT:
+            fprintf(print_fh, "source status: %s:%s\n", psz_addr, psz_port);
+            break;
+        default:
+            break;
+        }
+    }
+}
 
-        struct sockaddr_storage addr;
-        struct msghdr mh = {
-            .msg_name = &addr,
-            .msg_namelen = sizeof(addr),
-            .msg_iov = NULL,
-            .msg_iovlen = 0,
-            .msg_control = NULL,
-            .msg_controllen = 0,
-            .msg_flags = 0
-        };
-        if ( recvmsg( i_handle, &mh, MSG_DONTWAIT | MSG_PEEK ) != -1 &&
-             mh.msg_namelen >= sizeof(struct sockaddr) )
-        {
-            char psz_addr[256], psz_port[42];
-            if ( memcmp( &addr, &last_addr, mh.msg_namelen ) &&
-                 getnameinfo( (const struct sockaddr *)&addr, mh.msg_namelen,
-                     psz_addr, sizeof(psz_addr), psz_port, sizeof(psz_port),
-                     NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV ) == 0 )
-            {
-                memcpy( &last_addr, &addr, mh.msg_namelen );
-
-                msg_Info( NULL, "source: %s:%s", psz_addr, psz_port );
-                switch (i_print_type) {
-                case PRINT_XML:
-                    fprintf(print_fh, "<STATUS type=\"source\" address=\"%s\" port=\"%s\"/>\n", psz_addr, psz_port);
-                    break;
-                case PRINT_TEXT:
-                    fprintf(print_fh, "source status: %s:%s\n", psz_addr, psz_port);
-                    break;
-                default:
-                    break;
-                }
-            }
+/*****************************************************************************
+ * udp_CheckRTP: validate the RTP header of a datagram
+ *****************************************************************************/
+static void udp_CheckRTP( const uint8_t *p_rtp_hdr )
+{
+    uint8_t pi_new_ssrc[4];
+
+    if ( !rtp_check_hdr(p_rtp_hdr) )
+        msg_Warn( NULL, "invalid RTP packet received" );
+    if ( rtp_get_type(p_rtp_hdr) != RTP_TYPE_TS )
+        msg_Warn( NULL, "non-TS RTP packet received" );
+    rtp_get_ssrc(p_rtp_hdr, pi_new_ssrc);
+    if ( !memcmp( pi_ssrc, pi_new_ssrc, 4 * sizeof(uint8_t) ) )
+    {
+        if ( rtp_get_seqnum(p_rtp_hdr) != i_seqnum )
+            msg_Warn( NULL, "RTP discontinuity" );
+    }
+    else
+    {
+        struct in_addr addr;
+        memcpy( &addr.s_addr, pi_new_ssrc, 4 * sizeof(uint8_t) );
+        msg_Dbg( NULL, "new RTP source: %s", inet_ntoa( addr ) );
+        memcpy( pi_ssrc, pi_new_ssrc, 4 * sizeof(uint8_t) );
+        switch (i_print_type) {
+        case PRINT_XML:
+            fprintf(print_fh,
+                    "<STATUS type=\"rtpsource\" source=\"%s\"/>\n",
+                    inet_ntoa( addr ));
+            break;
+        case PRINT_TEXT:
+            fprintf(print_fh, "rtpsource: %s\n", inet_ntoa( addr ) );
+            break;
+        default:
+            break;
         }
     }
+    i_seqnum = rtp_get_seqnum(p_rtp_hdr) + 1;
+}
 
+/*****************************************************************************
+ * udp_Lock: called whenever TS packets were received
+ *****************************************************************************/
+static void udp_Lock( struct ev_loop *loop )
+{
+    if ( !b_sync )
+    {
+        msg_Info( NULL, "frontend has acquired lock" );
+        switch (i_print_type) {
+        case PRINT_XML:
+            fprintf(print_fh, "<STATUS type=\"lock\" status=\"1\"/>\n");
+            break;
+        case PRINT_TEXT:
+            fprintf(print_fh, "lock status: 1\n");
+            break;
+        default:
+            break;
+        }
+
+        b_sync = true;
+    }
+
+    ev_timer_again(loop, &mute_watcher);
+}
+
+/*****************************************************************************
+ * UDP events
+ *****************************************************************************/
+static void udp_Read(struct ev_loop *loop, struct ev_io *w, int revents)
+{
     struct iovec p_iov[i_block_cnt + 1];
     block_t *p_ts, **pp_current = &p_ts;
     int i_iov, i_block;
@@ -352,9 +496,39 @@ static void udp_Read(struct ev_loop *loop, struct ev_io *w, int revents)
         pp_current = &(*pp_current)->p_next;
         i_iov++;
     }
-    pp_current = &p_ts;
 
-    if ( (i_len = readv( i_handle, p_iov, i_iov )) < 0 )
+    i_len = readv( i_handle, p_iov, i_iov );
+    block_DeleteChain( udp_Handle( p_ts, i_len, p_rtp_hdr ) );
+}
+
+/*****************************************************************************
+ * udp_Handle: passes a datagram to the demux, returns unused blocks
+ *****************************************************************************/
+static block_t *udp_Handle( block_t *p_ts, ssize_t i_len,
+                            const uint8_t *p_rtp_hdr )
+{
+    block_t *p_unused, **pp_current = &p_ts;
+
+    i_wallclock = mdate();
+    if ( i_last_print + PRINT_REFRACTORY_PERIOD < i_wallclock )
+    {
+        i_last_print = i_wallclock;
+
+        struct sockaddr_storage addr;
+        struct msghdr mh = {
+            .msg_name = &addr,
+            .msg_namelen = sizeof(addr),
+            .msg_iov = NULL,
+            .msg_iovlen = 0,
+            .msg_control = NULL,
+            .msg_controllen = 0,
+            .msg_flags = 0
+        };
+        if ( recvmsg( i_handle, &mh, MSG_DONTWAIT | MSG_PEEK ) != -1 )
+            udp_PrintSource( &addr, mh.msg_namelen );
+    }
+
+    if ( i_len < 0 )
     {
         msg_Err( NULL, "couldn't read from network (%s)", strerror(errno) );
         goto err;
@@ -362,78 +536,114 @@ static void udp_Read(struct ev_loop *loop, struct ev_io *w, int revents)
 
     if ( !b_udp )
     {
-        uint8_t pi_new_ssrc[4];
-
-        if ( !rtp_check_hdr(p_rtp_hdr) )
-            msg_Warn( NULL, "invalid RTP packet received" );
-        if ( rtp_get_type(p_rtp_hdr) != RTP_TYPE_TS )
-            msg_Warn( NULL, "non-TS RTP packet received" );
-        rtp_get_ssrc(p_rtp_hdr, pi_new_ssrc);
-        if ( !memcmp( pi_ssrc, pi_new_ssrc, 4 * sizeof(uint8_t) ) )
-        {
-            if ( rtp_get_seqnum(p_rtp_hdr) != i_seqnum )
-                msg_Warn( NULL, "RTP discontinuity" );
-        }
-        else
-        {
-            struct in_addr addr;
-            memcpy( &addr.s_addr, pi_new_ssrc, 4 * sizeof(uint8_t) );
-            msg_Dbg( NULL, "new RTP source: %s", inet_ntoa( addr ) );
-            memcpy( pi_ssrc, pi_new_ssrc, 4 * sizeof(uint8_t) );
-            switch (i_print_type) {
-            case PRINT_XML:
-                fprintf(print_fh,
-                        "<STATUS type=\"rtpsource\" source=\"%s\"/>\n",
-                        inet_ntoa( addr ));
-                break;
-            case PRINT_TEXT:
-                fprintf(print_fh, "rtpsource: %s\n", inet_ntoa( addr ) );
-                break;
-            default:
-                break;
-            }
-        }
-        i_seqnum = rtp_get_seqnum(p_rtp_hdr) + 1;
-
+        udp_CheckRTP( p_rtp_hdr );
         i_len -= RTP_HEADER_SIZE;
     }
 
     i_len /= TS_SIZE;
 
     if ( i_len )
+        udp_Lock( event_loop );
+
+    while ( i_len > 0 && *pp_current )
     {
-        if ( !b_sync )
+        pp_current = &(*pp_current)->p_next;
+        i_len--;
+    }
+
+err:
+    p_unused = *pp_current;
+    *pp_current = NULL;
+
+    demux_Run( p_ts );
+    return p_unused;
+}
+
+#ifdef HAVE_RECVMMSG
+/*****************************************************************************
+ * udp_ReadBatch: receive up to i_batch datagrams with a single syscall
+ *****************************************************************************/
+static void udp_ReadBatch(struct ev_loop *loop, struct ev_io *w, int revents)
+{
+    int i_iov_per_msg = i_block_cnt + (b_udp ? 0 : 1);
+    int i_first_iov = b_udp ? 0 : 1;
+    block_t *p_ts = NULL, **pp_current = &p_ts;
+    int i_msg, i_block, i_nb_msgs;
+
+    /* Refill the slots consumed by the previous batch; blocks which were
+     * not filled by the kernel stay in place for the next call. */
+    for ( i_msg = 0; i_msg < i_batch; i_msg++ )
+    {
+        block_t **pp_blocks = &pp_batch_blocks[i_msg * i_block_cnt];
+        struct iovec *p_iov = &p_batch_iov[i_msg * i_iov_per_msg];
+
+        for ( i_block = 0; i_block < i_block_cnt; i_block++ )
         {
-            msg_Info( NULL, "frontend has acquired lock" );
-            switch (i_print_type) {
-            case PRINT_XML:
-                fprintf(print_fh, "<STATUS type=\"lock\" status=\"1\"/>\n");
-                break;
-            case PRINT_TEXT:
-                fprintf(print_fh, "lock status: 1\n");
-                break;
-            default:
-                break;
+            if ( pp_blocks[i_block] == NULL )
+            {
+                pp_blocks[i_block] = block_New();
+                p_iov[i_first_iov + i_block].iov_base =
+                    pp_blocks[i_block]->p_ts;
             }
-
-            b_sync = true;
         }
+        p_batch_msgs[i_msg].msg_hdr.msg_namelen =
+            sizeof(struct sockaddr_storage);
+    }
 
-        ev_timer_again(loop, &mute_watcher);
+    i_nb_msgs = recvmmsg( i_handle, p_batch_msgs, i_batch, MSG_DONTWAIT,
+                          NULL );
+    if ( i_nb_msgs < 0 )
+    {
+        if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+            msg_Err( NULL, "couldn't read from network (%s)",
+                     strerror(errno) );
+        return;
     }
 
-    while ( i_len && *pp_current )
+    i_wallclock = mdate();
+    i_nb_batches++;
+    i_nb_datagrams += i_nb_msgs;
+
+    if ( i_nb_msgs && i_last_print + PRINT_REFRACTORY_PERIOD < i_wallclock )
     {
-        pp_current = &(*pp_current)->p_next;
-        i_len--;
+        i_last_print = i_wallclock;
+        udp_PrintSource( &p_batch_addrs[0],
+                         p_batch_msgs[0].msg_hdr.msg_namelen );
     }
 
-err:
-    block_DeleteChain( *pp_current );
+    for ( i_msg = 0; i_msg < i_nb_msgs; i_msg++ )
+    {
+        block_t **pp_blocks = &pp_batch_blocks[i_msg * i_block_cnt];
+        ssize_t i_len = p_batch_msgs[i_msg].msg_len;
+
+        if ( !b_udp )
+        {
+            if ( i_len < RTP_HEADER_SIZE )
+                continue;
+            udp_CheckRTP( pp_batch_rtp_hdrs[i_msg] );
+            i_len -= RTP_HEADER_SIZE;
+        }
+
+        i_len /= TS_SIZE;
+        if ( i_len > i_block_cnt )
+            i_len = i_block_cnt;
+
+        /* Hand the filled blocks over to the chain. */
+        for ( i_block = 0; i_block < i_len; i_block++ )
+        {
+            *pp_current = pp_blocks[i_block];
+            pp_current = &(*pp_current)->p_next;
+            pp_blocks[i_block] = NULL;
+        }
+    }
     *pp_current = NULL;
 
+    if ( p_ts != NULL )
+        udp_Lock( loop );
+
     demux_Run( p_ts );
 }
+#endif
 
 static void udp_MuteCb(struct ev_loop *loop, struct ev_timer *w, int revents)
 {
@@ -452,6 +662,26 @@ static void udp_MuteCb(struct ev_loop *loop, struct ev_timer *w, int revents)
     }
 }
 
+static void udp_PrintCb(struct ev_loop *loop, struct ev_timer *w, int revents)
+{
+    uint64_t i_avg = i_nb_batches ? i_nb_datagrams * 100 / i_nb_batches : 0;
+
+    switch (i_print_type) {
+    case PRINT_XML:
+        fprintf(print_fh,
+                "<STATUS type=\"udp_batch\" depth=\"%d\" batches=\"%"PRIu64"\" average=\"%"PRIu64".%02"PRIu64"\"/>\n",
+                i_batch, i_nb_batches, i_avg / 100, i_avg % 100);
+        break;
+    case PRINT_TEXT:
+        fprintf(print_fh, "udp batch: %"PRIu64".%02"PRIu64" datagrams per read (%"PRIu64" reads, depth %d)\n",
+                i_avg / 100, i_avg % 100, i_nb_batches, i_batch);
+        break;
+    default:
+        break;
+    }
+    i_nb_batches = i_nb_datagrams = 0;
+}
+
 /* From now on these are just stubs */
 
 /*****************************************************************************
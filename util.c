@@ -23,12 +23,15 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <string.h>
 #include <stdarg.h>
 #include <sys/time.h>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -43,16 +46,88 @@
 /*****************************************************************************
  * Local declarations
  *****************************************************************************/
-#define MAX_BLOCKS 500
 #define MAX_MSG 1024
 #define VERB_DBG  4
 #define VERB_INFO 3
 #define VERB_WARN 2
 #define VERB_ERR 1
 
+/* Blocks are carved out of a single arena, aligned on cache lines. The
+ * arena is handed out in address order, so that its pages are only faulted
+ * in when they are first needed, and released blocks are reused first. */
+#define BLOCK_ALIGN 64
+#define BLOCK_STRIDE ((sizeof(block_t) + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1))
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+static uint8_t *p_block_arena = NULL;
+static size_t i_block_arena_size = 0;
+static size_t i_block_arena_used = 0;
+static block_t *p_block_free = NULL;
+static block_stats_t block_stats;
+
+/* Blocks allocated beyond the arena are recycled up to a limit. */
+#define MAX_BLOCKS 500
 static block_t *p_block_lifo = NULL;
 static unsigned int i_block_count = 0;
 
+/* Shared buffers are recycled as long as their size does not change. */
+#define MAX_BUFFERS 64
+static block_buffer_t *p_buffer_free = NULL;
+static unsigned int i_buffer_count = 0;
+
+/* Blocks released by a worker thread, for the main thread to delete */
+static __thread block_t **pp_block_garbage = NULL;
+
+/*****************************************************************************
+ * block_Init: preallocates a pool of i_pool blocks
+ *****************************************************************************/
+void block_Init( unsigned int i_pool, bool b_hugepages, bool b_prefault )
+{
+    size_t i_page = b_hugepages ? HUGEPAGE_SIZE : sysconf( _SC_PAGESIZE );
+    size_t i_size = (i_pool * BLOCK_STRIDE + i_page - 1) / i_page * i_page;
+    void *p_arena = MAP_FAILED;
+
+    if ( !i_pool )
+        return;
+
+    if ( b_hugepages )
+    {
+#ifdef MAP_HUGETLB
+        p_arena = mmap( NULL, i_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+        if ( p_arena == MAP_FAILED )
+            msg_Warn( NULL, "couldn't allocate huge pages for blocks (%s)",
+                      strerror(errno) );
+#else
+        msg_Warn( NULL, "huge pages are unsupported on this platform" );
+#endif
+    }
+
+    if ( p_arena == MAP_FAILED )
+    {
+        p_arena = mmap( NULL, i_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if ( p_arena == MAP_FAILED )
+        {
+            msg_Err( NULL, "couldn't allocate block pool (%s)",
+                     strerror(errno) );
+            return;
+        }
+    }
+
+    if ( b_prefault )
+        memset( p_arena, 0, i_size );
+
+    p_block_arena = p_arena;
+    i_block_arena_size = i_size;
+    i_block_arena_used = 0;
+    block_stats.i_pool = i_size / BLOCK_STRIDE;
+
+    msg_Dbg( NULL, "allocated a pool of %u blocks (%zu kB%s)",
+             block_stats.i_pool, i_size / 1024,
+             b_prefault ? ", prefaulted" : "" );
+}
+
 /*****************************************************************************
  * block_New
  *****************************************************************************/
@@ -60,36 +135,186 @@ block_t *block_New( void )
 {
     block_t *p_block;
 
-    if (i_block_count)
+    if ( p_block_free != NULL )
+    {
+        p_block = p_block_free;
+        p_block_free = p_block->p_next;
+        block_stats.i_hits++;
+    }
+    else if ( i_block_arena_used + BLOCK_STRIDE <= i_block_arena_size )
+    {
+        p_block = (block_t *)(p_block_arena + i_block_arena_used);
+        i_block_arena_used += BLOCK_STRIDE;
+        block_stats.i_hits++;
+    }
+    else if ( i_block_count )
     {
         p_block = p_block_lifo;
         p_block_lifo = p_block->p_next;
         i_block_count--;
+        block_stats.i_hits++;
     }
     else
     {
         p_block = malloc(sizeof(block_t));
+        block_stats.i_misses++;
     }
 
+    if ( ++block_stats.i_used > block_stats.i_highwater )
+        block_stats.i_highwater = block_stats.i_used;
+
+    p_block->p_ts = p_block->p_data;
+    p_block->p_buffer = NULL;
     p_block->p_next = NULL;
     p_block->i_refcount = 1;
     return p_block;
 }
 
+/*****************************************************************************
+ * block_BufferNew: allocates a page-aligned buffer, with one reference
+ *****************************************************************************/
+block_buffer_t *block_BufferNew( size_t i_size )
+{
+    block_buffer_t *p_buffer;
+
+    while ( p_buffer_free != NULL && p_buffer_free->i_size != i_size )
+    {
+        /* The requested size changed, drop the old buffers. */
+        p_buffer = p_buffer_free;
+        p_buffer_free = p_buffer->p_next;
+        i_buffer_count--;
+        free( p_buffer->p_data );
+        free( p_buffer );
+    }
+
+    if ( p_buffer_free != NULL )
+    {
+        p_buffer = p_buffer_free;
+        p_buffer_free = p_buffer->p_next;
+        i_buffer_count--;
+    }
+    else
+    {
+        p_buffer = malloc( sizeof(block_buffer_t) );
+        if ( posix_memalign( (void **)&p_buffer->p_data,
+                             sysconf( _SC_PAGESIZE ), i_size ) )
+        {
+            free( p_buffer );
+            return NULL;
+        }
+        p_buffer->i_size = i_size;
+    }
+
+    p_buffer->p_next = NULL;
+    p_buffer->i_refcount = 1;
+    return p_buffer;
+}
+
+/*****************************************************************************
+ * block_BufferRelease
+ *****************************************************************************/
+void block_BufferRelease( block_buffer_t *p_buffer )
+{
+    if ( --p_buffer->i_refcount )
+        return;
+
+    if ( i_buffer_count >= MAX_BUFFERS )
+    {
+        free( p_buffer->p_data );
+        free( p_buffer );
+        return;
+    }
+
+    p_buffer->p_next = p_buffer_free;
+    p_buffer_free = p_buffer;
+    i_buffer_count++;
+}
+
+/*****************************************************************************
+ * block_NewView: returns a block whose packet lives in p_buffer at i_offset
+ *****************************************************************************/
+block_t *block_NewView( block_buffer_t *p_buffer, size_t i_offset )
+{
+    block_t *p_block = block_New();
+
+    p_block->p_ts = p_buffer->p_data + i_offset;
+    p_block->p_buffer = p_buffer;
+    p_buffer->i_refcount++;
+    return p_block;
+}
+
 /*****************************************************************************
  * block_Delete
  *****************************************************************************/
 void block_Delete( block_t *p_block )
 {
-    if (i_block_count >= MAX_BLOCKS )
+    block_stats.i_used--;
+
+    if ( p_block->p_buffer != NULL )
+        block_BufferRelease( p_block->p_buffer );
+
+    if ( (uint8_t *)p_block < p_block_arena ||
+         (uint8_t *)p_block >= p_block_arena + i_block_arena_size )
     {
-        free( p_block );
+        if ( i_block_count >= MAX_BLOCKS )
+        {
+            free( p_block );
+            return;
+        }
+        p_block->p_next = p_block_lifo;
+        p_block_lifo = p_block;
+        i_block_count++;
+        return;
+    }
+
+    p_block->p_next = p_block_free;
+    p_block_free = p_block;
+}
+
+/*****************************************************************************
+ * block_SetGarbage: from a thread other than the main thread, blocks released
+ * with block_Release() are pushed on *pp_garbage instead of being deleted
+ *****************************************************************************/
+void block_SetGarbage( block_t **pp_garbage )
+{
+    pp_block_garbage = pp_garbage;
+}
+
+/*****************************************************************************
+ * block_Release: drops a reference, from any thread
+ *****************************************************************************/
+void block_Release( block_t *p_block )
+{
+    if ( block_Unref( p_block ) )
+        return;
+
+    if ( pp_block_garbage == NULL )
+    {
+        block_Delete( p_block );
         return;
     }
 
-    p_block->p_next = p_block_lifo;
-    p_block_lifo = p_block;
-    i_block_count++;
+    p_block->p_next = __atomic_load_n( pp_block_garbage, __ATOMIC_RELAXED );
+    while ( !__atomic_compare_exchange_n( pp_block_garbage, &p_block->p_next,
+                                          p_block, true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED ) );
+}
+
+/*****************************************************************************
+ * block_Collect: deletes the blocks pushed on *pp_garbage (main thread)
+ *****************************************************************************/
+void block_Collect( block_t **pp_garbage )
+{
+    block_DeleteChain( __atomic_exchange_n( pp_garbage, NULL,
+                                            __ATOMIC_ACQUIRE ) );
+}
+
+/*****************************************************************************
+ * block_GetStats
+ *****************************************************************************/
+void block_GetStats( block_stats_t *p_stats )
+{
+    *p_stats = block_stats;
 }
 
 /*****************************************************************************
@@ -97,13 +322,35 @@ void block_Delete( block_t *p_block )
  *****************************************************************************/
 void block_Vacuum( void )
 {
-    while (i_block_count)
+    while ( p_buffer_free != NULL )
+    {
+        block_buffer_t *p_buffer = p_buffer_free;
+        p_buffer_free = p_buffer->p_next;
+        free( p_buffer->p_data );
+        free( p_buffer );
+    }
+    i_buffer_count = 0;
+
+    while ( i_block_count )
     {
         block_t *p_block = p_block_lifo;
         p_block_lifo = p_block->p_next;
-        free(p_block);
+        free( p_block );
         i_block_count--;
     }
+
+    if ( p_block_arena == NULL )
+        return;
+
+    msg_Dbg( NULL, "block pool: %"PRIu64" hits, %"PRIu64" misses, high-water %u/%u",
+             block_stats.i_hits, block_stats.i_misses,
+             block_stats.i_highwater, block_stats.i_pool );
+
+    munmap( p_block_arena, i_block_arena_size );
+    p_block_arena = NULL;
+    i_block_arena_size = 0;
+    i_block_arena_used = 0;
+    p_block_free = NULL;
 }
 
 /*****************************************************************************
@@ -292,11 +539,25 @@ int dvb_string_cmp(const dvb_string_t *p_1, const dvb_string_t *p_2)
     return memcmp(p_1->p, p_2->p, p_1->i);
 }
 
+/*****************************************************************************
+ * mdate_Force: makes mdate() return i_date instead of the system clock, so
+ * that a file can be replayed faster than real time (-1 restores the clock)
+ *****************************************************************************/
+static mtime_t i_forced_date = -1;
+
+void mdate_Force( mtime_t i_date )
+{
+    i_forced_date = i_date;
+}
+
 /*****************************************************************************
  * mdate
  *****************************************************************************/
 mtime_t mdate( void )
 {
+    if ( i_forced_date != -1 )
+        return i_forced_date;
+
 #if defined (HAVE_CLOCK_NANOSLEEP)
     struct timespec ts;
 